@@ -0,0 +1,241 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <disk.h>
+
+#define fs_make_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_make_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Default upper bound on the data block count, same as the reference tool */
+#define DATA_BLOCK_MAX 8192
+
+/* FAT entries are 16 bits and 0xffff marks the end of a chain */
+#define FAT_EOC 0xffff
+
+/* The root directory holds 128 entries of 32 bytes */
+#define ROOT_SIZE 4096
+
+/* On-disk superblock, must match struct Superblock in libfs/fs.c */
+struct __attribute__((__packed__)) superblock {
+	char signature[8];
+	uint16_t block_count;
+	uint16_t rdir_blk;
+	uint16_t data_blk;
+	uint16_t data_blk_count;
+	uint16_t fat_blk_count;
+	uint16_t reserved_blk_count;
+	/* Metadata table heads, generation and features, kept by libfs */
+	uint8_t libfs[21];
+	uint8_t block_shift;
+	uint16_t journal_blocks;
+	uint32_t journal_seq;
+	/* Log head, kept by libfs */
+	uint16_t log_head;
+	uint8_t padding[BLOCK_SIZE - 50];
+};
+
+void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-x] [-r <reserved blocks>] [-p] "
+		"[-b <block size>] [-s <stripe unit>] [-j <journal blocks>] "
+		"<diskname> <data block count>\n",
+		program);
+	fprintf(stderr, "\t-x\tallow more than %d data blocks\n", DATA_BLOCK_MAX);
+	fprintf(stderr, "\t-r\tleave blocks free between the root directory "
+		"and the data region\n");
+	fprintf(stderr, "\t-p\tallocate the data region on the host instead "
+		"of leaving it sparse\n");
+	fprintf(stderr, "\t-b\tblock size in bytes, a power of two from %d to "
+		"%d (default %d)\n", BLOCK_SIZE_MIN, BLOCK_SIZE_MAX, BLOCK_SIZE);
+	fprintf(stderr, "\t-j\tkeep a metadata journal in this many blocks, "
+		"taken before the reserved blocks\n");
+	fprintf(stderr, "\t-s\tstripe the disk across the comma-separated "
+		"images of <diskname>, in units of this many bytes\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char *program = argv[0];
+	char *diskname;
+	long data_count, reserved = 0, journal = 0, max_count = DATA_BLOCK_MAX;
+	size_t fat_count, root_count, total, block_size = BLOCK_SIZE;
+	size_t stripe = 0, member_size;
+	int prealloc = 0, shift = 0, members = 1;
+	int opt, fd;
+	char *images, *image, *save, *name;
+	struct superblock sb;
+	uint16_t *fat;
+	char *block;
+
+	while ((opt = getopt(argc, argv, "xr:pb:s:j:")) != -1) {
+		switch (opt) {
+		case 'x':
+			/* Only limited by the 16-bit block count of the superblock */
+			max_count = FAT_EOC - 1;
+			break;
+		case 'r':
+			reserved = strtol(optarg, NULL, 0);
+			if (reserved < 0 || reserved > FAT_EOC)
+				die("reserved block count invalid");
+			break;
+		case 'p':
+			prealloc = 1;
+			break;
+		case 'b':
+			block_size = strtol(optarg, NULL, 0);
+			if (block_size < BLOCK_SIZE_MIN || block_size > BLOCK_SIZE_MAX ||
+			    (block_size & (block_size - 1)))
+				die("block size invalid, power of two in [%d, %d]",
+				    BLOCK_SIZE_MIN, BLOCK_SIZE_MAX);
+			break;
+		case 'j':
+			journal = strtol(optarg, NULL, 0);
+			if (journal < 1 || journal > FAT_EOC)
+				die("journal block count invalid");
+			break;
+		case 's':
+			stripe = strtol(optarg, NULL, 0);
+			if (!stripe || stripe % BLOCK_SIZE_MIN)
+				die("stripe unit invalid, multiple of %d",
+				    BLOCK_SIZE_MIN);
+			break;
+		default:
+			usage(program);
+		}
+	}
+
+	if (argc - optind < 2)
+		die("Usage: <diskname> <data block count>");
+
+	/* The journal is the first part of the reserved blocks */
+	reserved += journal;
+	if (reserved > FAT_EOC)
+		die("reserved block count invalid");
+
+	diskname = argv[optind];
+	data_count = strtol(argv[optind + 1], NULL, 0);
+	if (data_count < 1 || data_count > max_count)
+		die("data block count invalid, range is [1, %ld]", max_count);
+
+	if (stripe)
+		for (char *c = diskname; *c; c++)
+			members += *c == ',';
+
+	/* A striped disk only uses whole stripes, the data region fills them */
+	for (;;) {
+		fat_count = (data_count * 2 + block_size - 1) / block_size;
+		root_count = (ROOT_SIZE + block_size - 1) / block_size;
+		total = 1 + fat_count + root_count + reserved + data_count;
+		if (!stripe || total * block_size % (stripe * members) == 0)
+			break;
+		data_count++;
+	}
+	if (total > FAT_EOC || data_count > max_count)
+		die("disk too large, %zu blocks (max %d)", total, FAT_EOC);
+
+	/* A transaction may hold every FAT and root block and the superblock */
+	if (journal && (size_t)journal < fat_count + root_count + 2)
+		die("journal block count invalid, at least %zu",
+		    fat_count + root_count + 2);
+	member_size = total * block_size / members;
+
+	/*
+	 * Size the images with ftruncate so the data region stays a hole, then
+	 * only the metadata blocks are ever written. With -p the space is
+	 * allocated up front, still without writing zeros.
+	 */
+	images = strdup(diskname);
+	if (!images)
+		die("Cannot create virtual disk");
+	for (image = strtok_r(images, stripe ? "," : "", &save); image;
+	     image = strtok_r(NULL, stripe ? "," : "", &save)) {
+		fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			die_perror("open");
+		if (ftruncate(fd, member_size))
+			die_perror("ftruncate");
+		if (prealloc && posix_fallocate(fd, 0, member_size))
+			die("Cannot allocate virtual disk");
+		close(fd);
+	}
+	free(images);
+
+	/* The images are formatted through the driver that will mount them */
+	if (stripe) {
+		name = malloc(strlen(diskname) + 32);
+		if (!name)
+			die("Cannot create virtual disk");
+		sprintf(name, "raid0:%zu:%s", stripe, diskname);
+	} else {
+		name = diskname;
+	}
+	if (block_disk_open(name) || block_disk_set_block_size(block_size))
+		die("Cannot create virtual disk");
+	block = calloc(1, block_size);
+	if (!block)
+		die("Cannot create virtual disk");
+	fat = (uint16_t *)block;
+
+	/* The default block size is recorded as 0, same as volumes made before -b */
+	if (block_size != BLOCK_SIZE)
+		while (((size_t)1 << shift) < block_size)
+			shift++;
+
+	memset(&sb, 0, sizeof(sb));
+	memcpy(sb.signature, "ECS150FS", 8);
+	sb.block_count = total;
+	sb.fat_blk_count = fat_count;
+	sb.rdir_blk = 1 + fat_count;
+	sb.reserved_blk_count = reserved;
+	sb.data_blk = sb.rdir_blk + root_count + reserved;
+	sb.data_blk_count = data_count;
+	sb.block_shift = shift;
+	sb.journal_blocks = journal;
+	/* Small blocks only hold the start of the superblock, the rest is padding */
+	memcpy(block, &sb, sizeof(sb) < block_size ? sizeof(sb) : block_size);
+	if (block_write(0, block))
+		die("Cannot create virtual disk");
+
+	/* Entry 0 of the FAT is never handed out */
+	memset(block, 0, block_size);
+	fat[0] = FAT_EOC;
+	for (size_t i = 0; i < fat_count; i++) {
+		if (block_write(1 + i, fat))
+			die("Cannot create virtual disk");
+		fat[0] = 0;
+	}
+
+	memset(block, 0, block_size);
+	for (size_t i = 0; i < root_count; i++)
+		if (block_write(sb.rdir_blk + i, block))
+			die("Cannot create virtual disk");
+
+	free(block);
+	block_disk_close();
+
+	printf("Created virtual disk '%s' with '%ld' data blocks\n", name,
+	       data_count);
+	if (name != diskname)
+		free(name);
+
+	return 0;
+}
@@ -1,6 +1,9 @@
 #include <assert.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +12,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <disk.h>
 #include <fs.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -34,6 +38,14 @@ struct thread_arg {
 	char **argv;
 };
 
+size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX)
+		die_perror("strtol");
+	return (size_t)ret;
+}
+
 void thread_fs_script(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -152,6 +164,65 @@ void thread_fs_script(void *arg)
 				printf("SEEK successful.\n");
 			}
 
+		} else if (strcmp(command, "TRUNCATE") == 0) {
+			offset = atoi(command_args[1]);
+
+			if (fs_truncate(fs_fd, offset)) {
+				fs_umount();
+				die("Cannot truncate file");
+			} else {
+				printf("TRUNCATE successful.\n");
+			}
+
+		} else if (strcmp(command, "CLONE") == 0) {
+			if (fs_clone(command_args[1], command_args[2])) {
+				fs_umount();
+				die("Cannot clone file");
+			}
+
+			printf("CLONE successful.\n");
+
+		} else if (strcmp(command, "SNAPSHOT") == 0) {
+			int id = fs_snapshot_create();
+
+			if (id < 0) {
+				fs_umount();
+				die("Cannot create snapshot");
+			}
+
+			printf("SNAPSHOT %d successful.\n", id);
+
+		} else if (strcmp(command, "RESTORE") == 0) {
+			if (fs_snapshot_clone(atoi(command_args[1]), command_args[2],
+								  command_args[3])) {
+				fs_umount();
+				die("Cannot restore file");
+			}
+
+			printf("RESTORE successful.\n");
+
+		} else if (strcmp(command, "COMPRESS") == 0) {
+			if (fs_compress(fs_fd, atoi(command_args[1]))) {
+				fs_umount();
+				die("Cannot change compression");
+			}
+
+			printf("COMPRESS successful.\n");
+
+		} else if (strcmp(command, "SYNC") == 0) {
+			if (fs_sync()) {
+				fs_umount();
+				die("Cannot sync");
+			}
+
+			printf("SYNC successful.\n");
+
+		} else if (strcmp(command, "CRASH") == 0) {
+			/* Stop dead as a power cut would, without unmounting */
+			printf("CRASH\n");
+			fflush(stdout);
+			_exit(0);
+
 		} else if (strcmp(command, "WRITE") == 0) {
 			data_source = command_args[1];
 			data_description = command_args[2];
@@ -270,11 +341,195 @@ void thread_fs_script(void *arg)
 }
 
 void thread_fs_stat(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	const char *filename;
+	struct fs_dirent ent;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_stat_by_name(&filename, &ent, 1) != 1) {
+		fs_umount();
+		die("Cannot stat file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	if (!ent.size) {
+		/* Nothing to read, file is empty */
+		printf("Empty file\n");
+		return;
+	}
+
+	printf("Size of file '%s' is %zu bytes\n", filename, ent.size);
+}
+
+/* Size of each of the two buffers used by the streaming commands */
+#define STREAM_BUF_SIZE (64 * 1024)
+
+/* Fill or drain up to @len bytes of @buf, returns the number of bytes handled
+ * (0 at the end of the data) or -1 on error */
+typedef ssize_t (*stream_fn)(void *ctx, char *buf, size_t len);
+
+/*
+ * Two fixed buffers handed back and forth between a filler thread and the
+ * draining caller, so that reading the next chunk overlaps with writing the
+ * previous one and memory use does not depend on the file size.
+ */
+struct stream {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *buf[2];
+	ssize_t len[2];
+	char full[2];
+	char abort;
+	stream_fn fill;
+	void *fill_ctx;
+};
+
+static void *stream_filler(void *arg)
+{
+	struct stream *s = arg;
+	ssize_t n;
+	int i = 0;
+
+	do {
+		pthread_mutex_lock(&s->lock);
+		while (s->full[i] && !s->abort)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (s->abort) {
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		n = s->fill(s->fill_ctx, s->buf[i], STREAM_BUF_SIZE);
+
+		pthread_mutex_lock(&s->lock);
+		s->len[i] = n;
+		s->full[i] = 1;
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		i ^= 1;
+	} while (n > 0);
+
+	return NULL;
+}
+
+/* Move everything @fill produces to @drain, returns the number of bytes
+ * drained or -1 if @fill failed */
+static ssize_t stream_copy(stream_fn fill, void *fill_ctx,
+			   stream_fn drain, void *drain_ctx)
+{
+	struct stream s;
+	pthread_t filler;
+	ssize_t total = 0, n, drained;
+	int i = 0;
+
+	memset(&s, 0, sizeof(s));
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.cond, NULL);
+	s.buf[0] = malloc(STREAM_BUF_SIZE);
+	s.buf[1] = malloc(STREAM_BUF_SIZE);
+	if (!s.buf[0] || !s.buf[1])
+		die_perror("malloc");
+	s.fill = fill;
+	s.fill_ctx = fill_ctx;
+
+	pthread_create(&filler, NULL, stream_filler, &s);
+
+	while (1) {
+		pthread_mutex_lock(&s.lock);
+		while (!s.full[i])
+			pthread_cond_wait(&s.cond, &s.lock);
+		n = s.len[i];
+		pthread_mutex_unlock(&s.lock);
+
+		if (n <= 0) {
+			if (n < 0)
+				total = -1;
+			break;
+		}
+
+		drained = drain(drain_ctx, s.buf[i], n);
+		if (drained > 0)
+			total += drained;
+		if (drained < n)
+			break;
+
+		pthread_mutex_lock(&s.lock);
+		s.full[i] = 0;
+		pthread_cond_signal(&s.cond);
+		pthread_mutex_unlock(&s.lock);
+		i ^= 1;
+	}
+
+	/* Stop the filler if we quit before it reached the end */
+	pthread_mutex_lock(&s.lock);
+	s.abort = 1;
+	pthread_cond_signal(&s.cond);
+	pthread_mutex_unlock(&s.lock);
+	pthread_join(filler, NULL);
+
+	free(s.buf[0]);
+	free(s.buf[1]);
+	return total;
+}
+
+static ssize_t stream_fs_read(void *ctx, char *buf, size_t len)
+{
+	return fs_read(*(int *)ctx, buf, len);
+}
+
+static ssize_t stream_fs_write(void *ctx, char *buf, size_t len)
+{
+	return fs_write(*(int *)ctx, buf, len);
+}
+
+static ssize_t stream_host_read(void *ctx, char *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = read(*(int *)ctx, buf + done, len - done);
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+static ssize_t stream_host_write(void *ctx, char *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = write(*(int *)ctx, buf + done, len - done);
+		if (n < 0)
+			return done ? (ssize_t)done : -1;
+		done += n;
+	}
+	return done;
+}
+
+void thread_fs_cat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname, *filename;
-	int fs_fd;
+	int fs_fd, out_fd = STDOUT_FILENO;
 	int stat;
+	ssize_t read;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -293,18 +548,24 @@ void thread_fs_stat(void *arg)
 
 	stat = fs_stat(fs_fd);
 	if (stat < 0) {
-		fs_close(fs_fd);
 		fs_umount();
 		die("Cannot stat file");
 	}
 	if (!stat) {
+		/* Nothing to read, file is empty */
 		fs_close(fs_fd);
 		fs_umount();
-		/* Nothing to read, file is empty */
 		printf("Empty file\n");
 		return;
 	}
 
+	/* The content is streamed, a short read is reported once it is over */
+	printf("Read file '%s' (%d/%d bytes)\n", filename, stat, stat);
+	printf("Content of the file:\n");
+	fflush(stdout);
+
+	read = stream_copy(stream_fs_read, &fs_fd, stream_host_write, &out_fd);
+
 	if (fs_close(fs_fd)) {
 		fs_umount();
 		die("Cannot close file");
@@ -313,21 +574,29 @@ void thread_fs_stat(void *arg)
 	if (fs_umount())
 		die("cannot unmount diskname");
 
-	printf("Size of file '%s' is %d bytes\n", filename, stat);
+	if (read != stat)
+		die("Short read (%zd/%d bytes)", read, stat);
 }
 
-void thread_fs_cat(void *arg)
+void thread_fs_export(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
-	int fs_fd;
-	int stat, read;
+	char *diskname, *filename, *hostname;
+	int fs_fd, fd;
+	int stat;
+	ssize_t read;
 
-	if (t_arg->argc < 2)
-		die("need <diskname> <filename>");
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <filename> <host filename>");
 
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
+	hostname = t_arg->argv[2];
+
+	/* Create file on host computer */
+	fd = open(hostname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die_perror("open");
 
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
@@ -339,23 +608,7 @@ void thread_fs_cat(void *arg)
 	}
 
 	stat = fs_stat(fs_fd);
-	if (stat < 0) {
-		fs_umount();
-		die("Cannot stat file");
-	}
-	if (!stat) {
-		/* Nothing to read, file is empty */
-		printf("Empty file\n");
-		return;
-	}
-	buf = malloc(stat);
-	if (!buf) {
-		perror("malloc");
-		fs_umount();
-		die("Cannot malloc");
-	}
-
-	read = fs_read(fs_fd, buf, stat);
+	read = stream_copy(stream_fs_read, &fs_fd, stream_host_write, &fd);
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
@@ -363,14 +616,11 @@ void thread_fs_cat(void *arg)
 	}
 
 	if (fs_umount())
-		die("cannot unmount diskname");
-
-	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
-	printf("Content of the file:\n");
-	fwrite(buf, 1, stat, stdout);
-	fflush(stdout);
+		die("Cannot unmount diskname");
 
-	free(buf);
+	close(fd);
+	printf("Exported file '%s' to '%s' (%zd/%d bytes)\n", filename,
+		   hostname, read, stat);
 }
 
 void thread_fs_rm(void *arg)
@@ -398,13 +648,74 @@ void thread_fs_rm(void *arg)
 	printf("Removed file '%s'\n", filename);
 }
 
+void thread_fs_clone(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <source filename> <new filename>");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_clone(src, dst)) {
+		fs_umount();
+		die("Cannot clone file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Cloned file '%s' to '%s'\n", src, dst);
+}
+
+void thread_fs_compress(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	int enable = 1, fd;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename> [off]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	if (t_arg->argc > 2 && !strcmp(t_arg->argv[2], "off"))
+		enable = 0;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fd = fs_open(filename);
+	if (fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+	if (fs_compress(fd, enable)) {
+		fs_close(fd);
+		fs_umount();
+		die("Cannot change compression");
+	}
+	fs_close(fd);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Compression of '%s' %s\n", filename, enable ? "on" : "off");
+}
+
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename;
 	int fd, fs_fd;
 	struct stat st;
-	int written;
+	ssize_t written;
 
 	if (t_arg->argc < 2)
 		die("Usage: <diskname> <host filename>");
@@ -421,13 +732,8 @@ void thread_fs_add(void *arg)
 	if (!S_ISREG(st.st_mode))
 		die("Not a regular file: %s\n", filename);
 
-	/* Map file into buffer */
-	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!buf)
-		die_perror("mmap");
-
 	/* Now, deal with our filesystem:
-	 * - mount, create a new file, copy content of host file into this new
+	 * - mount, create a new file, stream content of host file into this new
 	 *   file, close the new file, and umount
 	 */
 	if (fs_mount(diskname))
@@ -444,7 +750,8 @@ void thread_fs_add(void *arg)
 		die("Cannot open file");
 	}
 
-	written = fs_write(fs_fd, buf, st.st_size);
+	fs_reserve(fs_fd, st.st_size);
+	written = stream_copy(stream_host_read, &fd, stream_fs_write, &fs_fd);
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
@@ -454,13 +761,529 @@ void thread_fs_add(void *arg)
 	if (fs_umount())
 		die("Cannot unmount diskname");
 
-	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
+	printf("Wrote file '%s' (%zd/%zu bytes)\n", filename, written,
 		   st.st_size);
 
-	munmap(buf, st.st_size);
 	close(fd);
 }
 
+/*
+ * Piece of a host file read by an import reader thread, waiting to be
+ * written. Each file is read by a single reader, so its pieces arrive in
+ * order, the first one carrying the size of the file and the last one
+ * closing it.
+ */
+struct import_chunk {
+	int file;
+	/* STREAM_BUF_SIZE bytes, NULL if the host file could not be read */
+	char *data;
+	size_t len;
+	size_t size;
+	char first;
+	char last;
+};
+
+/* Bounded pipeline between the import reader threads and the writer */
+struct import_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct import_chunk *slots;
+	int capacity;
+	int head;
+	int count;
+
+	/* Host files still to be read, shared by the readers */
+	const char *dirname;
+	char **names;
+	int name_count;
+	int next_name;
+	int readers_left;
+};
+
+static void import_push(struct import_queue *q, struct import_chunk *chunk)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == q->capacity)
+		pthread_cond_wait(&q->not_full, &q->lock);
+	q->slots[(q->head + q->count) % q->capacity] = *chunk;
+	q->count++;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Hand the content of host file @path over in pieces of STREAM_BUF_SIZE */
+static void import_read_host(struct import_queue *q, int file, const char *path)
+{
+	struct import_chunk chunk = { .file = file, .first = 1 };
+	struct stat st;
+	size_t done = 0;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		chunk.last = 1;
+		import_push(q, &chunk);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	chunk.size = st.st_size;
+
+	while (!chunk.last) {
+		ssize_t n;
+
+		chunk.data = malloc(STREAM_BUF_SIZE);
+		if (!chunk.data)
+			die_perror("malloc");
+		n = stream_host_read(&fd, chunk.data, STREAM_BUF_SIZE);
+		if (n < 0) {
+			free(chunk.data);
+			chunk.data = NULL;
+			n = 0;
+		}
+		chunk.len = n;
+		done += n;
+		chunk.last = !chunk.data || n < STREAM_BUF_SIZE ||
+			done >= chunk.size;
+		import_push(q, &chunk);
+		chunk.first = 0;
+	}
+	close(fd);
+}
+
+static void *import_reader(void *arg)
+{
+	struct import_queue *q = arg;
+	char path[PATH_MAX];
+
+	while (1) {
+		int i;
+
+		pthread_mutex_lock(&q->lock);
+		i = q->next_name < q->name_count ? q->next_name++ : -1;
+		pthread_mutex_unlock(&q->lock);
+		if (i < 0)
+			break;
+
+		snprintf(path, sizeof(path), "%s/%s", q->dirname, q->names[i]);
+		import_read_host(q, i, path);
+	}
+
+	pthread_mutex_lock(&q->lock);
+	q->readers_left--;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+	return NULL;
+}
+
+/* Regular files of @dirname whose names fit in the root directory */
+static int import_list_host(const char *dirname, char ***names)
+{
+	DIR *dir;
+	struct dirent *d;
+	char path[PATH_MAX];
+	struct stat st;
+	int count = 0, size = 16;
+
+	dir = opendir(dirname);
+	if (!dir)
+		die_perror("opendir");
+
+	*names = malloc(size * sizeof(char *));
+	while ((d = readdir(dir)) != NULL) {
+		snprintf(path, sizeof(path), "%s/%s", dirname, d->d_name);
+		if (stat(path, &st) || !S_ISREG(st.st_mode))
+			continue;
+		if (strlen(d->d_name) >= FS_FILENAME_LEN) {
+			test_fs_error("skipping '%s': name too long", d->d_name);
+			continue;
+		}
+		if (count == size) {
+			size *= 2;
+			*names = realloc(*names, size * sizeof(char *));
+		}
+		(*names)[count++] = strdup(d->d_name);
+	}
+	closedir(dir);
+
+	return count;
+}
+
+void thread_fs_import(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	struct import_queue q;
+	pthread_t *readers;
+	int nreaders = 4;
+	int imported = 0, failed = 0;
+	size_t total = 0;
+	/* fs file descriptor of each host file and bytes written to it */
+	int *fs_fds;
+	size_t *written;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host directory> [<reader threads>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 2)
+		nreaders = get_argv(t_arg->argv[2]);
+	if (nreaders < 1)
+		die("Need at least one reader thread");
+
+	memset(&q, 0, sizeof(q));
+	q.dirname = t_arg->argv[1];
+	q.name_count = import_list_host(q.dirname, &q.names);
+	q.capacity = 2 * nreaders;
+	q.slots = malloc(q.capacity * sizeof(struct import_chunk));
+	q.readers_left = nreaders;
+	fs_fds = malloc(q.name_count * sizeof(int));
+	written = malloc(q.name_count * sizeof(size_t));
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.not_empty, NULL);
+	pthread_cond_init(&q.not_full, NULL);
+
+	/* Mount once for the whole directory, metadata is flushed at umount */
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	readers = malloc(nreaders * sizeof(pthread_t));
+	for (int i = 0; i < nreaders; i++)
+		pthread_create(&readers[i], NULL, import_reader, &q);
+
+	/* Write the pieces as the readers hand them over, one file open per reader */
+	while (1) {
+		struct import_chunk chunk;
+		char *name;
+		int fs_fd;
+
+		pthread_mutex_lock(&q.lock);
+		while (q.count == 0 && q.readers_left > 0)
+			pthread_cond_wait(&q.not_empty, &q.lock);
+		if (q.count == 0) {
+			pthread_mutex_unlock(&q.lock);
+			break;
+		}
+		chunk = q.slots[q.head];
+		q.head = (q.head + 1) % q.capacity;
+		q.count--;
+		pthread_cond_signal(&q.not_full);
+		pthread_mutex_unlock(&q.lock);
+
+		name = q.names[chunk.file];
+		if (!chunk.data) {
+			/* The reader gave up on this file, it ends here */
+			test_fs_error("Cannot read host file '%s'", name);
+			if (!chunk.first && fs_fds[chunk.file] >= 0)
+				fs_close(fs_fds[chunk.file]);
+			failed++;
+			continue;
+		}
+
+		if (chunk.first) {
+			written[chunk.file] = 0;
+			if (fs_create(name) ||
+			    (fs_fds[chunk.file] = fs_open(name)) < 0) {
+				test_fs_error("Cannot create file '%s'", name);
+				fs_fds[chunk.file] = -1;
+			} else {
+				/* Allocate the whole file up front, in as few runs as possible */
+				fs_reserve(fs_fds[chunk.file], chunk.size);
+			}
+		}
+
+		fs_fd = fs_fds[chunk.file];
+		if (fs_fd >= 0 && chunk.len) {
+			int n = fs_write(fs_fd, chunk.data, chunk.len);
+
+			if (n > 0)
+				written[chunk.file] += n;
+		}
+		free(chunk.data);
+		if (!chunk.last)
+			continue;
+
+		if (fs_fd < 0) {
+			failed++;
+			continue;
+		}
+		fs_close(fs_fd);
+
+		printf("Wrote file '%s' (%zu/%zu bytes)\n", name,
+		       written[chunk.file], chunk.size);
+		imported++;
+		total += written[chunk.file];
+	}
+
+	for (int i = 0; i < nreaders; i++)
+		pthread_join(readers[i], NULL);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Imported %d files (%zu bytes), %d failed\n", imported, total,
+		   failed);
+
+	for (int i = 0; i < q.name_count; i++)
+		free(q.names[i]);
+	free(q.names);
+	free(q.slots);
+	free(fs_fds);
+	free(written);
+	free(readers);
+}
+
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	unsigned int budget = 0;
+	int ret, moved;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<budget in ms>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		budget = get_argv(t_arg->argv[1]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	ret = fs_defrag(budget, &moved);
+	if (ret < 0) {
+		fs_umount();
+		die("Cannot defragment");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Moved %d files%s\n", moved,
+		   ret ? ", budget exhausted before the pass was over" : "");
+}
+
+void thread_fs_dedup(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int enable = 1, freed;
+
+	if (t_arg->argc < 1)
+		die("need <diskname> [off]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1 && !strcmp(t_arg->argv[1], "off"))
+		enable = 0;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	freed = fs_dedup(enable);
+	if (freed < 0) {
+		fs_umount();
+		die("Cannot change deduplication");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (enable)
+		printf("Deduplication on, freed %d blocks\n", freed);
+	else
+		printf("Deduplication off\n");
+}
+
+void thread_fs_verify(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	struct fs_check_report report;
+	int nthreads = 0, repair = 0;
+	int problems;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<threads>] [repair]");
+
+	diskname = t_arg->argv[0];
+	for (int i = 1; i < t_arg->argc; i++) {
+		if (!strcmp(t_arg->argv[i], "repair"))
+			repair = 1;
+		else
+			nthreads = get_argv(t_arg->argv[i]);
+	}
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_check(&report, nthreads, repair)) {
+		fs_umount();
+		die("Cannot check file system");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	problems = report.bad_links + report.cross_linked +
+		report.size_mismatch + report.leaked_blocks + report.bad_refcounts;
+
+	printf("FS Verify:\nfiles=%d\nbad_links=%d\ncross_linked=%d\n"
+		   "size_mismatch=%d\nleaked_blocks=%d\nbad_refcounts=%d\n",
+		   report.files_checked, report.bad_links, report.cross_linked,
+		   report.size_mismatch, report.leaked_blocks, report.bad_refcounts);
+	if (repair && problems)
+		printf("repaired=%d\n", report.repaired);
+
+	if (problems && !repair)
+		exit(1);
+}
+
+/*
+ * A snapshot delta starts with the volume's block size, then holds a record
+ * per block: its number on the virtual disk, then its data
+ */
+static void snapshot_export(int from, int to, char *deltaname)
+{
+	struct fs_statfs info;
+	uint32_t block_size, block;
+	char *data;
+	size_t *blocks;
+	int count, delta_fd;
+
+	count = fs_snapshot_diff(from, to, NULL, 0);
+	if (count < 0 || fs_statfs(&info)) {
+		fs_umount();
+		die("Cannot compare snapshots");
+	}
+	block_size = info.block_size;
+	blocks = malloc(sizeof(size_t) * (count ? count : 1));
+	data = malloc(block_size);
+	if (!blocks || !data || fs_snapshot_diff(from, to, blocks, count) != count) {
+		fs_umount();
+		die("Cannot compare snapshots");
+	}
+
+	/* Nothing has been written since the mount, the disk is current */
+	delta_fd = open(deltaname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (delta_fd < 0)
+		die_perror("open");
+
+	if (write(delta_fd, &block_size, sizeof(block_size)) != sizeof(block_size))
+		die_perror("write");
+	for (int i = 0; i < count; i++) {
+		block = blocks[i];
+		if (block_read(block, data))
+			die("Cannot read block %u", block);
+		if (write(delta_fd, &block, sizeof(block)) != sizeof(block) ||
+		    write(delta_fd, data, block_size) != block_size)
+			die_perror("write");
+	}
+
+	close(delta_fd);
+	free(data);
+	free(blocks);
+	printf("Exported %d blocks to '%s'\n", count, deltaname);
+}
+
+static void snapshot_apply(char *diskname, char *deltaname)
+{
+	uint32_t block_size, block;
+	char *data;
+	int delta_fd, count = 0;
+	ssize_t n;
+
+	if (block_disk_open(diskname))
+		die("Cannot open diskname");
+	delta_fd = open(deltaname, O_RDONLY);
+	if (delta_fd < 0)
+		die_perror("open");
+
+	if (read(delta_fd, &block_size, sizeof(block_size)) != sizeof(block_size) ||
+	    block_size == 0)
+		die("Truncated delta file");
+	if (block_disk_set_block_size(block_size))
+		die("Invalid block size %u", block_size);
+	data = malloc(block_size);
+	if (!data)
+		die("Out of memory");
+
+	while ((n = read(delta_fd, &block, sizeof(block))) == sizeof(block)) {
+		if (read(delta_fd, data, block_size) != block_size)
+			die("Truncated delta file");
+		if (block_write(block, data))
+			die("Cannot write block %u", block);
+		count++;
+	}
+	if (n != 0)
+		die("Truncated delta file");
+
+	close(delta_fd);
+	if (block_disk_flush() || block_disk_close())
+		die("Cannot close diskname");
+	free(data);
+	printf("Applied %d blocks from '%s'\n", count, deltaname);
+}
+
+void thread_fs_snapshot(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *cmd;
+	int ret = 0;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> create | list | delete <id> | "
+			"restore <id> <filename> <new filename> | "
+			"export <from id> <to id> <delta file> | apply <delta file>");
+
+	diskname = t_arg->argv[0];
+	cmd = t_arg->argv[1];
+
+	/* A delta is applied to a backup image, which is not mounted */
+	if (!strcmp(cmd, "apply")) {
+		if (t_arg->argc < 3)
+			die("need <diskname> apply <delta file>");
+		snapshot_apply(diskname, t_arg->argv[2]);
+		return;
+	}
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (!strcmp(cmd, "create")) {
+		ret = fs_snapshot_create();
+		if (ret >= 0)
+			printf("Created snapshot %d\n", ret);
+	} else if (!strcmp(cmd, "list")) {
+		int count = fs_snapshot_list(NULL, 0);
+		int *ids = malloc(sizeof(int) * (count > 0 ? count : 1));
+		ret = ids ? fs_snapshot_list(ids, count) : -1;
+		for (int i = 0; i < ret; i++)
+			printf("%d\n", ids[i]);
+		free(ids);
+	} else if (!strcmp(cmd, "delete") && t_arg->argc > 2) {
+		ret = fs_snapshot_delete(get_argv(t_arg->argv[2]));
+	} else if (!strcmp(cmd, "restore") && t_arg->argc > 4) {
+		ret = fs_snapshot_clone(get_argv(t_arg->argv[2]), t_arg->argv[3],
+								t_arg->argv[4]);
+	} else if (!strcmp(cmd, "export") && t_arg->argc > 4) {
+		/* -1 stands for every block, or for the whole volume */
+		snapshot_export(get_argv(t_arg->argv[2]),
+						get_argv(t_arg->argv[3]), t_arg->argv[4]);
+	} else {
+		fs_umount();
+		die("Unknown snapshot command '%s'", cmd);
+	}
+
+	if (ret < 0) {
+		fs_umount();
+		die("Snapshot command '%s' failed", cmd);
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -499,12 +1322,61 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
-size_t get_argv(char *argv)
+void thread_fs_log(void *arg)
 {
-	long int ret = strtol(argv, NULL, 0);
-	if (ret == LONG_MIN || ret == LONG_MAX)
-		die_perror("strtol");
-	return (size_t)ret;
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int enable = 1;
+
+	if (t_arg->argc < 1)
+		die("need <diskname> [off]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1 && !strcmp(t_arg->argv[1], "off"))
+		enable = 0;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_log(enable)) {
+		fs_umount();
+		die("Cannot change log mode");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Log mode %s\n", enable ? "on" : "off");
+}
+
+void thread_fs_clean(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	unsigned int budget = 0;
+	int ret, freed;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<budget in ms>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		budget = get_argv(t_arg->argv[1]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	ret = fs_clean(budget, &freed);
+	if (ret < 0) {
+		fs_umount();
+		die("Cannot clean, is the volume in log mode?");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Freed %d segments%s\n", freed,
+		   ret ? ", budget exhausted before the pass was over" : "");
 }
 
 static struct {
@@ -514,9 +1386,19 @@ static struct {
 	{ "info",	thread_fs_info },
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
+	{ "import",	thread_fs_import },
 	{ "rm",		thread_fs_rm },
+	{ "clone",	thread_fs_clone },
+	{ "compress",	thread_fs_compress },
 	{ "cat",	thread_fs_cat },
+	{ "export",	thread_fs_export },
 	{ "stat",	thread_fs_stat },
+	{ "verify",	thread_fs_verify },
+	{ "defrag",	thread_fs_defrag },
+	{ "dedup",	thread_fs_dedup },
+	{ "log",	thread_fs_log },
+	{ "clean",	thread_fs_clean },
+	{ "snapshot",	thread_fs_snapshot },
 	{ "script",	thread_fs_script }
 };
 
@@ -0,0 +1,356 @@
+#!/bin/bash
+
+set -o pipefail
+#set -xv # debug
+
+#
+# Logging helpers
+#
+log() {
+    echo -e "${*}"
+}
+
+inf() {
+    log "Info: ${*}"
+}
+warning() {
+    log "Warning: ${*}"
+}
+error() {
+    log "Error: ${*}"
+}
+die() {
+    error "${*}"
+    exit 1
+}
+
+#
+# Scoring helpers
+#
+select_line() {
+	# 1: string
+	# 2: line to select
+	echo $(echo "${1}" | sed "${2}q;d")
+}
+
+fail() {
+	# 1: got
+	# 2: expected
+    log "Fail: got '${1}' but expected '${2}'"
+}
+
+pass() {
+	# got
+    log "Pass: ${1}"
+}
+
+compare_lines() {
+	# 1: output
+	# 2: expected
+    # 3: score (output)
+	declare -a output_lines=("${!1}")
+	declare -a expect_lines=("${!2}")
+    local __score=$3
+    local partial="0"
+
+    # Amount of partial credit for each correct output line
+    local step=$(bc -l <<< "1.0 / ${#expect_lines[@]}")
+
+    # Compare lines, two by two
+	for i in ${!output_lines[*]}; do
+		if [[ "${output_lines[${i}]}" =~ "${expect_lines[${i}]}" ]]; then
+			pass "${output_lines[${i}]}"
+            partial=$(bc <<< "${partial} + ${step}")
+		else
+			fail "${output_lines[${i}]}" "${expect_lines[${i}]}" ]]
+		fi
+	done
+
+    # Return final score
+    eval ${__score}="'${partial}'"
+}
+
+#
+# Generic function for running FS tests
+#
+run_test() {
+    # These are global variables after the test has run so clear them out now
+	unset STDOUT STDERR RET
+
+    # Create temp files for getting stdout and stderr
+    local outfile=$(mktemp)
+    local errfile=$(mktemp)
+
+    timeout 2 "${@}" >${outfile} 2>${errfile}
+
+    # Get the return status, stdout and stderr of the test case
+    RET="${?}"
+    STDOUT=$(cat "${outfile}")
+    STDERR=$(cat "${errfile}")
+
+    # Deal with the possible timeout errors
+    [[ ${RET} -eq 127 ]] && warning "Something is wrong (the executable probably doesn't exists)"
+    [[ ${RET} -eq 124 ]] && warning "Command timed out..."
+
+    # Clean up temp files
+    rm -f "${outfile}"
+    rm -f "${errfile}"
+}
+
+#
+# Generic function for capturing output of non-test programs
+#
+run_tool() {
+    # Create temp files for getting stdout and stderr
+    local outfile=$(mktemp)
+    local errfile=$(mktemp)
+
+    timeout 2 "${@}" >${outfile} 2>${errfile}
+
+    # Get the return status, stdout and stderr of the test case
+    local ret="${?}"
+    local stdout=$(cat "${outfile}")
+    local stderr=$(cat "${errfile}")
+
+    # Log the output
+    [[ ! -z ${stdout} ]] && inf "${stdout}"
+    [[ ! -z ${stderr} ]] && inf "${stderr}"
+
+    # Deal with the possible timeout errors
+    [[ ${ret} -eq 127 ]] && warning "Tool execution failed..."
+    [[ ${ret} -eq 124 ]] && warning "Tool execution timed out..."
+
+    # Clean up temp files
+    rm -f "${outfile}"
+    rm -f "${errfile}"
+}
+
+#
+# Shared helpers for the feature tests
+#
+
+# Host files compared against by the feature scripts
+make_host_files() {
+	run_tool dd if=/dev/urandom of=test-file-1 bs=4096 count=3
+	run_tool dd if=/dev/zero of=zero-file bs=19996 count=1
+	printf 'he\0\0\0\0' > shrunk-file
+	python3 -c "print('log line x' * 5000, end='')" > text-file
+}
+
+clean_host_files() {
+	rm -f test.fs backup.fs delta test-file-1 zero-file shrunk-file text-file
+}
+
+# Append the consistency check of test.fs to line_array/corr_array
+check_verify() {
+	local out
+	out=$(timeout 2 ./test_fs.x verify "${1:-test.fs}")
+	line_array+=("$(select_line "${out}" "3")")
+	line_array+=("$(select_line "${out}" "4")")
+	line_array+=("$(select_line "${out}" "5")")
+	line_array+=("$(select_line "${out}" "6")")
+	line_array+=("$(select_line "${out}" "7")")
+	corr_array+=("bad_links=0")
+	corr_array+=("cross_linked=0")
+	corr_array+=("size_mismatch=0")
+	corr_array+=("leaked_blocks=0")
+	corr_array+=("bad_refcounts=0")
+}
+
+#
+# Copy on write
+#
+
+# write to a clone, the original keeps its data
+clone_cow() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	make_host_files
+	run_tool ./fs_make.x test.fs 100
+	run_test ./test_fs.x script test.fs scripts/clone.script
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "13")")
+	line_array+=("$(select_line "${STDOUT}" "15")")
+	line_array+=("$(select_line "${STDOUT}" "18")")
+	local corr_array=()
+	corr_array+=("Read 7 bytes from file. Compared 7 correct.")
+	corr_array+=("Read 8 bytes from file. Compared 8 correct.")
+	corr_array+=("Read 12288 bytes from file. Compared 12288 correct.")
+	check_verify
+	clean_host_files
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# overwrite a file after a snapshot, restore the old version from it
+snapshot_cow() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	make_host_files
+	run_tool ./fs_make.x test.fs 100
+	run_test ./test_fs.x script test.fs scripts/snapshot.script
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "6")")
+	line_array+=("$(select_line "${STDOUT}" "12")")
+	line_array+=("$(select_line "${STDOUT}" "15")")
+	local corr_array=()
+	corr_array+=("SNAPSHOT 0 successful.")
+	corr_array+=("Read 12288 bytes from file. Compared 12288 correct.")
+	corr_array+=("Read 11 bytes from file. Compared 11 correct.")
+	check_verify
+	clean_host_files
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# export the changes since a snapshot and apply them to a copy of the disk
+snapshot_diff() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	make_host_files
+	run_tool ./fs_make.x test.fs 100
+	run_tool ./test_fs.x script test.fs scripts/snapshot_base.script
+	run_tool ./test_fs.x snapshot test.fs create
+	cp test.fs backup.fs
+	run_tool ./test_fs.x script test.fs scripts/snapshot_change.script
+	run_tool ./test_fs.x snapshot test.fs export 0 -1 delta
+	run_tool ./test_fs.x snapshot backup.fs apply delta
+	run_test ./test_fs.x script backup.fs scripts/snapshot_check.script
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "4")")
+	local corr_array=()
+	corr_array+=("Read 7 bytes from file. Compared 7 correct.")
+	check_verify backup.fs
+	clean_host_files
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Journal
+#
+
+# stop without unmounting, the journal brings back what was synced
+journal_replay() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	make_host_files
+	run_tool ./fs_make.x -j 24 test.fs 100
+	run_test ./test_fs.x script test.fs scripts/journal_crash.script
+	local crash="${STDOUT}"
+	run_test ./test_fs.x script test.fs scripts/journal_replay.script
+	local replay="${STDOUT}"
+	run_test ./test_fs.x ls test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${crash}" "8")")
+	line_array+=("$(select_line "${replay}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	line_array+=("unsynced files: $(echo "${STDOUT}" | grep -c 'file: lost')")
+	local corr_array=()
+	corr_array+=("CRASH")
+	corr_array+=("Read 12288 bytes from file. Compared 12288 correct.")
+	corr_array+=("file: file, size: 12288")
+	corr_array+=("unsynced files: 0")
+	check_verify
+	clean_host_files
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Sparse files and compression
+#
+
+# holes read back as zeros, truncate drops and zero-extends data
+sparse_truncate() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	make_host_files
+	run_tool ./fs_make.x test.fs 100
+	run_test ./test_fs.x script test.fs scripts/sparse.script
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "8")")
+	line_array+=("$(select_line "${STDOUT}" "9")")
+	line_array+=("$(select_line "${STDOUT}" "13")")
+	local corr_array=()
+	corr_array+=("Read 19996 bytes from file. Compared 19996 correct.")
+	corr_array+=("Read 4 bytes from file. Compared 4 correct.")
+	corr_array+=("Read 6 bytes from file. Compared 6 correct.")
+	check_verify
+	clean_host_files
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# compress, patch, remount and decompress a file
+compress_roundtrip() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	make_host_files
+	run_tool ./fs_make.x test.fs 100
+	run_test ./test_fs.x script test.fs scripts/compress.script
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	line_array+=("$(select_line "${STDOUT}" "15")")
+	line_array+=("$(select_line "${STDOUT}" "18")")
+	local corr_array=()
+	corr_array+=("Read 50000 bytes from file. Compared 50000 correct.")
+	corr_array+=("Read 7 bytes from file. Compared 7 correct.")
+	corr_array+=("Read 10 bytes from file. Compared 10 correct.")
+	check_verify
+	clean_host_files
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Run tests
+#
+run_tests() {
+	# Copy on write
+	clone_cow
+	snapshot_cow
+	snapshot_diff
+	# Journal
+	journal_replay
+	# Sparse files and compression
+	sparse_truncate
+	compress_roundtrip
+}
+
+make_fs() {
+    # Compile
+    make > /dev/null 2>&1 ||
+        die "Compilation failed"
+
+    local execs=("test_fs.x" "fs_make.x")
+
+    # Make sure executables were properly created
+    local x
+    for x in "${execs[@]}"; do
+        if [[ ! -x "${x}" ]]; then
+            die "Can't find executable ${x}"
+        fi
+    done
+}
+
+make_fs
+run_tests
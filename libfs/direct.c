@@ -0,0 +1,263 @@
+#define _GNU_SOURCE /* for O_DIRECT */
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "disk.h"
+
+/* Alignment of the memory given to the device, its page size */
+#define DIRECT_ALIGN 4096
+
+/* Size of each pool buffer, a multiple of every block size */
+#define DIRECT_BUF_SIZE (256 * 1024)
+
+/* Number of pool buffers, requests wait for one when they are all in use */
+#define DIRECT_POOL_BUFS 4
+
+/* Most segments a single preadv/pwritev accepts (UIO_MAXIOV on Linux) */
+#define DIRECT_IOV_MAX 1024
+
+struct direct {
+	int fd;
+	size_t size;
+	/* Memory of all the pool buffers, and the ones not in use */
+	char *pool;
+	char *free[DIRECT_POOL_BUFS];
+	int nfree;
+	pthread_mutex_t lock;
+	pthread_cond_t freed;
+};
+
+static char *direct_buf_get(struct direct *dio)
+{
+	char *buf;
+
+	pthread_mutex_lock(&dio->lock);
+	while (!dio->nfree)
+		pthread_cond_wait(&dio->freed, &dio->lock);
+	buf = dio->free[--dio->nfree];
+	pthread_mutex_unlock(&dio->lock);
+
+	return buf;
+}
+
+static void direct_buf_put(struct direct *dio, char *buf)
+{
+	pthread_mutex_lock(&dio->lock);
+	dio->free[dio->nfree++] = buf;
+	pthread_cond_signal(&dio->freed);
+	pthread_mutex_unlock(&dio->lock);
+}
+
+/* Whether the device can transfer straight from or to the buffers of @iov */
+static int direct_aligned(const struct iovec *iov, int iovcnt)
+{
+	if (iovcnt > DIRECT_IOV_MAX)
+		return 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		if ((uintptr_t)iov[i].iov_base % DIRECT_ALIGN ||
+		    iov[i].iov_len % DIRECT_ALIGN)
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Copy @n bytes between the buffers of @iov, from segment *@i at byte *@in,
+ * and @buf, then move the position past them
+ */
+static void direct_copy(const struct iovec *iov, int *i, size_t *in,
+			char *buf, size_t n, int to_buf)
+{
+	while (n) {
+		size_t len = iov[*i].iov_len - *in < n ? iov[*i].iov_len - *in : n;
+		char *base = (char *)iov[*i].iov_base + *in;
+
+		if (to_buf)
+			memcpy(buf, base, len);
+		else
+			memcpy(base, buf, len);
+		buf += len;
+		n -= len;
+		*in += len;
+		if (*in == iov[*i].iov_len) {
+			(*i)++;
+			*in = 0;
+		}
+	}
+}
+
+/*
+ * Transfer aligned buffers as they are, and bounce everything else through
+ * a pool buffer, one pool buffer's worth at a time
+ */
+static int direct_io(void *dev, size_t offset, const struct iovec *iov,
+		     int iovcnt, size_t len, int write)
+{
+	struct direct *dio = dev;
+	size_t in = 0;
+	char *buf;
+	int i = 0, ret = 0;
+
+	if (direct_aligned(iov, iovcnt)) {
+		ssize_t done = write ? pwritev(dio->fd, iov, iovcnt, offset) :
+			preadv(dio->fd, iov, iovcnt, offset);
+
+		if (done != (ssize_t)len) {
+			perror(write ? "pwritev" : "preadv");
+			return -1;
+		}
+		return 0;
+	}
+
+	buf = direct_buf_get(dio);
+	while (len) {
+		size_t n = len < DIRECT_BUF_SIZE ? len : DIRECT_BUF_SIZE;
+
+		if (write) {
+			direct_copy(iov, &i, &in, buf, n, 1);
+			if (pwrite(dio->fd, buf, n, offset) != (ssize_t)n) {
+				perror("pwrite");
+				ret = -1;
+				break;
+			}
+		} else {
+			if (pread(dio->fd, buf, n, offset) != (ssize_t)n) {
+				perror("pread");
+				ret = -1;
+				break;
+			}
+			direct_copy(iov, &i, &in, buf, n, 0);
+		}
+		offset += n;
+		len -= n;
+	}
+	direct_buf_put(dio, buf);
+
+	return ret;
+}
+
+static int direct_read(void *dev, size_t offset, void *buf, size_t len)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+	return direct_io(dev, offset, &iov, 1, len, 0);
+}
+
+static int direct_write(void *dev, size_t offset, const void *buf, size_t len)
+{
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+	return direct_io(dev, offset, &iov, 1, len, 1);
+}
+
+static int direct_readv(void *dev, size_t offset, const struct iovec *iov,
+			int iovcnt, size_t len)
+{
+	return direct_io(dev, offset, iov, iovcnt, len, 0);
+}
+
+static int direct_writev(void *dev, size_t offset, const struct iovec *iov,
+			 int iovcnt, size_t len)
+{
+	return direct_io(dev, offset, iov, iovcnt, len, 1);
+}
+
+/* Data bypasses the host cache, but the device's own cache may hold it */
+static int direct_flush(void *dev)
+{
+	struct direct *dio = dev;
+
+	if (fsync(dio->fd)) {
+		perror("fsync");
+		return -1;
+	}
+
+	return 0;
+}
+
+static size_t direct_size(void *dev)
+{
+	return ((struct direct *)dev)->size;
+}
+
+static int direct_close(void *dev)
+{
+	struct direct *dio = dev;
+	int ret = 0;
+
+	if (close(dio->fd)) {
+		perror("close");
+		ret = -1;
+	}
+	pthread_cond_destroy(&dio->freed);
+	pthread_mutex_destroy(&dio->lock);
+	free(dio->pool);
+	free(dio);
+
+	return ret;
+}
+
+static void *direct_open(const char *path)
+{
+	struct direct *dio;
+	struct stat st;
+	void *pool;
+
+	if (!(dio = calloc(1, sizeof(*dio)))) {
+		perror("calloc");
+		return NULL;
+	}
+
+	if ((dio->fd = open(path, O_RDWR | O_DIRECT, 0644)) < 0) {
+		perror("open");
+		free(dio);
+		return NULL;
+	}
+
+	if (fstat(dio->fd, &st)) {
+		perror("fstat");
+		goto fail;
+	}
+	dio->size = st.st_size;
+
+	/* The whole pool is allocated up front, it is all the memory used */
+	if (posix_memalign(&pool, DIRECT_ALIGN,
+			   DIRECT_POOL_BUFS * DIRECT_BUF_SIZE)) {
+		perror("posix_memalign");
+		goto fail;
+	}
+	dio->pool = pool;
+	for (int b = 0; b < DIRECT_POOL_BUFS; b++)
+		dio->free[b] = dio->pool + b * DIRECT_BUF_SIZE;
+	dio->nfree = DIRECT_POOL_BUFS;
+	pthread_mutex_init(&dio->lock, NULL);
+	pthread_cond_init(&dio->freed, NULL);
+
+	return dio;
+
+fail:
+	close(dio->fd);
+	free(dio);
+	return NULL;
+}
+
+const struct block_driver block_driver_direct = {
+	.name = "direct",
+	.open = direct_open,
+	.close = direct_close,
+	.size = direct_size,
+	.read = direct_read,
+	.write = direct_write,
+	.readv = direct_readv,
+	.writev = direct_writev,
+	.flush = direct_flush,
+};
@@ -1,8 +1,12 @@
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "disk.h"
@@ -10,75 +14,576 @@
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
-/* Invalid file descriptor */
-#define INVALID_FD -1
+/* Most drivers that can be registered at the same time */
+#define BLOCK_DRIVER_MAX 16
+
+/* Granularity at which the RAM disk tracks what to write back */
+#define RAM_PAGE BLOCK_SIZE_MIN
 
 /* Disk instance description */
 struct disk {
-	/* File descriptor */
-	int fd;
+	/* Driver of the disk, NULL when no disk is open */
+	const struct block_driver *driver;
+	/* Private state the driver returned when opening the disk */
+	void *dev;
 	/* Block count */
 	size_t bcount;
+	/* Block size */
+	size_t bsize;
+	/* Size of the disk image in bytes */
+	size_t size;
 };
 
 /* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+static struct disk disk;
 
-int block_disk_open(const char *diskname)
-{
+/*
+ * State of the built-in drivers, which all work on a single image file. The
+ * mmap and RAM drivers access the image through @mem, the RAM disk remembers
+ * in @dirty which of its pages are newer than the file.
+ */
+struct image {
 	int fd;
+	size_t size;
+	char *mem;
+	uint8_t *dirty;
+};
+
+/* Open the image file @path for the built-in drivers */
+static struct image *image_open(const char *path)
+{
+	struct image *img;
 	struct stat st;
+	int fd;
 
-	if (!diskname) {
-		block_error("invalid file diskname");
+	if ((fd = open(path, O_RDWR, 0644)) < 0) {
+		perror("open");
+		return NULL;
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
+		return NULL;
+	}
+
+	if (!(img = calloc(1, sizeof(*img)))) {
+		perror("calloc");
+		close(fd);
+		return NULL;
+	}
+
+	img->fd = fd;
+	img->size = st.st_size;
+
+	return img;
+}
+
+static int image_close(struct image *img)
+{
+	int ret = 0;
+
+	if (close(img->fd)) {
+		perror("close");
+		ret = -1;
+	}
+	free(img->dirty);
+	free(img);
+
+	return ret;
+}
+
+static size_t image_size(void *dev)
+{
+	return ((struct image *)dev)->size;
+}
+
+/*
+ * Plain file driver: every request goes to the image file with one system
+ * call, the page cache of the host is the only cache.
+ */
+static void *file_open(const char *path)
+{
+	return image_open(path);
+}
+
+static int file_close(void *dev)
+{
+	return image_close(dev);
+}
+
+static int file_read(void *dev, size_t offset, void *buf, size_t len)
+{
+	struct image *img = dev;
+
+	if (pread(img->fd, buf, len, offset) != (ssize_t)len) {
+		perror("pread");
 		return -1;
 	}
 
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
+	return 0;
+}
+
+static int file_write(void *dev, size_t offset, const void *buf, size_t len)
+{
+	struct image *img = dev;
+
+	if (pwrite(img->fd, buf, len, offset) != (ssize_t)len) {
+		perror("pwrite");
 		return -1;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
-		perror("open");
+	return 0;
+}
+
+static int file_readv(void *dev, size_t offset, const struct iovec *iov,
+		      int iovcnt, size_t len)
+{
+	struct image *img = dev;
+
+	if (preadv(img->fd, iov, iovcnt, offset) != (ssize_t)len) {
+		perror("preadv");
 		return -1;
 	}
 
-	if (fstat(fd, &st)) {
-		perror("fstat");
+	return 0;
+}
+
+static int file_writev(void *dev, size_t offset, const struct iovec *iov,
+		       int iovcnt, size_t len)
+{
+	struct image *img = dev;
+
+	if (pwritev(img->fd, iov, iovcnt, offset) != (ssize_t)len) {
+		perror("pwritev");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int file_flush(void *dev)
+{
+	struct image *img = dev;
+
+	if (fsync(img->fd)) {
+		perror("fsync");
+		return -1;
+	}
+
+	return 0;
+}
+
+const struct block_driver block_driver_file = {
+	.name = "file",
+	.open = file_open,
+	.close = file_close,
+	.size = image_size,
+	.read = file_read,
+	.write = file_write,
+	.readv = file_readv,
+	.writev = file_writev,
+	.flush = file_flush,
+};
+
+/*
+ * Memory accessors shared by the mmap and RAM drivers. Writes mark the pages
+ * they touch when the image keeps a dirty map.
+ */
+static void mem_dirty(struct image *img, size_t offset, size_t len)
+{
+	if (!img->dirty || !len)
+		return;
+
+	memset(img->dirty + offset / RAM_PAGE, 1,
+	       (offset + len - 1) / RAM_PAGE - offset / RAM_PAGE + 1);
+}
+
+static int mem_read(void *dev, size_t offset, void *buf, size_t len)
+{
+	struct image *img = dev;
+
+	memcpy(buf, img->mem + offset, len);
+
+	return 0;
+}
+
+static int mem_write(void *dev, size_t offset, const void *buf, size_t len)
+{
+	struct image *img = dev;
+
+	memcpy(img->mem + offset, buf, len);
+	mem_dirty(img, offset, len);
+
+	return 0;
+}
+
+static int mem_readv(void *dev, size_t offset, const struct iovec *iov,
+		     int iovcnt, size_t len)
+{
+	struct image *img = dev;
+
+	(void)len;
+	for (int i = 0; i < iovcnt; offset += iov[i++].iov_len)
+		memcpy(iov[i].iov_base, img->mem + offset, iov[i].iov_len);
+
+	return 0;
+}
+
+static int mem_writev(void *dev, size_t offset, const struct iovec *iov,
+		      int iovcnt, size_t len)
+{
+	struct image *img = dev;
+
+	mem_dirty(img, offset, len);
+	for (int i = 0; i < iovcnt; offset += iov[i++].iov_len)
+		memcpy(img->mem + offset, iov[i].iov_base, iov[i].iov_len);
+
+	return 0;
+}
+
+/*
+ * mmap driver: the image is mapped shared, requests are plain copies and the
+ * kernel writes the dirty pages back on its own schedule or at flush.
+ */
+static void *mmap_open(const char *path)
+{
+	struct image *img = image_open(path);
+
+	if (!img || !img->size)
+		return img;
+
+	img->mem = mmap(NULL, img->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			img->fd, 0);
+	if (img->mem == MAP_FAILED) {
+		perror("mmap");
+		image_close(img);
+		return NULL;
+	}
+
+	return img;
+}
+
+static int mmap_close(void *dev)
+{
+	struct image *img = dev;
+	int ret = 0;
+
+	if (img->mem && munmap(img->mem, img->size)) {
+		perror("munmap");
+		ret = -1;
+	}
+
+	return image_close(img) || ret ? -1 : 0;
+}
+
+static int mmap_flush(void *dev)
+{
+	struct image *img = dev;
+
+	if (img->mem && msync(img->mem, img->size, MS_SYNC)) {
+		perror("msync");
 		return -1;
 	}
 
-	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
+	return 0;
+}
+
+const struct block_driver block_driver_mmap = {
+	.name = "mmap",
+	.open = mmap_open,
+	.close = mmap_close,
+	.size = image_size,
+	.read = mem_read,
+	.write = mem_write,
+	.readv = mem_readv,
+	.writev = mem_writev,
+	.flush = mmap_flush,
+};
+
+/*
+ * RAM disk driver: the whole image is loaded in memory when it is opened and
+ * served from there. The image file is only written at flush and close, and
+ * then only with the pages that changed.
+ */
+static void *ram_open(const char *path)
+{
+	struct image *img = image_open(path);
+
+	if (!img)
+		return NULL;
+
+	img->mem = malloc(img->size ? img->size : 1);
+	img->dirty = calloc(img->size / RAM_PAGE + 1, 1);
+	if (!img->mem || !img->dirty) {
+		perror("malloc");
+		goto fail;
+	}
+
+	if (pread(img->fd, img->mem, img->size, 0) != (ssize_t)img->size) {
+		perror("pread");
+		goto fail;
+	}
+
+	return img;
+
+fail:
+	free(img->mem);
+	image_close(img);
+	return NULL;
+}
+
+/* Write the dirty pages back to the image file, one request per run */
+static int ram_writeback(struct image *img)
+{
+	size_t pages = (img->size + RAM_PAGE - 1) / RAM_PAGE;
+
+	for (size_t p = 0; p < pages; p++) {
+		size_t q = p, offset, len;
+
+		if (!img->dirty[p])
+			continue;
+		while (q < pages && img->dirty[q])
+			q++;
+
+		offset = p * RAM_PAGE;
+		len = (q < pages ? q * RAM_PAGE : img->size) - offset;
+		if (pwrite(img->fd, img->mem + offset, len, offset) != (ssize_t)len) {
+			perror("pwrite");
+			return -1;
+		}
+		memset(img->dirty + p, 0, q - p);
+		p = q;
+	}
+
+	return 0;
+}
+
+static int ram_close(void *dev)
+{
+	struct image *img = dev;
+	int ret = ram_writeback(img);
+
+	free(img->mem);
+
+	return image_close(img) || ret ? -1 : 0;
+}
+
+static int ram_flush(void *dev)
+{
+	struct image *img = dev;
+
+	if (ram_writeback(img))
+		return -1;
+
+	if (fsync(img->fd)) {
+		perror("fsync");
+		return -1;
+	}
+
+	return 0;
+}
+
+const struct block_driver block_driver_ram = {
+	.name = "ram",
+	.open = ram_open,
+	.close = ram_close,
+	.size = image_size,
+	.read = mem_read,
+	.write = mem_write,
+	.readv = mem_readv,
+	.writev = mem_writev,
+	.flush = ram_flush,
+};
+
+/* Drivers block_disk_open() can select, the first one is the default */
+static const struct block_driver *drivers[BLOCK_DRIVER_MAX] = {
+	&block_driver_file,
+	&block_driver_mmap,
+	&block_driver_ram,
+	&block_driver_raid0,
+	&block_driver_direct,
+	&block_driver_sim,
+	&block_driver_elevator,
+};
+
+int block_driver_register(const struct block_driver *driver)
+{
+	int i;
+
+	if (!driver || !driver->name || !driver->open || !driver->close ||
+	    !driver->size || !driver->read || !driver->write ||
+	    !driver->readv || !driver->writev || !driver->flush) {
+		block_error("invalid driver");
+		return -1;
+	}
+
+	for (i = 0; i < BLOCK_DRIVER_MAX && drivers[i]; i++) {
+		if (!strcmp(drivers[i]->name, driver->name)) {
+			block_error("driver '%s' already registered", driver->name);
+			return -1;
+		}
+	}
+
+	if (i == BLOCK_DRIVER_MAX) {
+		block_error("too many drivers");
+		return -1;
+	}
+
+	drivers[i] = driver;
+
+	return 0;
+}
+
+const struct block_driver *block_driver_find(const char *diskname,
+					     const char **path)
+{
+	const char *colon = strchr(diskname, ':');
+
+	*path = diskname;
+	if (!colon)
+		return NULL;
+
+	for (int i = 0; i < BLOCK_DRIVER_MAX && drivers[i]; i++) {
+		if (strlen(drivers[i]->name) == (size_t)(colon - diskname) &&
+		    !strncmp(drivers[i]->name, diskname, colon - diskname)) {
+			*path = colon + 1;
+			return drivers[i];
+		}
+	}
+
+	return NULL;
+}
+
+const char *block_driver_parse(const char *path,
+			       const struct block_driver_param *params,
+			       size_t count, void *settings)
+{
+	const char *p = path;
+
+	while (*p != ':') {
+		const char *eq = strchr(p, '=');
+		char *end;
+		size_t k;
+
+		for (k = 0; eq && k < count; k++)
+			if (strlen(params[k].key) == (size_t)(eq - p) &&
+			    !strncmp(params[k].key, p, eq - p))
+				break;
+		if (!eq || k == count) {
+			block_error("invalid parameter at '%s'", p);
+			return NULL;
+		}
+
+		*(unsigned long *)((char *)settings + params[k].offset) =
+			strtoul(eq + 1, &end, 0);
+		if (end == eq + 1 || (*end != ',' && *end != ':')) {
+			block_error("invalid value at '%s'", p);
+			return NULL;
+		}
+		p = *end == ',' ? end + 1 : end;
+	}
+
+	return p + 1;
+}
+
+void *block_driver_open_wrapped(const char *diskname,
+				const struct block_driver **driver)
+{
+	const char *path;
+
+	*driver = block_driver_find(diskname, &path);
+	if (!*driver)
+		*driver = drivers[0];
+
+	return (*driver)->open(path);
+}
+
+int block_disk_open_driver(const char *diskname,
+			   const struct block_driver *driver)
+{
+	void *dev;
+	size_t size;
+
+	if (!diskname || !driver) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	if (disk.driver) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	if (!(dev = driver->open(diskname)))
+		return -1;
+
+	/*
+	 * The disk image's size should be a multiple of the block size, which
+	 * may be as small as BLOCK_SIZE_MIN once the file system switches to it
+	 */
+	size = driver->size(dev);
+	if (size % BLOCK_SIZE_MIN != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+			    size, BLOCK_SIZE_MIN);
+		driver->close(dev);
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk.driver = driver;
+	disk.dev = dev;
+	disk.size = size;
+	disk.bsize = BLOCK_SIZE;
+	disk.bcount = size / BLOCK_SIZE;
 
 	return 0;
 }
 
+int block_disk_open(const char *diskname)
+{
+	const struct block_driver *driver;
+	const char *path;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	driver = block_driver_find(diskname, &path);
+
+	return block_disk_open_driver(path, driver ? driver : drivers[0]);
+}
+
 int block_disk_close(void)
 {
-	if (disk.fd == INVALID_FD) {
+	int ret;
+
+	if (!disk.driver) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	ret = disk.driver->close(disk.dev);
 
-	disk.fd = INVALID_FD;
+	disk.driver = NULL;
+	disk.dev = NULL;
 
-	return 0;
+	return ret;
+}
+
+int block_disk_flush(void)
+{
+	if (!disk.driver) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	return disk.driver->flush(disk.dev);
 }
 
 int block_disk_count(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.driver) {
 		block_error("no disk currently open");
 		return -1;
 	}
@@ -86,37 +591,43 @@ int block_disk_count(void)
 	return disk.bcount;
 }
 
-int block_write(size_t block, const void *buf)
+int block_disk_set_block_size(size_t size)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.driver) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (size < BLOCK_SIZE_MIN || size > BLOCK_SIZE_MAX || (size & (size - 1))) {
+		block_error("invalid block size '%zu'", size);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (disk.size % size != 0) {
+		block_error("size '%zu' is not multiple of '%zu'", disk.size, size);
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	disk.bsize = size;
+	disk.bcount = disk.size / size;
+
+	return 0;
+}
+
+int block_disk_block_size(void)
+{
+	if (!disk.driver) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	return 0;
+	return disk.bsize;
 }
 
-int block_read(size_t block, void *buf)
+/* Check a single block request */
+static int block_check(size_t block)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.driver) {
 		block_error("no disk currently open");
 		return -1;
 	}
@@ -127,17 +638,76 @@ int block_read(size_t block, void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	return 0;
+}
+
+int block_write(size_t block, const void *buf)
+{
+	if (block_check(block))
+		return -1;
+
+	/* Perform the actual write into the disk image */
+	return disk.driver->write(disk.dev, block * disk.bsize, buf, disk.bsize);
+}
+
+int block_read(size_t block, void *buf)
+{
+	if (block_check(block))
 		return -1;
-	}
 
 	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	return disk.driver->read(disk.dev, block * disk.bsize, buf, disk.bsize);
+}
+
+/* Check a vectored request and return the number of bytes it covers */
+static ssize_t block_iov_check(size_t block, const struct iovec *iov,
+			       int iovcnt)
+{
+	size_t len = 0;
+
+	if (!disk.driver) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	return 0;
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (len % disk.bsize != 0) {
+		block_error("length '%zu' is not multiple of '%zu'",
+			    len, disk.bsize);
+		return -1;
+	}
+
+	if (block + len / disk.bsize > disk.bcount) {
+		block_error("block index out of bounds (%zu+%zu/%zu)",
+			    block, len / disk.bsize, disk.bcount);
+		return -1;
+	}
+
+	return len;
+}
+
+int block_writev(size_t block, const struct iovec *iov, int iovcnt)
+{
+	ssize_t len = block_iov_check(block, iov, iovcnt);
+
+	if (len < 0)
+		return -1;
+
+	/* Perform the actual write into the disk image */
+	return disk.driver->writev(disk.dev, block * disk.bsize, iov, iovcnt,
+				   len);
+}
+
+int block_readv(size_t block, const struct iovec *iov, int iovcnt)
+{
+	ssize_t len = block_iov_check(block, iov, iovcnt);
+
+	if (len < 0)
+		return -1;
+
+	/* Perform the actual read from the disk image */
+	return disk.driver->readv(disk.dev, block * disk.bsize, iov, iovcnt,
+				  len);
 }
@@ -2,10 +2,154 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
-/** Size of a disk block in bytes */
+/** Size of a disk block in bytes, until block_disk_set_block_size() changes it */
 #define BLOCK_SIZE 4096
 
+/** Smallest and largest block sizes block_disk_set_block_size() accepts */
+#define BLOCK_SIZE_MIN 1024
+#define BLOCK_SIZE_MAX 65536
+
+/**
+ * struct block_driver - Block device driver
+ * @name: Name selecting the driver in block_disk_open(), as in "name:path"
+ * @open: Open the device at @path, return its private state or NULL
+ * @close: Write back anything pending and release the device
+ * @size: Size of the device in bytes
+ * @read: Read @len bytes at byte @offset into @buf
+ * @write: Write @len bytes of @buf at byte @offset
+ * @readv: Read @len bytes at byte @offset into the buffers of @iov
+ * @writev: Write the @len bytes of the buffers of @iov at byte @offset
+ * @flush: Make everything written so far durable
+ *
+ * All the operations but @open and @size return -1 on failure and 0
+ * otherwise. Requests are checked against the block size and the size of the
+ * device before they reach the driver, offsets and lengths are always
+ * multiples of the block size.
+ */
+struct block_driver {
+	const char *name;
+	void *(*open)(const char *path);
+	int (*close)(void *dev);
+	size_t (*size)(void *dev);
+	int (*read)(void *dev, size_t offset, void *buf, size_t len);
+	int (*write)(void *dev, size_t offset, const void *buf, size_t len);
+	int (*readv)(void *dev, size_t offset, const struct iovec *iov,
+		     int iovcnt, size_t len);
+	int (*writev)(void *dev, size_t offset, const struct iovec *iov,
+		      int iovcnt, size_t len);
+	int (*flush)(void *dev);
+};
+
+/**
+ * Built-in drivers: "file" sends every request to the disk file, "mmap" maps
+ * the disk file in memory, and "ram" loads the whole disk file in memory and
+ * only writes the blocks that changed back to it at block_disk_flush() and
+ * block_disk_close().
+ *
+ * "raid0" stripes the disk across several image files, named as in
+ * "raid0:<stripe unit>:<image>,<image>,...". Consecutive stripe units, in
+ * bytes or with a 'k' suffix, go to consecutive images, and a request that
+ * spans several images is issued on all of them in parallel.
+ *
+ * "direct" opens the disk file with O_DIRECT so blocks are not kept in the
+ * host's page cache. Requests whose buffers are not page-aligned go through a
+ * small pool of aligned buffers allocated when the disk is opened.
+ *
+ * "sim" wraps another disk, named as in "sim:<key>=<value>,...:<diskname>",
+ * and delays each request the way a modelled device would. <diskname> may
+ * itself start with a driver name. The keys are "lat", the latency of every
+ * request in microseconds, "jitter", the most microseconds drawn at random
+ * and added to it, "bw", the bandwidth in MB/s, "seek", the microseconds a
+ * seek across the whole disk adds (shorter seeks add proportionally less),
+ * "qd", the number of requests serviced at once, and "seed", the seed of the
+ * random draws. Keys left out are 0, except "qd" and "seed" which are 1.
+ *
+ * "elevator" wraps another disk, named as in
+ * "elevator:<key>=<value>,...:<diskname>", with a request queue for disks
+ * used from several threads at once. Requests that arrive while the disk is
+ * busy are kept sorted by offset and sent in one sweep across the disk,
+ * wrapping around at its end, and requests in the same direction that follow
+ * each other on the disk are merged into a single vectored request. A request
+ * that has waited too long goes first. The keys are "read" and "write", the
+ * milliseconds a read or a write may wait before that (500 and 5000), "batch",
+ * the largest merged request in KB (1024), and "qd", the number of merged
+ * requests sent to the disk at once (1). The keys may be left out, as in
+ * "elevator::sim:seek=8000:disk.fs".
+ */
+extern const struct block_driver block_driver_file;
+extern const struct block_driver block_driver_mmap;
+extern const struct block_driver block_driver_ram;
+extern const struct block_driver block_driver_raid0;
+extern const struct block_driver block_driver_direct;
+extern const struct block_driver block_driver_sim;
+extern const struct block_driver block_driver_elevator;
+
+/**
+ * block_driver_register - Make a driver selectable by name
+ * @driver: Driver to register
+ *
+ * Register @driver so that block_disk_open() picks it for disk names prefixed
+ * with its name. The built-in drivers are always registered.
+ *
+ * Return: -1 if @driver is missing operations, if a driver with the same name
+ * is already registered, or if there are too many drivers. 0 otherwise.
+ */
+int block_driver_register(const struct block_driver *driver);
+
+/**
+ * block_driver_find - Find the driver a disk name selects
+ * @diskname: Disk name, possibly prefixed with a driver name and a colon
+ * @path: Set to the rest of the name, to be passed to the driver's open
+ *
+ * Return: the registered driver whose name prefixes @diskname, or NULL if
+ * there is none, in which case @path is set to @diskname.
+ */
+const struct block_driver *block_driver_find(const char *diskname,
+					     const char **path);
+
+/**
+ * struct block_driver_param - Parameter of a driver that wraps another disk
+ * @key: Name of the parameter, as in "<key>=<value>"
+ * @offset: Offset of the unsigned long that takes its value in the driver's
+ * settings
+ */
+struct block_driver_param {
+	const char *key;
+	size_t offset;
+};
+
+/**
+ * block_driver_parse - Parse the parameters of a driver that wraps another disk
+ * @path: Path passed to the driver's open, "<key>=<value>,...:<diskname>"
+ * @params: Parameters the driver accepts
+ * @count: Number of entries in @params
+ * @settings: Driver settings, keys left out keep their value
+ *
+ * Values are numbers as strtoul() reads them with base 0.
+ *
+ * Return: the wrapped disk name, past the ':', or NULL if a key is unknown or
+ * a value is not a number.
+ */
+const char *block_driver_parse(const char *path,
+			       const struct block_driver_param *params,
+			       size_t count, void *settings);
+
+/**
+ * block_driver_open_wrapped - Open the disk a driver wraps
+ * @diskname: Disk name, possibly prefixed with a driver name and a colon
+ * @driver: Set to the driver the disk is opened with
+ *
+ * Open @diskname the way block_disk_open() would, but without making it the
+ * current disk, for a driver that sends its requests on to it.
+ *
+ * Return: the private state of the opened disk, or NULL if it cannot be
+ * opened.
+ */
+void *block_driver_open_wrapped(const char *diskname,
+				const struct block_driver **driver);
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -14,11 +158,29 @@
  * blocks can be read from it with block_read() or written to it with
  * block_write().
  *
+ * @diskname may start with the name of a registered driver and a colon, as in
+ * "ram:disk.fs", to open the rest of the name with that driver. Otherwise the
+ * whole name is a path opened with the "file" driver.
+ *
  * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
  * or is already open. 0 otherwise.
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_driver - Open virtual disk with a given driver
+ * @diskname: Name of the virtual disk, as the driver understands it
+ * @driver: Driver to open the disk with
+ *
+ * Same as block_disk_open() but with an explicit driver, @diskname is passed
+ * to it as is.
+ *
+ * Return: -1 if @diskname or @driver is invalid, if the virtual disk cannot be
+ * opened or is already open. 0 otherwise.
+ */
+int block_disk_open_driver(const char *diskname,
+			   const struct block_driver *driver);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -26,6 +188,16 @@ int block_disk_open(const char *diskname);
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_flush - Flush virtual disk
+ *
+ * Make every block written so far durable in the underlying storage.
+ *
+ * Return: -1 if there was no virtual disk file opened or if the flush fails.
+ * 0 otherwise.
+ */
+int block_disk_flush(void);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -34,12 +206,34 @@ int block_disk_close(void);
  */
 int block_disk_count(void);
 
+/**
+ * block_disk_set_block_size - Change disk's block size
+ * @size: New block size in bytes
+ *
+ * A virtual disk is opened with blocks of %BLOCK_SIZE bytes. Set the size of
+ * the blocks of the currently open disk to @size bytes, which must be a power
+ * of two between %BLOCK_SIZE_MIN and %BLOCK_SIZE_MAX. Block indexes and the
+ * block count are in units of the new size from then on.
+ *
+ * Return: -1 if there was no virtual disk file opened, if @size is invalid, or
+ * if the disk's size is not a multiple of @size. 0 otherwise.
+ */
+int block_disk_set_block_size(size_t size);
+
+/**
+ * block_disk_block_size - Get disk's block size
+ *
+ * Return: -1 if there was no virtual disk file opened, otherwise the size in
+ * bytes of the blocks of the currently open disk.
+ */
+int block_disk_block_size(void);
+
 /**
  * block_write - Write a block to disk
  * @block: Index of the block to write to
  * @buf: Data buffer to write in the block
  *
- * Write the content of buffer @buf (%BLOCK_SIZE bytes) in the virtual disk's
+ * Write the content of buffer @buf (one block) in the virtual disk's
  * block @block.
  *
  * Return: -1 if @block is out of bounds or inaccessible or if the writing
@@ -52,7 +246,7 @@ int block_write(size_t block, const void *buf);
  * @block: Index of the block to read from
  * @buf: Data buffer to be filled with content of block
  *
- * Read the content of virtual disk's block @block (%BLOCK_SIZE bytes) into
+ * Read the content of virtual disk's block @block (one block) into
  * buffer @buf.
  *
  * Return: -1 if @block is out of bounds or inaccessible, or if the reading
@@ -60,5 +254,38 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_writev - Write consecutive blocks from a vector of buffers
+ * @block: Index of the first block to write to
+ * @iov: Array of data buffers to write
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Write the buffers of @iov, back to back, into the virtual disk starting at
+ * block @block. The buffers do not need to be block-sized individually, but
+ * their total length must be a multiple of the block size. All the blocks are
+ * written with a single request to the driver.
+ *
+ * Return: -1 if the total length of @iov is not a multiple of the block size,
+ * if any of the blocks is out of bounds or inaccessible, or if the writing
+ * operation fails. 0 otherwise.
+ */
+int block_writev(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_readv - Read consecutive blocks into a vector of buffers
+ * @block: Index of the first block to read from
+ * @iov: Array of data buffers to be filled
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Read the virtual disk's blocks starting at block @block into the buffers of
+ * @iov, back to back. The total length of @iov must be a multiple of the block
+ * size. All the blocks are read with a single request to the driver.
+ *
+ * Return: -1 if the total length of @iov is not a multiple of the block size,
+ * if any of the blocks is out of bounds or inaccessible, or if the reading
+ * operation fails. 0 otherwise.
+ */
+int block_readv(size_t block, const struct iovec *iov, int iovcnt);
+
 #endif /* _DISK_H */
 
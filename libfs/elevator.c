@@ -0,0 +1,332 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "disk.h"
+
+#define elevator_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Most segments a single preadv/pwritev accepts (UIO_MAXIOV on Linux) */
+#define ELEVATOR_IOV_MAX 1024
+
+/* Merged requests with fewer segments than this do not allocate */
+#define ELEVATOR_SEGS_INLINE 64
+
+/* Scheduler settings, times in milliseconds */
+struct elevator_params {
+	/* How long a read may wait before it is served out of order */
+	unsigned long read_expire;
+	/* Same for writes, which callers wait less on */
+	unsigned long write_expire;
+	/* Largest merged request in KB */
+	unsigned long batch;
+	/* Merged requests sent to the device at the same time */
+	unsigned long depth;
+};
+
+/* Request of a caller, queued until a dispatcher sends it to the device */
+struct elevator_request {
+	size_t offset;
+	size_t len;
+	const struct iovec *iov;
+	int iovcnt;
+	int write;
+	/* Microseconds on the monotonic clock after which it is served first */
+	uint64_t deadline;
+	int done;
+	int result;
+	/* Next request by offset in the queue */
+	struct elevator_request *next;
+};
+
+struct elevator {
+	struct elevator_params params;
+	/* Wrapped device */
+	const struct block_driver *driver;
+	void *dev;
+	size_t size;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	/* Pending requests, sorted by offset */
+	struct elevator_request *queue;
+	/* Merged requests being serviced by the device */
+	unsigned long inflight;
+	/* Where the last dispatched request ended, the sweep goes on from there */
+	size_t head;
+};
+
+static uint64_t elevator_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Pick the request to dispatch next: the one whose deadline passed first if
+ * any, otherwise the first one at or after the head, wrapping around to the
+ * lowest offset once the sweep reaches the end of the disk.
+ */
+static struct elevator_request **elevator_pick(struct elevator *elv)
+{
+	struct elevator_request **r, **expired = NULL, **ahead = NULL;
+	uint64_t now = elevator_now();
+
+	for (r = &elv->queue; *r; r = &(*r)->next) {
+		if ((*r)->deadline <= now &&
+		    (!expired || (*r)->deadline < (*expired)->deadline))
+			expired = r;
+		if (!ahead && (*r)->offset >= elv->head)
+			ahead = r;
+	}
+
+	if (expired)
+		return expired;
+
+	return ahead ? ahead : &elv->queue;
+}
+
+/*
+ * Take the picked request and the ones that continue it on the disk in the
+ * same direction off the queue, up to the batch size and the number of
+ * segments a vectored request takes. They follow each other in the queue, so
+ * they stay linked through @next. Return the number of requests taken.
+ */
+static int elevator_take(struct elevator *elv, struct elevator_request **pick,
+			 int *iovcnt, size_t *len)
+{
+	struct elevator_request *first = *pick, *last = first;
+	size_t limit = elv->params.batch * 1024;
+	int n = 1;
+
+	*iovcnt = first->iovcnt;
+	*len = first->len;
+	for (struct elevator_request *r = first->next; r; r = r->next) {
+		if (r->write != first->write ||
+		    r->offset != first->offset + *len ||
+		    *len + r->len > limit ||
+		    *iovcnt + r->iovcnt > ELEVATOR_IOV_MAX)
+			break;
+		*iovcnt += r->iovcnt;
+		*len += r->len;
+		last = r;
+		n++;
+	}
+	*pick = last->next;
+
+	return n;
+}
+
+/*
+ * Dispatch the next merged request from the queue, called with the lock held
+ * and released while the device services it
+ */
+static void elevator_dispatch(struct elevator *elv)
+{
+	struct iovec segs_inline[ELEVATOR_SEGS_INLINE], *segs = segs_inline;
+	struct elevator_request **pick = elevator_pick(elv);
+	struct elevator_request *first = *pick, *r;
+	size_t len;
+	int n, iovcnt, ret;
+
+	n = elevator_take(elv, pick, &iovcnt, &len);
+	elv->head = first->offset + len;
+	elv->inflight++;
+	pthread_mutex_unlock(&elv->lock);
+
+	if (n == 1) {
+		segs = (struct iovec *)first->iov;
+	} else if (iovcnt > ELEVATOR_SEGS_INLINE &&
+		   !(segs = malloc(sizeof(*segs) * iovcnt))) {
+		perror("malloc");
+	} else {
+		int s = 0;
+
+		r = first;
+		for (int i = 0; i < n; i++, r = r->next) {
+			memcpy(segs + s, r->iov, sizeof(*segs) * r->iovcnt);
+			s += r->iovcnt;
+		}
+	}
+
+	if (!segs)
+		ret = -1;
+	else if (first->write)
+		ret = elv->driver->writev(elv->dev, first->offset, segs,
+					  iovcnt, len);
+	else
+		ret = elv->driver->readv(elv->dev, first->offset, segs,
+					 iovcnt, len);
+	if (n > 1 && segs != segs_inline)
+		free(segs);
+
+	pthread_mutex_lock(&elv->lock);
+	/* A request belongs to its caller again once done, read @next first */
+	r = first;
+	for (int i = 0; i < n; i++) {
+		struct elevator_request *next = r->next;
+
+		r->result = ret;
+		r->done = 1;
+		r = next;
+	}
+	elv->inflight--;
+	pthread_cond_broadcast(&elv->done);
+}
+
+/*
+ * Queue a request and wait for it. Callers dispatch the queue themselves
+ * while the device has room, so requests that arrive while it is busy are
+ * sorted and merged before they go out.
+ */
+static int elevator_io(void *dev, size_t offset, const struct iovec *iov,
+		       int iovcnt, size_t len, int write)
+{
+	struct elevator *elv = dev;
+	struct elevator_request req = {
+		.offset = offset,
+		.len = len,
+		.iov = iov,
+		.iovcnt = iovcnt,
+		.write = write,
+	};
+	struct elevator_request **r;
+
+	req.deadline = elevator_now() + 1000 *
+		(write ? elv->params.write_expire : elv->params.read_expire);
+
+	pthread_mutex_lock(&elv->lock);
+	for (r = &elv->queue; *r && (*r)->offset <= offset; r = &(*r)->next)
+		;
+	req.next = *r;
+	*r = &req;
+
+	while (!req.done) {
+		if (elv->queue && elv->inflight < elv->params.depth)
+			elevator_dispatch(elv);
+		else
+			pthread_cond_wait(&elv->done, &elv->lock);
+	}
+	pthread_mutex_unlock(&elv->lock);
+
+	return req.result;
+}
+
+static int elevator_read(void *dev, size_t offset, void *buf, size_t len)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+	return elevator_io(dev, offset, &iov, 1, len, 0);
+}
+
+static int elevator_write(void *dev, size_t offset, const void *buf,
+			  size_t len)
+{
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+	return elevator_io(dev, offset, &iov, 1, len, 1);
+}
+
+static int elevator_readv(void *dev, size_t offset, const struct iovec *iov,
+			  int iovcnt, size_t len)
+{
+	return elevator_io(dev, offset, iov, iovcnt, len, 0);
+}
+
+static int elevator_writev(void *dev, size_t offset, const struct iovec *iov,
+			   int iovcnt, size_t len)
+{
+	return elevator_io(dev, offset, iov, iovcnt, len, 1);
+}
+
+/* Writes that completed are already with the device, pass the flush on */
+static int elevator_flush(void *dev)
+{
+	struct elevator *elv = dev;
+
+	return elv->driver->flush(elv->dev);
+}
+
+static size_t elevator_size(void *dev)
+{
+	return ((struct elevator *)dev)->size;
+}
+
+static int elevator_close(void *dev)
+{
+	struct elevator *elv = dev;
+	int ret = elv->driver->close(elv->dev);
+
+	pthread_cond_destroy(&elv->done);
+	pthread_mutex_destroy(&elv->lock);
+	free(elv);
+
+	return ret;
+}
+
+/* Keys of the path, see block_driver_parse() */
+static const struct block_driver_param elevator_params[] = {
+	{ "read", offsetof(struct elevator_params, read_expire) },
+	{ "write", offsetof(struct elevator_params, write_expire) },
+	{ "batch", offsetof(struct elevator_params, batch) },
+	{ "qd", offsetof(struct elevator_params, depth) },
+};
+
+/* @path is "<key>=<value>,...:<diskname>", see block_driver_elevator */
+static void *elevator_open(const char *path)
+{
+	struct elevator_params params = {
+		.read_expire = 500,
+		.write_expire = 5000,
+		.batch = 1024,
+		.depth = 1,
+	};
+	const char *name;
+	struct elevator *elv;
+
+	name = block_driver_parse(path, elevator_params,
+				  sizeof(elevator_params) /
+				  sizeof(elevator_params[0]), &params);
+	if (!name)
+		return NULL;
+	if (!params.depth || !params.batch) {
+		elevator_error("queue depth and batch size must be at least 1");
+		return NULL;
+	}
+
+	if (!(elv = calloc(1, sizeof(*elv)))) {
+		perror("calloc");
+		return NULL;
+	}
+	elv->params = params;
+
+	if (!(elv->dev = block_driver_open_wrapped(name, &elv->driver))) {
+		free(elv);
+		return NULL;
+	}
+	elv->size = elv->driver->size(elv->dev);
+	pthread_mutex_init(&elv->lock, NULL);
+	pthread_cond_init(&elv->done, NULL);
+
+	return elv;
+}
+
+const struct block_driver block_driver_elevator = {
+	.name = "elevator",
+	.open = elevator_open,
+	.close = elevator_close,
+	.size = elevator_size,
+	.read = elevator_read,
+	.write = elevator_write,
+	.readv = elevator_readv,
+	.writev = elevator_writev,
+	.flush = elevator_flush,
+};
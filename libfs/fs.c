@@ -1,17 +1,31 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <stdbool.h>
+#include <unistd.h>
 
 #include "disk.h"
 #include "fs.h"
+#include "lz.h"
 
-#define FAT_PER_BLOCK 2048
+#define FAT_PER_BLOCK (blockSize / 2)
 #define FAT_EOC 0xffff
 #define FD_EMPTY -1
 
+/* Metadata tables kept in chains of data blocks, see metaSave */
+enum MetaTable
+{
+	META_HOLES,
+	META_REFS,
+	META_SNAPSHOTS,
+	META_GENERATIONS,
+	META_TABLE_COUNT = 8
+};
+
 /* TODO: Phase 1 */
 
 // packed attribute to keep the struct size stable
@@ -23,22 +37,55 @@ struct __attribute__((__packed__)) Superblock
 	uint16_t dataB_startIndex;
 	uint16_t dataBCount;
 	uint16_t FATLen;
-	int8_t padding[4079];
+	// blocks left free between the root directory and the data region (fs_make.x -r)
+	uint16_t reservedCount;
+	// first block of each metadata table (enum MetaTable), 0 if the table is empty
+	uint16_t metaHead[META_TABLE_COUNT];
+	// generation of the live volume, bumped by every snapshot
+	uint32_t generation;
+	// FEATURE_* bits of the volume, 0 for a plain volume
+	uint8_t features;
+	// log2 of the block size of the volume (fs_make.x -b), 0 for BLOCK_SIZE
+	uint8_t blockShift;
+	// blocks of the metadata journal at the start of the reserved blocks (fs_make.x -j), see journalCommit
+	uint16_t journalBlocks;
+	// sequence number of the first journal transaction that mount replays
+	uint32_t journalSeq;
+	// next block the log appends to while FEATURE_LOG is set, see logAlloc
+	uint16_t logHead;
+	int8_t padding[4047];
 };
 
+// identical blocks are shared between files, see dedupFile
+#define FEATURE_DEDUP 0x01
+// blocks are appended at a moving head and never overwritten, see fs_log
+#define FEATURE_LOG 0x02
+
 struct __attribute__((__packed__)) RootEntry
 {
 	char filename[16];
 	uint32_t fileSize;
 	uint16_t dataStartIndex;
-	int8_t padding[10];
+	// ENTRY_* bits, 0 for a plain file
+	uint8_t flags;
+	// where the last, partial block of the file is packed while ENTRY_TAIL is set
+	uint16_t tailBlock;
+	uint16_t tailOffset;
+	int8_t padding[5];
 };
 
+// the file is stored as compressed chunks, see chunkStore
+#define ENTRY_COMPRESSED 0x01
+// the last block of the file is packed in a tail block with others, see tailPack
+#define ENTRY_TAIL 0x02
+
 /* phase 3 */
 struct FileDescriptor
 {
 	int entryIndex;
 	uint32_t offset;
+	// next free fd in the free list, only meaningful while entryIndex == FD_EMPTY
+	int nextFree;
 };
 
 // Flag to determine if fs is mounted or not
@@ -49,6 +96,12 @@ uint16_t *FAT;
 struct RootEntry rootEntries[FS_FILE_MAX_COUNT];
 int FATLength;
 
+// block size of the mounted volume, every block of the disk has this size
+uint32_t blockSize;
+
+// blocks taken by the root directory, one unless blocks are smaller than it
+#define ROOT_BLOCKS ((sizeof(rootEntries) + blockSize - 1) / blockSize)
+
 /* Phase 3 */
 /**
  * fdTable is the datastructure used to keep track of fd, which are integers returned by fs_open, used by fs_close, fs_read, fs_write, etc.
@@ -65,531 +118,6481 @@ int FATLength;
  * say if we wnat to access the name of the file associated with fd, we would use:
  * 
  * rootEntries[fdTable[fd].entryIndex].filename
+ *
+ * The table starts with FS_OPEN_MAX_COUNT entries and doubles whenever it runs out.
+ * Free entries are chained through nextFree starting at fdFreeHead, so fs_open and
+ * fs_close never scan the table.
 */
-struct FileDescriptor fdTable[FS_OPEN_MAX_COUNT];
+struct FileDescriptor *fdTable;
+int fdTableSize;
+int fdFreeHead;
+
+// number of fds currently open on each root entry, lets fs_delete check for open files without strcmp
+int openCount[FS_FILE_MAX_COUNT];
+
+// set by fs_reserve when a file may hold blocks past its size, they are given back on last close
+bool reserved[FS_FILE_MAX_COUNT];
+
+// set when a file changes while it is open, in dedup mode it is deduplicated on last close
+bool written[FS_FILE_MAX_COUNT];
 
 /**
- * Find last FAT block of a file
- * return FAT block index, or FAT_EOC if file length is 0
+ * A run of count logical blocks of a file, starting at block start, that are
+ * not in its chain. With block 0 they have never been written: they read back
+ * as zeros and have no data block. Otherwise they are shared: they read from
+ * the count blocks that follow each other on disk from FAT index block, which
+ * other files or snapshots may hold too, and are copied when written.
 */
-int findFATEnd(int fd)
+struct Hole
 {
-	int FATEnd = rootEntries[fdTable[fd].entryIndex].dataStartIndex;
-	if (FATEnd == FAT_EOC)
+	uint32_t start;
+	uint32_t count;
+	uint16_t block;
+};
+
+/**
+ * Holes and shared runs of one file, sorted by start, never overlapping
+ * The FAT chain only holds the blocks that are not in a hole, in file order.
+ * Chains are never shared, whatever other files share is in their runs.
+*/
+struct HoleList
+{
+	struct Hole *holes;
+	int count;
+	int capacity;
+};
+
+struct HoleList holeLists[FS_FILE_MAX_COUNT];
+
+/**
+ * Frozen copy of the root directory and hole lists, taken by fs_snapshot_create
+ * Its files have no chains: each block of their data is in a shared run, which
+ * holds a reference to it, so writes to the live files copy the blocks they
+ * share with it one at a time instead of changing them.
+*/
+struct Snapshot
+{
+	uint32_t generation;
+	struct RootEntry entries[FS_FILE_MAX_COUNT];
+	struct HoleList holes[FS_FILE_MAX_COUNT];
+};
+
+struct Snapshot *snapshots;
+int snapshotCount;
+
+// on-disk header of each snapshot in the snapshot table, see snapshotTableSave
+struct __attribute__((__packed__)) SnapshotHeader
+{
+	uint32_t generation;
+	uint32_t holeCount;
+};
+
+// on-disk run of blocks with the same generation, see genTableSave
+struct __attribute__((__packed__)) GenRecord
+{
+	uint16_t start;
+	uint16_t count;
+	uint32_t generation;
+};
+
+// on-disk record of the hole table, see holeTableSave
+struct __attribute__((__packed__)) HoleRecord
+{
+	uint8_t entryIndex;
+	uint8_t padding;
+	uint16_t block;
+	uint32_t start;
+	uint32_t count;
+};
+
+/**
+ * Free-space index over the FAT: bit i of freeMap is set while FAT[i] is free.
+ * freeHint is the first word that may still contain a set bit, so allocation
+ * never rescans the full words at the front of the map.
+*/
+uint64_t *freeMap;
+int freeCount;
+int freeHint;
+
+// each metadata slot and the superblock as of the last transaction, the slots that differ go in the next one
+char *metaJournal;
+
+/**
+ * Blocks freed since the last journal transaction that it still links. After
+ * a crash the journal brings those links back, so the blocks stay out of
+ * freeMap until the next transaction commits (bit i of freePending set),
+ * which keeps their content as committed. NULL without a journal.
+*/
+uint64_t *freePending;
+int pendingCount;
+
+/**
+ * Reference counts for blocks shared between files and snapshots, kept beside
+ * the FAT: blockRefs[i] is the number of holders of block i, minus one. A
+ * block is held by the chain it is in, if any, and by every shared run that
+ * covers it, so a block that left its chain may live on in runs alone (its FAT
+ * entry is then FAT_EOC). sharedCount is the number of blocks with extra
+ * references.
+*/
+uint16_t *blockRefs;
+int sharedCount;
+
+/**
+ * Generation of the volume when each block was last written, compared with the
+ * generation of a snapshot to tell whether the block changed since it was taken
+*/
+uint32_t *blockGen;
+
+// on-disk record of the reference table, see refTableSave
+struct __attribute__((__packed__)) RefRecord
+{
+	uint16_t block;
+	uint16_t refs;
+};
+
+/**
+ * Content index of the data blocks, kept while the volume is in dedup mode:
+ * blockHash[i] is the hash of the data in block i, or 0 if block i is not
+ * indexed. Blocks with the same hash bucket are chained through dedupNext
+ * from dedupBuckets, FAT_EOC ending the list. The index lives in memory
+ * only and is rebuilt from the data blocks at mount.
+*/
+uint64_t *blockHash;
+uint16_t *dedupNext;
+uint16_t *dedupBuckets;
+int dedupMask;
+
+/**
+ * Hash of the blockSize bytes at data, never 0
+*/
+uint64_t blockHashOf(const void *data)
+{
+	const char *bytes = data;
+	uint64_t h = 0x9e3779b97f4a7c15ULL;
+	for (uint32_t i = 0; i < blockSize; i += 8)
 	{
-		return FAT_EOC;
+		uint64_t word;
+		memcpy(&word, bytes + i, sizeof(word));
+		h = (h ^ (word * 0xff51afd7ed558ccdULL)) * 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 29;
 	}
-	for (; FAT[FATEnd] != FAT_EOC; FATEnd = FAT[FATEnd]);
-	return FATEnd;
+	return h != 0 ? h : 1;
 }
 
-int findFATStart(int fd, long *offset)
+/**
+ * Take block i out of the content index, before its data changes or it is freed
+*/
+void dedupForget(int i)
 {
-	int FATStart = rootEntries[fdTable[fd].entryIndex].dataStartIndex;
-	while (*offset >= BLOCK_SIZE && FATStart != FAT_EOC)
+	if (blockHash == NULL || blockHash[i] == 0)
 	{
-		*offset -= BLOCK_SIZE;
-		FATStart = FAT[FATStart];
+		return;
 	}
-	return FATStart;
+	uint16_t *link = &dedupBuckets[blockHash[i] & dedupMask];
+	while (*link != i)
+	{
+		link = &dedupNext[*link];
+	}
+	*link = dedupNext[i];
+	blockHash[i] = 0;
 }
 
 /**
- * Allocate a new block for file pointed to by fd
- * return FAT index of new space if successful
- * return -1 if no space to allocate
+ * Record that block i holds data with hash h
 */
-int falloc(int fd)
+void dedupAdd(int i, uint64_t h)
 {
-	// Find index for the new block
-	int i = 1;
-	for (; i < FATLength && FAT[i] != 0; i++);
-	if (i == FATLength)
-	{
-		return -1;
-	}
-	FAT[i] = FAT_EOC;
-	int FATEnd = findFATEnd(fd);
-	if (FATEnd == FAT_EOC)
+	if (blockHash == NULL)
 	{
-		rootEntries[fdTable[fd].entryIndex].dataStartIndex = i;
+		return;
 	}
-	else
+	dedupForget(i);
+	blockHash[i] = h;
+	dedupNext[i] = dedupBuckets[h & dedupMask];
+	dedupBuckets[h & dedupMask] = i;
+}
+
+/**
+ * Find an indexed block other than skip that holds the data in buf, whose hash
+ * is h, so that it can take the place of skip
+ * Hashes may collide, so the data of a candidate is compared too. Until
+ * *loaded is set buf is only read from skip, if there is a candidate.
+ * return FAT index of the block, or -1 if there is none
+*/
+int dedupFind(int skip, uint64_t h, char *buf, bool *loaded)
+{
+	char other[blockSize];
+	for (int i = dedupBuckets[h & dedupMask]; i != FAT_EOC; i = dedupNext[i])
 	{
-		FAT[FATEnd] = i;
+		if (i == skip || blockHash[i] != h)
+		{
+			continue;
+		}
+		if (!*loaded)
+		{
+			if (block_read(superblock.dataB_startIndex + skip, buf) == -1)
+			{
+				return -1;
+			}
+			*loaded = true;
+		}
+		if (block_read(superblock.dataB_startIndex + i, other) == 0 && memcmp(buf, other, blockSize) == 0)
+		{
+			return i;
+		}
 	}
-	return i;
+	return -1;
 }
 
-int fs_mount(const char *diskname)
+/**
+ * Add a reference to block i
+*/
+void refGet(int i)
 {
-	/* TODO: Phase 1 */
-	// open disk
-	int out = block_disk_open(diskname);
-	if (out == -1)
+	if (blockRefs[i]++ == 0)
 	{
-		return -1;
+		sharedCount++;
 	}
-	
-	// read superblock
-	block_read(0, &superblock);
-	
-	// perform signature checking
-	char* signature = "ECS150FS";
-	if (strncmp((char *)&superblock.signature, signature, 8) != 0)
+}
+
+/**
+ * Drop one of the extra references to block i
+*/
+void refPut(int i)
+{
+	if (--blockRefs[i] == 0)
 	{
-		return -1;
+		sharedCount--;
 	}
+}
 
-	// check if number of blocks is correct
-	if (block_disk_count() != superblock.blockCount)
+/**
+ * Build freeMap from the FAT
+ * return 0 if successful, -1 if out of memory
+*/
+int freeMapBuild(void)
+{
+	int words = (FATLength + 63) / 64;
+	freeMap = calloc(words, sizeof(uint64_t));
+	if (freeMap == NULL)
 	{
 		return -1;
 	}
-
-	// check the validity of FAT and Root blocks
-	uint32_t FATLen = (uint32_t)superblock.dataBCount * 2 / BLOCK_SIZE;
-	if ((uint32_t)superblock.dataBCount * 2 % BLOCK_SIZE != 0)
+	if (metaJournal != NULL && freePending == NULL)
 	{
-		FATLen += 1;
+		freePending = calloc(words, sizeof(uint64_t));
+		if (freePending == NULL)
+		{
+			return -1;
+		}
 	}
-	if (FATLen != superblock.FATLen || FATLen + 1 != superblock.rootDir_Index 
-	|| superblock.rootDir_Index + 1 != superblock.dataB_startIndex)
+	if (freePending != NULL)
 	{
-		return -1;
+		memset(freePending, 0, words * sizeof(uint64_t));
 	}
-
-	// initialize FAT
-	FATLength = superblock.dataBCount;
-	FAT = malloc(sizeof(uint16_t) * superblock.FATLen * FAT_PER_BLOCK);
-	for (unsigned int i = 0; i < superblock.FATLen; i++)
+	freeCount = 0;
+	freeHint = 0;
+	pendingCount = 0;
+	for (int i = 1; i < FATLength; i++)
 	{
-		block_read(i+1, &FAT[i * FAT_PER_BLOCK]);
+		if (FAT[i] == 0 && freePending != NULL && ((const uint16_t *)metaJournal)[i] != 0)
+		{
+			freePending[i / 64] |= (uint64_t)1 << (i % 64);
+			pendingCount++;
+		}
+		else if (FAT[i] == 0)
+		{
+			freeMap[i / 64] |= (uint64_t)1 << (i % 64);
+			freeCount++;
+		}
 	}
+	return 0;
+}
 
-	// read root block
-	block_read(superblock.rootDir_Index, rootEntries);
-
-	// initialize fdTable so that all entries are available
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+/**
+ * Give the blocks freed before the transaction that just committed to freeMap
+*/
+void pendingRelease(void)
+{
+	int words = (FATLength + 63) / 64;
+	for (int w = 0; pendingCount > 0 && w < words; w++)
 	{
-		fdTable[i].entryIndex = FD_EMPTY;
+		if (freePending[w] != 0)
+		{
+			freeMap[w] |= freePending[w];
+			freeCount += __builtin_popcountll(freePending[w]);
+			pendingCount -= __builtin_popcountll(freePending[w]);
+			freePending[w] = 0;
+			if (w < freeHint)
+			{
+				freeHint = w;
+			}
+		}
 	}
+}
 
-	mount = true;
-
-	return 0;
+/**
+ * Take block i out of the free-space index and mark it as the end of a chain
+*/
+void blockTake(int i)
+{
+	freeMap[i / 64] &= ~((uint64_t)1 << (i % 64));
+	freeCount--;
+	FAT[i] = FAT_EOC;
+	blockGen[i] = superblock.generation;
+	dedupForget(i);
 }
 
-int fs_umount(void)
+/**
+ * Take the first free block at or after the log head, wrapping around at the
+ * end of the FAT, and move the head past it
+ * Every file and table grows at the head, so whatever the number of files
+ * being written the disk sees one sequential stream.
+ * return FAT index of the block, or -1 if the disk is full
+*/
+int logAlloc(void)
 {
-	/* TODO: Phase 1 */
-	// Check if disk was mounted
-	if (!mount)
+	int words = (FATLength + 63) / 64;
+	int head = superblock.logHead < FATLength ? superblock.logHead : 0;
+	int w = head / 64;
+	uint64_t bits = freeMap[w] & (~(uint64_t)0 << (head % 64));
+	for (int scanned = 0; bits == 0 && scanned < words; scanned++)
 	{
-		return -1;
+		w = (w + 1) % words;
+		bits = freeMap[w];
 	}
-	// Copy the FAT and Root directory back to the original disk
-	for (unsigned int i = 0; i < superblock.FATLen; i++)
+	if (bits == 0)
 	{
-		block_write(i+1, &FAT[i * FAT_PER_BLOCK]);
+		return -1;
 	}
+	int i = w * 64 + __builtin_ctzll(bits);
+	blockTake(i);
+	superblock.logHead = i + 1 < FATLength ? i + 1 : 0;
+	return i;
+}
 
-	block_write(superblock.rootDir_Index, rootEntries);
-	
-
-	// try to close the disk file
-	if (block_disk_close() == -1) 
+/**
+ * Bytes one snapshot takes in the snapshot table, with the given hole lists
+*/
+size_t snapshotLen(const struct HoleList *holes)
+{
+	size_t len = sizeof(struct SnapshotHeader) + sizeof(struct RootEntry) * FS_FILE_MAX_COUNT;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
 	{
-		return -1;
+		len += sizeof(struct HoleRecord) * holes[i].count;
 	}
+	return len;
+}
 
-	free(FAT);
-	mount = false;
-	return 0;
+// bytes the snapshot table takes, kept up to date as snapshots come and go
+size_t snapshotBytes;
+
+// set while metaSave allocates, which may use the blocks kept for the tables
+bool metaSaving;
+
+// blocks in the chain of each metadata table as last loaded or saved
+int metaChainBlocks[META_TABLE_COUNT];
+
+/**
+ * Blocks a metadata table of len bytes takes, see metaSave
+*/
+int metaBlocks(size_t len)
+{
+	return len == 0 ? 0 : (sizeof(uint32_t) + len + blockSize - 1) / blockSize;
 }
 
-int fs_info(void)
+/**
+ * Blocks kept free so that the metadata tables can always be saved, however
+ * full the files get: the hole, reference and snapshot tables as they are now
+ * with the given bytes added, and the largest generation table once there are
+ * generations (or if generations is set)
+ * Writing a block may split a hole or a shared run, so while there are holes
+ * or shared blocks room for one more record is kept too.
+ * A new chain is written before the old one is freed, so whatever the tables
+ * need past the blocks their chains hold now is kept twice: once for the next
+ * save, and once for the save after it.
+*/
+int metaReserve(size_t holeBytes, size_t refBytes, size_t snapshotExtra, bool generations)
 {
-	/* TODO: Phase 1 */
-	if (!mount)
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
 	{
-		return -1;
+		holeBytes += sizeof(struct HoleRecord) * holeLists[i].count;
 	}
-
-	int freeFAT = 0, freeRootEntries = 0;
-	for (int i = 0; i < FATLength; i++) 
+	refBytes += sizeof(struct RefRecord) * sharedCount;
+	int blocks = metaBlocks(holeBytes ? holeBytes + sizeof(struct HoleRecord) : 0)
+	+ metaBlocks(refBytes ? refBytes + sizeof(struct RefRecord) : 0)
+	+ metaBlocks(snapshotBytes + snapshotExtra);
+	if (generations || superblock.generation != 0)
 	{
-		if (FAT[i] == 0) 
-		{
-			freeFAT++;
-		}
+		blocks += metaBlocks(sizeof(struct GenRecord) * FATLength);
 	}
-
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	int held = 0;
+	for (int t = 0; t < META_TABLE_COUNT; t++)
 	{
-		if (strlen(rootEntries[i].filename) == 0) {
-			freeRootEntries++;
-		}
+		held += metaChainBlocks[t];
 	}
-	printf("FS Info:\ntotal_blk_count=%d\nfat_blk_count=%d\nrdir_blk=%d\ndata_blk=%d\ndata_blk_count=%d\n"
-	"fat_free_ratio=%d/%d\nrdir_free_ratio=%d/%d\n", superblock.blockCount, superblock.FATLen, superblock.rootDir_Index,
-	superblock.dataB_startIndex, superblock.dataBCount, freeFAT, FATLength, freeRootEntries, FS_FILE_MAX_COUNT);
+	return blocks > held ? 2 * blocks - held : blocks;
+}
 
-	return 0;
+/**
+ * Free blocks that files may still take, past the ones kept for the tables
+*/
+int blocksAvailable(void)
+{
+	int reserve = metaReserve(0, 0, 0, false);
+	return freeCount > reserve ? freeCount - reserve : 0;
 }
 
-int fs_create(const char *filename)
+/**
+ * Allocate a free block, preferring the one right after near so that files
+ * grow in contiguous runs (pass FAT_EOC for no preference)
+ * In log mode the block comes from the log head instead.
+ * return FAT index of the block, or -1 if the disk is full
+*/
+int blockAlloc(int near)
 {
-	/* TODO: Phase 2 */
-	// fixed the conditions:
-	// added strlen() to filename when checking length
-	// block_disk_count is not used for checking maximum number of files, therefore deleted
-	// checking of number of files is implemented in the last part of the function
-	if (!mount || strlen(filename) >= FS_FILENAME_LEN || filename == NULL)
+	if (freeCount == 0 || (!metaSaving && blocksAvailable() == 0))
 	{
 		return -1;
 	}
-
-	int i = 0;
-	while(i < FS_FILE_MAX_COUNT)
+	if (superblock.features & FEATURE_LOG)
 	{
-		if (strcmp(rootEntries[i].filename, filename) == 0)
-		{
-			return -1;
-		}
-		i++;
+		return logAlloc();
+	}
+	if (near != FAT_EOC && near + 1 < FATLength && (freeMap[(near + 1) / 64] & ((uint64_t)1 << ((near + 1) % 64))))
+	{
+		blockTake(near + 1);
+		return near + 1;
 	}
 
-	i = 0;
-	while (i < FS_FILE_MAX_COUNT)
+	int words = (FATLength + 63) / 64;
+	for (; freeHint < words; freeHint++)
 	{
-		// cannot use filename == NULL to check for \0, use strlen instead
-		if (strlen(rootEntries[i].filename) == 0)  
+		if (freeMap[freeHint] != 0)
 		{
-			// -> is not the way to access elements in an array, change all of them to index
-			strcpy(rootEntries[i].filename, filename);
-			rootEntries[i].fileSize = 0;
-			rootEntries[i].dataStartIndex = FAT_EOC;
-			return 0;
+			int i = freeHint * 64 + __builtin_ctzll(freeMap[freeHint]);
+			blockTake(i);
+			return i;
 		}
-		i++;
 	}
-
-	// Reaching this line means no free space in rootEntries can be found
-	// Therefore meaning that there already exists 128 files
 	return -1;
 }
 
-
-int fs_delete(const char *filename)
+/**
+ * Give block i back to the free-space index, or keep it pending if the last
+ * journal transaction links it
+*/
+void blockFree(int i)
 {
-	/* TODO: Phase 2 */
-	// same checking as fs_create
-	if (!mount || strlen(filename) >= FS_FILENAME_LEN || filename == NULL)
+	dedupForget(i);
+	FAT[i] = 0;
+	if (freePending != NULL && ((const uint16_t *)metaJournal)[i] != 0)
 	{
-		return -1;
+		freePending[i / 64] |= (uint64_t)1 << (i % 64);
+		pendingCount++;
+		return;
+	}
+	freeMap[i / 64] |= (uint64_t)1 << (i % 64);
+	freeCount++;
+	if (i / 64 < freeHint)
+	{
+		freeHint = i / 64;
 	}
+}
 
-	// Implements checking if file to be deleted is currently open. This depends on datastrucure for fd
-	// fdTable stores the open file's index in rootEntries in its entryIndex field
-	// therefore, use entryIndex to access the filename of each open file in rootEntries and check if
-	// it is the same as the filename of the file to be deleted
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+/**
+ * Give the n blocks starting at FAT index start back to the free-space index,
+ * setting whole words of freeMap at once (their FAT entries must already be 0)
+*/
+void blockFreeRun(int start, int n)
+{
+	int i = start, end = start + n;
+	if (freePending != NULL)
 	{
-		if (strcmp(rootEntries[fdTable[i].entryIndex].filename, filename) == 0)
+		// with a journal, the blocks it links wait for the next transaction one by one
+		for (; i < end; i++)
 		{
-			return -1;
+			blockFree(i);
 		}
+		return;
 	}
-
-	int i = 0;
-	while (i < FS_FILE_MAX_COUNT) // replace filename null check with index i's checking
+	if (blockHash != NULL)
 	{
-		if (strcmp(rootEntries[i].filename, filename) == 0) // strcmp returns 0 if two strings match
+		for (int j = start; j < end; j++)
 		{
-			uint16_t fatIndex = rootEntries[i].dataStartIndex;
-			if (fatIndex != FAT_EOC)
-			{
-				while (FAT[fatIndex] != FAT_EOC)
-				{
-					uint16_t tempfatIndex = 0;
-					tempfatIndex = FAT[fatIndex];
-					FAT[fatIndex] = 0;
-					fatIndex = tempfatIndex;
-				}
-				FAT[fatIndex] = 0;
-			}
+			dedupForget(j);
+		}
+	}
+	for (; i < end && i % 64 != 0; i++)
+	{
+		freeMap[i / 64] |= (uint64_t)1 << (i % 64);
+	}
+	for (; i + 64 <= end; i += 64)
+	{
+		freeMap[i / 64] = ~(uint64_t)0;
+	}
+	for (; i < end; i++)
+	{
+		freeMap[i / 64] |= (uint64_t)1 << (i % 64);
+	}
+	freeCount += n;
+	if (start / 64 < freeHint)
+	{
+		freeHint = start / 64;
+	}
+}
+
+/**
+ * Drop one holder of block i, freeing it if there is no other
+ * A chain that lets go of a block it shares must set its FAT entry to FAT_EOC.
+*/
+void blockRelease(int i)
+{
+	if (blockRefs[i] > 0)
+	{
+		refPut(i);
+	}
+	else
+	{
+		blockFree(i);
+	}
+}
+
+/**
+ * Free every block of the chain starting at FATIndex
+ * Blocks that follow each other on disk are released as one run. Blocks that
+ * shared runs still point at leave the chain and only lose a reference.
+*/
+void chainFree(int FATIndex)
+{
+	while (FATIndex != FAT_EOC)
+	{
+		if (blockRefs[FATIndex] > 0)
+		{
+			int next = FAT[FATIndex];
+			FAT[FATIndex] = FAT_EOC;
+			refPut(FATIndex);
+			FATIndex = next;
+			continue;
+		}
+		int start = FATIndex, n = 0;
+		do
+		{
+			int next = FAT[FATIndex];
+			FAT[FATIndex] = 0;
+			FATIndex = next;
+			n++;
+		} while (FATIndex == start + n && blockRefs[FATIndex] == 0);
+		blockFreeRun(start, n);
+	}
+}
+
+/**
+ * Find the first run of n free blocks that are next to each other on disk
+ * return FAT index of the first block, or -1 if there is no such run
+*/
+int freeRunFind(int n)
+{
+	int runStart = -1, runLength = 0;
+	for (int i = 1; i < FATLength; i++)
+	{
+		// whole words of used blocks cannot hold any part of a run
+		if (i % 64 == 0 && freeMap[i / 64] == 0)
+		{
+			runLength = 0;
+			i += 63;
+			continue;
+		}
+		if (freeMap[i / 64] & ((uint64_t)1 << (i % 64)))
+		{
+			if (runLength == 0)
+			{
+				runStart = i;
+			}
+			if (++runLength == n)
+			{
+				return runStart;
+			}
+		}
+		else
+		{
+			runLength = 0;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Number of blocks of rootEntries[entryIndex] below logical block limit that
+ * are not in its chain, in holes or shared runs
+*/
+uint32_t holeBlocksBelow(int entryIndex, uint32_t limit)
+{
+	struct HoleList *list = &holeLists[entryIndex];
+	uint32_t total = 0;
+	for (int i = 0; i < list->count && list->holes[i].start < limit; i++)
+	{
+		uint32_t end = list->holes[i].start + list->holes[i].count;
+		total += (end < limit ? end : limit) - list->holes[i].start;
+	}
+	return total;
+}
+
+/**
+ * Find the hole or shared run of list that covers logical block block
+ * return its index in list, or -1 if the block is in the chain
+*/
+int holeIndex(const struct HoleList *list, uint32_t block)
+{
+	for (int i = 0; i < list->count && list->holes[i].start <= block; i++)
+	{
+		if (block < list->holes[i].start + list->holes[i].count)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Number of chain blocks a file of size bytes needs, leaving out its holes
+ * and its packed tail
+*/
+uint32_t chainBlocksFor(int entryIndex, uint32_t size)
+{
+	uint32_t blocks = (size + blockSize - 1) / blockSize;
+	struct RootEntry *entry = &rootEntries[entryIndex];
+	if ((entry->flags & ENTRY_TAIL) && blocks > entry->fileSize / blockSize)
+	{
+		blocks = entry->fileSize / blockSize;
+	}
+	return blocks - holeBlocksBelow(entryIndex, blocks);
+}
+
+/**
+ * Make sure list has room for count records, so that adding up to that many
+ * cannot run out of memory
+ * return 0 if successful, -1 if out of memory
+*/
+int holeListGrow(struct HoleList *list, int count)
+{
+	if (count > list->capacity)
+	{
+		int capacity = list->capacity ? list->capacity : 4;
+		while (capacity < count)
+		{
+			capacity *= 2;
+		}
+		struct Hole *holes = realloc(list->holes, sizeof(struct Hole) * capacity);
+		if (holes == NULL)
+		{
+			return -1;
+		}
+		list->holes = holes;
+		list->capacity = capacity;
+	}
+	return 0;
+}
+
+/**
+ * Make room for one more hole at position i of list
+ * return 0 if successful, -1 if out of memory
+*/
+int holeInsertAt(struct HoleList *list, int i)
+{
+	if (holeListGrow(list, list->count + 1) == -1)
+	{
+		return -1;
+	}
+	memmove(&list->holes[i + 1], &list->holes[i], sizeof(struct Hole) * (list->count - i));
+	list->count++;
+	return 0;
+}
+
+/**
+ * Record logical blocks [start, start + count) of the file whose hole list is
+ * list as a hole (block 0), or as a run shared with the blocks from FAT index
+ * block on, merging it with the record before and after when they continue it
+ * The blocks must not be in the chain, this only adds them to the list. Once
+ * mounted, and if checked is set, a new record needs room in the hole table.
+ * return 0 if successful, -1 if the hole table would not fit or out of memory
+*/
+int holeListAdd(struct HoleList *list, uint32_t start, uint32_t count, uint16_t block, bool checked)
+{
+	// records usually go at the end, look from there
+	int i = list->count;
+	for (; i > 0 && list->holes[i - 1].start >= start; i--);
+
+	struct Hole *prev = i > 0 ? &list->holes[i - 1] : NULL;
+	struct Hole *next = i < list->count ? &list->holes[i] : NULL;
+	bool before = prev != NULL && prev->start + prev->count == start
+	&& (block == 0 ? prev->block == 0 : prev->block != 0 && prev->block + prev->count == block);
+	bool after = next != NULL && start + count == next->start
+	&& (block == 0 ? next->block == 0 : next->block != 0 && block + count == next->block);
+	if (before && after)
+	{
+		prev->count += count + next->count;
+		memmove(&list->holes[i], &list->holes[i + 1], sizeof(struct Hole) * (list->count - i - 1));
+		list->count--;
+	}
+	else if (before)
+	{
+		prev->count += count;
+	}
+	else if (after)
+	{
+		next->start = start;
+		next->count += count;
+		next->block = block;
+	}
+	else
+	{
+		if ((checked && mount && freeCount < metaReserve(sizeof(struct HoleRecord), 0, 0, false)) || holeInsertAt(list, i) == -1)
+		{
+			return -1;
+		}
+		list->holes[i].start = start;
+		list->holes[i].count = count;
+		list->holes[i].block = block;
+	}
+	return 0;
+}
+
+/**
+ * Record logical blocks [start, start + count) of rootEntries[entryIndex] as a hole
+ * The blocks must not be in the chain, this only merges them into the list
+ * return 0 if successful, -1 if the hole table would not fit or out of memory
+*/
+int holeAdd(int entryIndex, uint32_t start, uint32_t count)
+{
+	return holeListAdd(&holeLists[entryIndex], start, count, 0, true);
+}
+
+/**
+ * Take logical block block out of hole or shared run i of rootEntries[entryIndex],
+ * once it has a data block in the chain
+ * return 0 if successful, -1 if out of memory
+*/
+int holeFill(int entryIndex, int i, uint32_t block)
+{
+	struct HoleList *list = &holeLists[entryIndex];
+	struct Hole *hole = &list->holes[i];
+	uint32_t end = hole->start + hole->count;
+	if (hole->count == 1)
+	{
+		memmove(&list->holes[i], &list->holes[i + 1], sizeof(struct Hole) * (list->count - i - 1));
+		list->count--;
+	}
+	else if (block == hole->start)
+	{
+		hole->start++;
+		hole->count--;
+		if (hole->block != 0)
+		{
+			hole->block++;
+		}
+	}
+	else if (block == end - 1)
+	{
+		hole->count--;
+	}
+	else
+	{
+		// split in two around block
+		if (holeInsertAt(list, i + 1) == -1)
+		{
+			return -1;
+		}
+		hole = &list->holes[i];
+		hole->count = block - hole->start;
+		list->holes[i + 1].start = block + 1;
+		list->holes[i + 1].count = end - block - 1;
+		list->holes[i + 1].block = hole->block != 0 ? hole->block + hole->count + 1 : 0;
+	}
+	return 0;
+}
+
+/**
+ * Drop the records of list at or past logical block limit, without releasing
+ * the blocks of its shared runs
+*/
+void holeListClip(struct HoleList *list, uint32_t limit)
+{
+	while (list->count > 0 && list->holes[list->count - 1].start >= limit)
+	{
+		list->count--;
+	}
+	if (list->count > 0)
+	{
+		struct Hole *last = &list->holes[list->count - 1];
+		if (last->start + last->count > limit)
+		{
+			last->count = limit - last->start;
+		}
+	}
+}
+
+/**
+ * Drop the holes and shared runs of rootEntries[entryIndex] at or past logical
+ * block limit
+*/
+void holeClip(int entryIndex, uint32_t limit)
+{
+	struct HoleList *list = &holeLists[entryIndex];
+	for (int i = list->count - 1; i >= 0 && list->holes[i].start + list->holes[i].count > limit; i--)
+	{
+		struct Hole *hole = &list->holes[i];
+		uint32_t from = hole->start > limit ? hole->start : limit;
+		for (uint32_t b = from; hole->block != 0 && b < hole->start + hole->count; b++)
+		{
+			blockRelease(hole->block + b - hole->start);
+		}
+	}
+	holeListClip(list, limit);
+}
+
+/**
+ * Forget all the holes of rootEntries[entryIndex]
+*/
+void holeClear(int entryIndex)
+{
+	free(holeLists[entryIndex].holes);
+	memset(&holeLists[entryIndex], 0, sizeof(struct HoleList));
+}
+
+/**
+ * Number of blocks the shared runs of list point at
+*/
+uint32_t holeListShared(const struct HoleList *list)
+{
+	uint32_t total = 0;
+	for (int i = 0; i < list->count; i++)
+	{
+		total += list->holes[i].block != 0 ? list->holes[i].count : 0;
+	}
+	return total;
+}
+
+/**
+ * Add a reference to every block the shared runs of list point at
+*/
+void holeListHold(const struct HoleList *list)
+{
+	for (int i = 0; i < list->count; i++)
+	{
+		for (uint32_t b = 0; list->holes[i].block != 0 && b < list->holes[i].count; b++)
+		{
+			refGet(list->holes[i].block + b);
+		}
+	}
+}
+
+/**
+ * Drop the reference of list to every block its shared runs point at
+*/
+void holeListRelease(const struct HoleList *list)
+{
+	for (int i = 0; i < list->count; i++)
+	{
+		for (uint32_t b = 0; list->holes[i].block != 0 && b < list->holes[i].count; b++)
+		{
+			blockRelease(list->holes[i].block + b);
+		}
+	}
+}
+
+/**
+ * Describe the data of entry, whose holes and shared runs are in src, without
+ * a chain: dst, which must be empty, gets the records of src and a shared run
+ * for each stretch of the chain that follows itself on disk. The packed tail
+ * is left out, and no reference is taken yet (see holeListHold).
+ * return 0 if successful, -1 if out of memory
+*/
+int holeListFreeze(struct HoleList *dst, const struct RootEntry *entry, const struct HoleList *src)
+{
+	uint32_t blocks = (entry->fileSize + blockSize - 1) / blockSize;
+	if ((entry->flags & ENTRY_TAIL) && blocks > entry->fileSize / blockSize)
+	{
+		blocks = entry->fileSize / blockSize;
+	}
+	int FATIndex = entry->dataStartIndex;
+	int h = 0;
+	for (uint32_t b = 0; b < blocks; )
+	{
+		int ret;
+		if (h < src->count && src->holes[h].start <= b)
+		{
+			const struct Hole *hole = &src->holes[h++];
+			uint32_t count = hole->start + hole->count - b;
+			if (count > blocks - b)
+			{
+				count = blocks - b;
+			}
+			ret = holeListAdd(dst, b, count, hole->block != 0 ? hole->block + b - hole->start : 0, false);
+			b += count;
+		}
+		else if (FATIndex >= 1 && FATIndex < FATLength)
+		{
+			ret = holeListAdd(dst, b, 1, FATIndex, false);
+			FATIndex = FAT[FATIndex];
+			b++;
+		}
+		else
+		{
+			// the chain is shorter than the file, fs_check tells
+			break;
+		}
+		if (ret == -1)
+		{
+			free(dst->holes);
+			memset(dst, 0, sizeof(struct HoleList));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Copy src into dst, which must be empty, with the blocks of its shared runs
+ * that moved (moved[block] != 0) pointing at their new place
+ * return 1 if a run of src points at a moved block, 0 if not (dst stays
+ * empty), -1 if out of memory
+*/
+int holeListRemap(struct HoleList *dst, const struct HoleList *src, const uint16_t *moved)
+{
+	bool touched = false;
+	for (int i = 0; i < src->count && !touched; i++)
+	{
+		for (uint32_t b = 0; src->holes[i].block != 0 && b < src->holes[i].count && !touched; b++)
+		{
+			touched = moved[src->holes[i].block + b] != 0;
+		}
+	}
+	if (!touched)
+	{
+		return 0;
+	}
+	for (int i = 0; i < src->count; i++)
+	{
+		const struct Hole *hole = &src->holes[i];
+		int ret = 0;
+		if (hole->block == 0)
+		{
+			ret = holeListAdd(dst, hole->start, hole->count, 0, false);
+		}
+		for (uint32_t b = 0; hole->block != 0 && b < hole->count && ret == 0; b++)
+		{
+			uint16_t block = moved[hole->block + b] != 0 ? moved[hole->block + b] : hole->block + b;
+			ret = holeListAdd(dst, hole->start + b, 1, block, false);
+		}
+		if (ret == -1)
+		{
+			free(dst->holes);
+			memset(dst, 0, sizeof(struct HoleList));
+			return -1;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Last partial block written to each file in log mode, so that the next small
+ * append to it does not read it back before writing its new version
+ * The copy belongs to block FAT index block: once the file's block moves, the
+ * index no longer matches and the copy is not used. Bytes past the end of the
+ * file may be stale, they are cleared as on disk.
+*/
+struct LogTail
+{
+	int block;
+	char *data;
+};
+
+struct LogTail logTails[FS_FILE_MAX_COUNT];
+
+/**
+ * Forget the copy of rootEntries[entryIndex]'s partial block, or all of them if
+ * entryIndex is -1
+*/
+void logTailDrop(int entryIndex)
+{
+	for (int i = entryIndex == -1 ? 0 : entryIndex; i < FS_FILE_MAX_COUNT; i++)
+	{
+		free(logTails[i].data);
+		logTails[i].data = NULL;
+		if (entryIndex != -1)
+		{
+			break;
+		}
+	}
+}
+
+/**
+ * Remember data as the content of block FAT index block of rootEntries[entryIndex]
+ * An allocation failure only costs a read later.
+*/
+void logTailKeep(int entryIndex, int block, const char *data)
+{
+	if (logTails[entryIndex].data == NULL)
+	{
+		logTails[entryIndex].data = malloc(blockSize);
+		if (logTails[entryIndex].data == NULL)
+		{
+			return;
+		}
+	}
+	logTails[entryIndex].block = block;
+	memcpy(logTails[entryIndex].data, data, blockSize);
+}
+
+/**
+ * Read metadata table, stored in the chain starting at superblock.metaHead[table]
+ * The table is laid out as a 32-bit byte count followed by the bytes themselves
+ * return malloc'ed table (*len set to its size), or NULL if the chain is invalid
+ * or out of memory
+*/
+void *metaLoad(int table, size_t *len)
+{
+	char block[blockSize];
+	int head = superblock.metaHead[table];
+	if (head < 1 || head >= FATLength || block_read(superblock.dataB_startIndex + head, block) == -1)
+	{
+		return NULL;
+	}
+
+	uint32_t size;
+	memcpy(&size, block, sizeof(size));
+	char *data = malloc(size ? size : 1);
+	if (data == NULL)
+	{
+		return NULL;
+	}
+
+	size_t done = 0, first = blockSize - sizeof(size);
+	memcpy(data, block + sizeof(size), size < first ? size : first);
+	done = size < first ? size : first;
+	for (int b = FAT[head]; done < size; b = FAT[b])
+	{
+		if (b < 1 || b >= FATLength || block_read(superblock.dataB_startIndex + b, block) == -1)
+		{
+			free(data);
+			return NULL;
+		}
+		size_t n = size - done < blockSize ? size - done : blockSize;
+		memcpy(data + done, block, n);
+		done += n;
+	}
+
+	*len = size;
+	metaChainBlocks[table] = metaBlocks(size);
+	return data;
+}
+
+/**
+ * Store metadata table in a fresh chain of data blocks, then free the chain
+ * that held its previous version, which stays in place if the save fails;
+ * superblock.metaHead[table] is set to the new chain (0 if len is 0)
+ * return 0 if successful, -1 if the disk is full or on I/O error
+*/
+int metaSave(int table, const void *data, uint32_t len)
+{
+	int head = 0;
+	char block[blockSize];
+	size_t total = len ? sizeof(len) + len : 0, done = 0;
+	int prev = FAT_EOC;
+	metaSaving = true;
+	while (done < total)
+	{
+		int b = blockAlloc(prev);
+		if (b == -1)
+		{
+			break;
+		}
+		if (prev == FAT_EOC)
+		{
+			head = b;
+		}
+		else
+		{
+			FAT[prev] = b;
+		}
+		prev = b;
+
+		// the first block starts with the byte count
+		memset(block, 0, blockSize);
+		size_t n;
+		if (done == 0)
+		{
+			memcpy(block, &len, sizeof(len));
+			n = len < blockSize - sizeof(len) ? len : blockSize - sizeof(len);
+			memcpy(block + sizeof(len), data, n);
+			done = sizeof(len) + n;
+		}
+		else
+		{
+			n = total - done < blockSize ? total - done : blockSize;
+			memcpy(block, (const char *)data + done - sizeof(len), n);
+			done += n;
+		}
+		if (block_write(superblock.dataB_startIndex + b, block) == -1)
+		{
+			break;
+		}
+	}
+	metaSaving = false;
+	if (done < total)
+	{
+		if (prev != FAT_EOC)
+		{
+			chainFree(head);
+		}
+		return -1;
+	}
+
+	if (superblock.metaHead[table] != 0)
+	{
+		chainFree(superblock.metaHead[table]);
+	}
+	superblock.metaHead[table] = head;
+	metaChainBlocks[table] = metaBlocks(len);
+	return 0;
+}
+
+/**
+ * Load the hole lists of all files from the hole table
+ * return 0 if successful, -1 if the table is corrupt or out of memory
+*/
+int holeTableLoad(void)
+{
+	memset(holeLists, 0, sizeof(holeLists));
+	if (superblock.metaHead[META_HOLES] == 0)
+	{
+		return 0;
+	}
+
+	size_t len;
+	struct HoleRecord *records = metaLoad(META_HOLES, &len);
+	if (records == NULL)
+	{
+		return -1;
+	}
+	for (size_t i = 0; i < len / sizeof(struct HoleRecord); i++)
+	{
+		if (records[i].entryIndex >= FS_FILE_MAX_COUNT
+		|| (records[i].block != 0 && records[i].block + records[i].count > (uint32_t)FATLength)
+		|| holeListAdd(&holeLists[records[i].entryIndex], records[i].start, records[i].count, records[i].block, false) == -1)
+		{
+			free(records);
+			return -1;
+		}
+	}
+	free(records);
+	return 0;
+}
+
+/**
+ * Write the hole lists of all files to the hole table
+ * return 0 if successful, -1 otherwise
+*/
+int holeTableSave(void)
+{
+	uint32_t count = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		count += holeLists[i].count;
+	}
+
+	struct HoleRecord *records = calloc(count ? count : 1, sizeof(struct HoleRecord));
+	if (records == NULL)
+	{
+		return -1;
+	}
+	uint32_t r = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		for (int h = 0; h < holeLists[i].count; h++, r++)
+		{
+			records[r].entryIndex = i;
+			records[r].block = holeLists[i].holes[h].block;
+			records[r].start = holeLists[i].holes[h].start;
+			records[r].count = holeLists[i].holes[h].count;
+		}
+	}
+	int ret = metaSave(META_HOLES, records, count * sizeof(struct HoleRecord));
+	free(records);
+	return ret;
+}
+
+/**
+ * Allocate blockRefs and load it from the reference table
+ * return 0 if successful, -1 if the table is corrupt or out of memory
+*/
+int refTableLoad(void)
+{
+	blockRefs = calloc(FATLength, sizeof(uint16_t));
+	sharedCount = 0;
+	if (blockRefs == NULL)
+	{
+		return -1;
+	}
+	if (superblock.metaHead[META_REFS] == 0)
+	{
+		return 0;
+	}
+
+	size_t len;
+	struct RefRecord *records = metaLoad(META_REFS, &len);
+	if (records == NULL)
+	{
+		return -1;
+	}
+	for (size_t i = 0; i < len / sizeof(struct RefRecord); i++)
+	{
+		if (records[i].block < 1 || records[i].block >= FATLength || FAT[records[i].block] == 0)
+		{
+			free(records);
+			return -1;
+		}
+		if (blockRefs[records[i].block] == 0 && records[i].refs > 0)
+		{
+			sharedCount++;
+		}
+		blockRefs[records[i].block] = records[i].refs;
+	}
+	free(records);
+	return 0;
+}
+
+/**
+ * Write the blocks that have extra references to the reference table
+ * return 0 if successful, -1 otherwise
+*/
+int refTableSave(void)
+{
+	struct RefRecord *records = calloc(sharedCount ? sharedCount : 1, sizeof(struct RefRecord));
+	if (records == NULL)
+	{
+		return -1;
+	}
+	int r = 0;
+	for (int i = 1; i < FATLength && r < sharedCount; i++)
+	{
+		if (blockRefs[i] > 0)
+		{
+			records[r].block = i;
+			records[r].refs = blockRefs[i];
+			r++;
+		}
+	}
+	int ret = metaSave(META_REFS, records, r * sizeof(struct RefRecord));
+	free(records);
+	return ret;
+}
+
+/**
+ * Free the hole lists of snap
+*/
+void snapshotClear(struct Snapshot *snap)
+{
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		free(snap->holes[i].holes);
+	}
+}
+
+/**
+ * Load all snapshots from the snapshot table
+ * return 0 if successful, -1 if the table is corrupt or out of memory
+*/
+int snapshotTableLoad(void)
+{
+	snapshots = NULL;
+	snapshotCount = 0;
+	snapshotBytes = 0;
+	if (superblock.metaHead[META_SNAPSHOTS] == 0)
+	{
+		return 0;
+	}
+
+	size_t len;
+	char *table = metaLoad(META_SNAPSHOTS, &len);
+	if (table == NULL)
+	{
+		return -1;
+	}
+	for (size_t pos = 0; pos < len; )
+	{
+		struct SnapshotHeader header;
+		size_t entriesLen = sizeof(struct RootEntry) * FS_FILE_MAX_COUNT;
+		if (len - pos < sizeof(header) + entriesLen)
+		{
+			free(table);
+			return -1;
+		}
+		memcpy(&header, table + pos, sizeof(header));
+		pos += sizeof(header);
+
+		struct Snapshot *grown = realloc(snapshots, sizeof(struct Snapshot) * (snapshotCount + 1));
+		if (grown == NULL)
+		{
+			free(table);
+			return -1;
+		}
+		snapshots = grown;
+		struct Snapshot *snap = &snapshots[snapshotCount++];
+		memset(snap->holes, 0, sizeof(snap->holes));
+		snap->generation = header.generation;
+		memcpy(snap->entries, table + pos, entriesLen);
+		pos += entriesLen;
+
+		for (uint32_t h = 0; h < header.holeCount; h++)
+		{
+			struct HoleRecord record;
+			if (len - pos < sizeof(record))
+			{
+				free(table);
+				return -1;
+			}
+			memcpy(&record, table + pos, sizeof(record));
+			pos += sizeof(record);
+
+			if (record.entryIndex >= FS_FILE_MAX_COUNT
+			|| (record.block != 0 && record.block + record.count > (uint32_t)FATLength))
+			{
+				free(table);
+				return -1;
+			}
+			struct HoleList *list = &snap->holes[record.entryIndex];
+			if (holeInsertAt(list, list->count) == -1)
+			{
+				free(table);
+				return -1;
+			}
+			list->holes[list->count - 1].start = record.start;
+			list->holes[list->count - 1].count = record.count;
+			list->holes[list->count - 1].block = record.block;
+		}
+	}
+	free(table);
+	snapshotBytes = len;
+	return 0;
+}
+
+/**
+ * Write all snapshots to the snapshot table, each as a header, its root
+ * directory and its hole records
+ * return 0 if successful, -1 otherwise
+*/
+int snapshotTableSave(void)
+{
+	size_t len = snapshotBytes;
+	if (len > UINT32_MAX)
+	{
+		return -1;
+	}
+
+	char *table = malloc(len ? len : 1);
+	if (table == NULL)
+	{
+		return -1;
+	}
+	size_t pos = 0;
+	for (int s = 0; s < snapshotCount; s++)
+	{
+		struct Snapshot *snap = &snapshots[s];
+		struct SnapshotHeader header = { snap->generation, 0 };
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+		{
+			header.holeCount += snap->holes[i].count;
+		}
+		memcpy(table + pos, &header, sizeof(header));
+		pos += sizeof(header);
+		memcpy(table + pos, snap->entries, sizeof(snap->entries));
+		pos += sizeof(snap->entries);
+
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+		{
+			for (int h = 0; h < snap->holes[i].count; h++)
+			{
+				struct Hole *hole = &snap->holes[i].holes[h];
+				struct HoleRecord record = { i, 0, hole->block, hole->start, hole->count };
+				memcpy(table + pos, &record, sizeof(record));
+				pos += sizeof(record);
+			}
+		}
+	}
+	int ret = metaSave(META_SNAPSHOTS, table, len);
+	free(table);
+	return ret;
+}
+
+/**
+ * Allocate blockGen and load it from the generation table
+ * Until the first snapshot every block is at generation 0 and there is no table.
+ * return 0 if successful, -1 if the table is corrupt or out of memory
+*/
+int genTableLoad(void)
+{
+	blockGen = calloc(FATLength, sizeof(uint32_t));
+	if (blockGen == NULL)
+	{
+		return -1;
+	}
+	if (superblock.metaHead[META_GENERATIONS] == 0)
+	{
+		return 0;
+	}
+
+	size_t len;
+	struct GenRecord *records = metaLoad(META_GENERATIONS, &len);
+	if (records == NULL)
+	{
+		return -1;
+	}
+	for (size_t i = 0; i < len / sizeof(struct GenRecord); i++)
+	{
+		if (records[i].start < 1 || records[i].start + records[i].count > FATLength)
+		{
+			free(records);
+			return -1;
+		}
+		for (int b = records[i].start; b < records[i].start + records[i].count; b++)
+		{
+			blockGen[b] = records[i].generation;
+		}
+	}
+	free(records);
+	return 0;
+}
+
+/**
+ * Write blockGen to the generation table, as runs of blocks that share the same
+ * generation (blocks at generation 0 are left out)
+ * The blocks the table itself lands on are not in it, fs_snapshot_diff always
+ * reports the metadata tables.
+ * return 0 if successful, -1 otherwise
+*/
+int genTableSave(void)
+{
+	if (superblock.generation == 0)
+	{
+		return metaSave(META_GENERATIONS, NULL, 0);
+	}
+
+	int count = 0;
+	for (int i = 1; i < FATLength; i++)
+	{
+		if (blockGen[i] != 0 && blockGen[i] != blockGen[i - 1])
+		{
+			count++;
+		}
+	}
+	struct GenRecord *records = calloc(count ? count : 1, sizeof(struct GenRecord));
+	if (records == NULL)
+	{
+		return -1;
+	}
+	int r = -1;
+	for (int i = 1; i < FATLength; i++)
+	{
+		if (blockGen[i] == 0)
+		{
+			continue;
+		}
+		if (r == -1 || blockGen[i] != records[r].generation || records[r].start + records[r].count != i)
+		{
+			records[++r].start = i;
+			records[r].generation = blockGen[i];
+		}
+		records[r].count++;
+	}
+	int ret = metaSave(META_GENERATIONS, records, (r + 1) * sizeof(struct GenRecord));
+	free(records);
+	return ret;
+}
+
+/**
+ * Store every metadata table, generations last so that it sees the blocks the
+ * other tables were written to
+ * return 0 if successful, -1 otherwise
+*/
+int metaTablesSave(void)
+{
+	if (holeTableSave() == -1 || snapshotTableSave() == -1 || refTableSave() == -1 || genTableSave() == -1)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Release the blocks of rootEntries[entryIndex] that lie past its file size
+*/
+void chainTrim(int entryIndex)
+{
+	struct RootEntry *entry = &rootEntries[entryIndex];
+	uint32_t keep = chainBlocksFor(entryIndex, entry->fileSize);
+	if (keep == 0)
+	{
+		chainFree(entry->dataStartIndex);
+		entry->dataStartIndex = FAT_EOC;
+		return;
+	}
+
+	int last = entry->dataStartIndex;
+	for (uint32_t i = 1; i < keep && last != FAT_EOC; i++)
+	{
+		last = FAT[last];
+	}
+	if (last != FAT_EOC)
+	{
+		chainFree(FAT[last]);
+		FAT[last] = FAT_EOC;
+	}
+}
+
+/**
+ * Grow fdTable to newSize entries and push the new entries onto the free list
+ * return 0 if successful, -1 if out of memory
+*/
+int fdTableGrow(int newSize)
+{
+	struct FileDescriptor *table = realloc(fdTable, sizeof(struct FileDescriptor) * newSize);
+	if (table == NULL)
+	{
+		return -1;
+	}
+	fdTable = table;
+
+	// push in reverse so that the lowest new fd is handed out first
+	for (int fd = newSize - 1; fd >= fdTableSize; fd--)
+	{
+		fdTable[fd].entryIndex = FD_EMPTY;
+		fdTable[fd].nextFree = fdFreeHead;
+		fdFreeHead = fd;
+	}
+	fdTableSize = newSize;
+	return 0;
+}
+
+/**
+ * Check that fd refers to a currently open file
+*/
+bool fdValid(int fd)
+{
+	return mount && fd >= 0 && fd < fdTableSize && fdTable[fd].entryIndex != FD_EMPTY;
+}
+
+/**
+ * Find last FAT block of a file
+ * return FAT block index, or FAT_EOC if file length is 0
+*/
+int findFATEnd(int fd)
+{
+	int FATEnd = rootEntries[fdTable[fd].entryIndex].dataStartIndex;
+	if (FATEnd == FAT_EOC)
+	{
+		return FAT_EOC;
+	}
+	for (; FAT[FATEnd] != FAT_EOC; FATEnd = FAT[FATEnd]);
+	return FATEnd;
+}
+
+/**
+ * Find the FAT block holding byte *offset of the file pointed to by fd
+ * *offset is reduced to the offset within that block, and *prev is set to the
+ * block before it in the chain (FAT_EOC if there is none)
+ * return FAT block index, or FAT_EOC if the chain ends before *offset
+*/
+int findFATStart(int fd, long *offset, int *prev)
+{
+	int FATStart = rootEntries[fdTable[fd].entryIndex].dataStartIndex;
+	*prev = FAT_EOC;
+	while (*offset >= blockSize && FATStart != FAT_EOC)
+	{
+		*offset -= blockSize;
+		*prev = FATStart;
+		FATStart = FAT[FATStart];
+	}
+	return FATStart;
+}
+
+/**
+ * Allocate a new block for file pointed to by fd and link it after FATEnd,
+ * the current last block of the file (FAT_EOC if the file has no blocks)
+ * return FAT index of new space if successful
+ * return -1 if no space to allocate
+*/
+int falloc(int fd, int FATEnd)
+{
+	// Find index for the new block
+	int i = blockAlloc(FATEnd);
+	if (i == -1)
+	{
+		return -1;
+	}
+	if (FATEnd == FAT_EOC)
+	{
+		rootEntries[fdTable[fd].entryIndex].dataStartIndex = i;
+	}
+	else
+	{
+		FAT[FATEnd] = i;
+	}
+	return i;
+}
+
+/* Maximum number of buffer pieces gathered into one vectored block request */
+#define RUN_IOV_MAX 256
+
+/**
+ * Position inside a caller's iovec array
+*/
+struct IovCursor
+{
+	const struct iovec *iov;
+	int iovcnt;
+	int index;
+	size_t offset;
+};
+
+/**
+ * Copy len bytes between the cursor position and buf, then advance the cursor
+ * toIov selects the direction: true copies buf into the iovecs
+*/
+void iovCopy(struct IovCursor *cur, char *buf, size_t len, bool toIov)
+{
+	while (len > 0)
+	{
+		const struct iovec *v = &cur->iov[cur->index];
+		size_t n = v->iov_len - cur->offset;
+		if (n > len)
+		{
+			n = len;
+		}
+		if (toIov)
+		{
+			memcpy((char *)v->iov_base + cur->offset, buf, n);
+		}
+		else
+		{
+			memcpy(buf, (char *)v->iov_base + cur->offset, n);
+		}
+		buf += n;
+		len -= n;
+		cur->offset += n;
+		if (cur->offset == v->iov_len)
+		{
+			cur->index++;
+			cur->offset = 0;
+		}
+	}
+}
+
+/**
+ * Describe the next len bytes at the cursor as at most max pieces in out
+ * the cursor only advances if the bytes fit
+ * return number of pieces used, or -1 if more than max pieces are needed
+*/
+int iovSlice(struct IovCursor *cur, size_t len, struct iovec *out, int max)
+{
+	int index = cur->index;
+	size_t offset = cur->offset;
+	int pieces = 0;
+	while (len > 0)
+	{
+		const struct iovec *v = &cur->iov[index];
+		size_t n = v->iov_len - offset;
+		if (n > len)
+		{
+			n = len;
+		}
+		if (n > 0)
+		{
+			if (pieces == max)
+			{
+				return -1;
+			}
+			out[pieces].iov_base = (char *)v->iov_base + offset;
+			out[pieces].iov_len = n;
+			pieces++;
+		}
+		len -= n;
+		offset += n;
+		if (offset == v->iov_len)
+		{
+			index++;
+			offset = 0;
+		}
+	}
+	cur->index = index;
+	cur->offset = offset;
+	return pieces;
+}
+
+/**
+ * Issue a run of whole blocks, contiguous on disk from FAT index runStart, as one request
+ * return 0 if successful, -1 otherwise
+*/
+int flushRun(int runStart, const struct iovec *run, int runPieces, bool write)
+{
+	if (write)
+	{
+		return block_writev(superblock.dataB_startIndex + runStart, run, runPieces);
+	}
+	return block_readv(superblock.dataB_startIndex + runStart, run, runPieces);
+}
+
+/* Longest last block that is packed into a tail block */
+#define TAIL_MAX (blockSize / 2)
+
+/**
+ * Byte range of a tail block holding the packed last block of one or more
+ * files: clones and snapshots point at the same range, refs counts them
+*/
+struct TailSlot
+{
+	uint16_t offset;
+	uint16_t length;
+	uint32_t refs;
+};
+
+/**
+ * A data block shared by packed tails, outside of any chain
+ * Its slots are sorted by offset and never overlap. The table lives in memory
+ * only, it is rebuilt from the root entries and snapshots at mount.
+*/
+struct TailBlock
+{
+	uint16_t block;
+	int count;
+	int capacity;
+	struct TailSlot *slots;
+};
+
+struct TailBlock *tailBlocks;
+int tailBlockCount;
+
+/**
+ * Last tail block read or written, small files are read from it without I/O
+ * block is FAT_EOC while the cache is empty, data takes one block and is
+ * allocated at mount.
+*/
+struct TailCache
+{
+	int block;
+	char *data;
+};
+
+struct TailCache tailCache = { FAT_EOC, NULL };
+
+/**
+ * Find the tail block whose data block is block
+ * return its index in tailBlocks, or -1 if block is not a tail block
+*/
+int tailFind(int block)
+{
+	for (int t = 0; t < tailBlockCount; t++)
+	{
+		if (tailBlocks[t].block == block)
+		{
+			return t;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Add a reference to the slot of length bytes at offset in tail block block,
+ * making it a tail block and adding the slot if needed
+ * return 0 if successful, -1 if out of memory
+*/
+int tailSlotGet(int block, uint16_t offset, uint16_t length)
+{
+	int t = tailFind(block);
+	if (t == -1)
+	{
+		struct TailBlock *grown = realloc(tailBlocks, sizeof(struct TailBlock) * (tailBlockCount + 1));
+		if (grown == NULL)
+		{
+			return -1;
+		}
+		tailBlocks = grown;
+		t = tailBlockCount++;
+		memset(&tailBlocks[t], 0, sizeof(struct TailBlock));
+		tailBlocks[t].block = block;
+	}
+
+	struct TailBlock *tail = &tailBlocks[t];
+	int i = 0;
+	for (; i < tail->count && tail->slots[i].offset < offset; i++);
+	if (i < tail->count && tail->slots[i].offset == offset)
+	{
+		tail->slots[i].refs++;
+		return 0;
+	}
+	if (tail->count == tail->capacity)
+	{
+		int capacity = tail->capacity ? tail->capacity * 2 : 4;
+		struct TailSlot *slots = realloc(tail->slots, sizeof(struct TailSlot) * capacity);
+		if (slots == NULL)
+		{
+			return -1;
+		}
+		tail->slots = slots;
+		tail->capacity = capacity;
+	}
+	memmove(&tail->slots[i + 1], &tail->slots[i], sizeof(struct TailSlot) * (tail->count - i));
+	tail->slots[i] = (struct TailSlot){ offset, length, 1 };
+	tail->count++;
+	return 0;
+}
+
+/**
+ * Drop a reference to the slot at offset in tail block block, freeing the
+ * block once its last slot is gone
+*/
+void tailSlotPut(int block, uint16_t offset)
+{
+	int t = tailFind(block);
+	if (t == -1)
+	{
+		return;
+	}
+	struct TailBlock *tail = &tailBlocks[t];
+	int i = 0;
+	for (; i < tail->count && tail->slots[i].offset != offset; i++);
+	if (i == tail->count || --tail->slots[i].refs > 0)
+	{
+		return;
+	}
+	memmove(&tail->slots[i], &tail->slots[i + 1], sizeof(struct TailSlot) * (tail->count - i - 1));
+	tail->count--;
+	if (tail->count == 0)
+	{
+		free(tail->slots);
+		blockFree(block);
+		if (tailCache.block == block)
+		{
+			tailCache.block = FAT_EOC;
+		}
+		tailBlocks[t] = tailBlocks[--tailBlockCount];
+	}
+}
+
+/**
+ * Forget every tail block, without freeing their data blocks
+*/
+void tailTableClear(void)
+{
+	for (int t = 0; t < tailBlockCount; t++)
+	{
+		free(tailBlocks[t].slots);
+	}
+	free(tailBlocks);
+	tailBlocks = NULL;
+	tailBlockCount = 0;
+	tailCache.block = FAT_EOC;
+}
+
+/**
+ * Tell if entry points at a packed tail that lies inside an allocated block
+*/
+bool tailValid(const struct RootEntry *entry)
+{
+	uint32_t length = entry->fileSize % blockSize;
+	return length > 0 && length <= TAIL_MAX && entry->tailOffset + length <= blockSize
+	&& entry->tailBlock >= 1 && entry->tailBlock < FATLength && FAT[entry->tailBlock] != 0;
+}
+
+/**
+ * Build the tail table from the packed tails of the files and snapshots
+ * Tails that do not point inside an allocated block are left for fs_check.
+ * return 0 if successful, -1 if out of memory
+*/
+int tailTableBuild(void)
+{
+	tailBlocks = NULL;
+	tailBlockCount = 0;
+	for (int s = -1; s < snapshotCount; s++)
+	{
+		struct RootEntry *entries = s == -1 ? rootEntries : snapshots[s].entries;
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+		{
+			struct RootEntry *entry = &entries[i];
+			if (entry->filename[0] != '\0' && (entry->flags & ENTRY_TAIL) && tailValid(entry)
+			&& tailSlotGet(entry->tailBlock, entry->tailOffset, entry->fileSize % blockSize) == -1)
+			{
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * Load tail block block into tailCache
+ * return the cached data, or NULL on I/O error
+*/
+char *tailLoad(int block)
+{
+	if (tailCache.block != block)
+	{
+		if (block_read(superblock.dataB_startIndex + block, tailCache.data) == -1)
+		{
+			tailCache.block = FAT_EOC;
+			return NULL;
+		}
+		tailCache.block = block;
+	}
+	return tailCache.data;
+}
+
+/**
+ * Pack the last block of rootEntries[entryIndex] into a tail block, if it
+ * holds at most TAIL_MAX bytes. It goes into the first tail block with a
+ * large enough gap, or becomes a new tail block itself if there is none.
+ * Files that are compressed, or whose last block is shared, are left as they are.
+ * return 0 if successful, -1 on I/O error or if out of memory
+*/
+int tailPack(int entryIndex)
+{
+	struct RootEntry *entry = &rootEntries[entryIndex];
+	uint32_t length = entry->fileSize % blockSize;
+	uint32_t last = entry->fileSize / blockSize;
+	if ((entry->flags & (ENTRY_COMPRESSED | ENTRY_TAIL)) || length == 0 || length > TAIL_MAX
+	|| holeBlocksBelow(entryIndex, last + 1) != holeBlocksBelow(entryIndex, last))
+	{
+		return 0;
+	}
+
+	// the chain is cut before its last block, which must be this file's own
+	int prev = FAT_EOC;
+	int b = entry->dataStartIndex;
+	for (; b != FAT_EOC && FAT[b] != FAT_EOC; prev = b, b = FAT[b]);
+	if (b == FAT_EOC || blockRefs[b] > 0)
+	{
+		return 0;
+	}
+
+	// the partial block leaves the chain
+	logTailDrop(entryIndex);
+
+	// first fit among the gaps of the tail blocks
+	int block = FAT_EOC;
+	uint16_t offset = 0;
+	for (int t = 0; t < tailBlockCount && block == FAT_EOC; t++)
+	{
+		uint32_t pos = 0;
+		for (int i = 0; i <= tailBlocks[t].count; i++)
+		{
+			uint32_t end = i < tailBlocks[t].count ? tailBlocks[t].slots[i].offset : blockSize;
+			if (end - pos >= length)
+			{
+				block = tailBlocks[t].block;
+				offset = pos;
+				break;
+			}
+			if (i < tailBlocks[t].count)
+			{
+				pos = tailBlocks[t].slots[i].offset + tailBlocks[t].slots[i].length;
+			}
+		}
+	}
+
+	if (block == FAT_EOC)
+	{
+		// the last block becomes a tail block, its data is already in place
+		if (tailSlotGet(b, 0, length) == -1)
+		{
+			return -1;
+		}
+		block = b;
+	}
+	else
+	{
+		char data[blockSize];
+		char *tail = tailLoad(block);
+		if (tail == NULL || block_read(superblock.dataB_startIndex + b, data) == -1)
+		{
+			return -1;
+		}
+		memcpy(tail + offset, data, length);
+		if (block_write(superblock.dataB_startIndex + block, tail) == -1)
+		{
+			tailCache.block = FAT_EOC;
+			return -1;
+		}
+		if (tailSlotGet(block, offset, length) == -1)
+		{
+			return -1;
+		}
+		blockGen[block] = superblock.generation;
+		blockFree(b);
+	}
+	dedupForget(block);
+
+	if (prev == FAT_EOC)
+	{
+		entry->dataStartIndex = FAT_EOC;
+	}
+	else
+	{
+		FAT[prev] = FAT_EOC;
+	}
+	entry->tailBlock = block;
+	entry->tailOffset = offset;
+	entry->flags |= ENTRY_TAIL;
+	return 0;
+}
+
+/**
+ * Move the packed tail of rootEntries[entryIndex] back into a block of its
+ * own at the end of its chain, before the file changes
+ * return 0 if successful, -1 if the disk is full or on I/O error
+*/
+int tailUnpack(int entryIndex)
+{
+	struct RootEntry *entry = &rootEntries[entryIndex];
+	if (!(entry->flags & ENTRY_TAIL))
+	{
+		return 0;
+	}
+	int last = entry->dataStartIndex;
+	for (; last != FAT_EOC && FAT[last] != FAT_EOC; last = FAT[last]);
+
+	char bounce[blockSize];
+	uint32_t length = entry->fileSize % blockSize;
+	char *tail = tailLoad(entry->tailBlock);
+	if (tail == NULL)
+	{
+		return -1;
+	}
+	memcpy(bounce, tail + entry->tailOffset, length);
+	memset(bounce + length, 0, blockSize - length);
+
+	int b = blockAlloc(last);
+	if (b == -1)
+	{
+		return -1;
+	}
+	if (block_write(superblock.dataB_startIndex + b, bounce) == -1)
+	{
+		blockFree(b);
+		return -1;
+	}
+	if (blockHash != NULL)
+	{
+		dedupAdd(b, blockHashOf(bounce));
+	}
+	if (last == FAT_EOC)
+	{
+		entry->dataStartIndex = b;
+	}
+	else
+	{
+		FAT[last] = b;
+	}
+	tailSlotPut(entry->tailBlock, entry->tailOffset);
+	entry->flags &= ~ENTRY_TAIL;
+	return 0;
+}
+
+/**
+ * Zero the bytes of rootEntries[entryIndex] between its size and the end of its
+ * last block, before the file grows past them without writing them
+ * Blocks are reused without being cleared, so those bytes may hold stale data
+ * return 0 if successful, -1 if the last block was shared and could not be
+ * copied, or on I/O error
+*/
+int zeroTail(int entryIndex)
+{
+	struct RootEntry *entry = &rootEntries[entryIndex];
+	struct HoleList *holes = &holeLists[entryIndex];
+	uint32_t last = entry->fileSize / blockSize;
+	uint32_t tail = entry->fileSize % blockSize;
+	if (tail == 0)
+	{
+		return 0;
+	}
+	int h = holeIndex(holes, last);
+	if (h != -1 && holes->holes[h].block == 0)
+	{
+		// the last block is a hole, it already reads back as zeros
+		return 0;
+	}
+
+	// the block's place in the chain, or where it goes if it is in a shared run
+	uint32_t index = last - holeBlocksBelow(entryIndex, last);
+	int prev = FAT_EOC;
+	int FATIndex = entry->dataStartIndex;
+	for (uint32_t i = 0; i < index && FATIndex != FAT_EOC; i++)
+	{
+		prev = FATIndex;
+		FATIndex = FAT[FATIndex];
+	}
+	int old = h != -1 ? (int)(holes->holes[h].block + (last - holes->holes[h].start)) : FATIndex;
+	if (old == FAT_EOC)
+	{
+		return 0;
+	}
+
+	char bounce[blockSize];
+	if (block_read(superblock.dataB_startIndex + old, bounce) == -1)
+	{
+		return -1;
+	}
+	memset(bounce + tail, 0, blockSize - tail);
+
+	// a shared block is copied, the copy takes its place in the file
+	int b = old;
+	if (h != -1 || blockRefs[old] > 0)
+	{
+		b = blockAlloc(prev);
+		if (b == -1)
+		{
+			return -1;
+		}
+	}
+	if (block_write(superblock.dataB_startIndex + b, bounce) == -1)
+	{
+		if (b != old)
+		{
+			blockFree(b);
+		}
+		return -1;
+	}
+	if (h != -1)
+	{
+		if (holeFill(entryIndex, h, last) == -1)
+		{
+			blockFree(b);
+			return -1;
+		}
+		FAT[b] = FATIndex;
+	}
+	else if (b != old)
+	{
+		FAT[b] = FAT[old];
+		FAT[old] = FAT_EOC;
+	}
+	if (b != old)
+	{
+		if (prev == FAT_EOC)
+		{
+			entry->dataStartIndex = b;
+		}
+		else
+		{
+			FAT[prev] = b;
+		}
+		blockRelease(old);
+	}
+	blockGen[b] = superblock.generation;
+	if (blockHash != NULL)
+	{
+		dedupAdd(b, blockHashOf(bounce));
+	}
+	return 0;
+}
+
+/**
+ * Set the size of rootEntries[entryIndex] to length bytes, as stored on disk
+ * A file that grows gets a hole, the same as a write past its end; a file
+ * that shrinks has its chain cut and the tail released.
+ * return 0 if successful, -1 if a shared last block could not be copied, out
+ * of memory or on I/O error
+*/
+int entryTruncate(int entryIndex, uint32_t length)
+{
+	struct RootEntry *entry = &rootEntries[entryIndex];
+	uint32_t oldBlocks = (entry->fileSize + blockSize - 1) / blockSize;
+	uint32_t newBlocks = (length + blockSize - 1) / blockSize;
+	if (tailUnpack(entryIndex) == -1)
+	{
+		return -1;
+	}
+	if (length > entry->fileSize)
+	{
+		if (zeroTail(entryIndex) == -1)
+		{
+			return -1;
+		}
+		if (newBlocks > oldBlocks && holeAdd(entryIndex, oldBlocks, newBlocks - oldBlocks) == -1)
+		{
+			return -1;
+		}
+		entry->fileSize = length;
+		return 0;
+	}
+
+	// cut the chain after the last block still in use and release the tail
+	entry->fileSize = length;
+	holeClip(entryIndex, newBlocks);
+	chainTrim(entryIndex);
+	return 0;
+}
+
+/**
+ * Move count bytes between rootEntries[entryIndex] (from byte pos) and the
+ * buffers in iov, walking the FAT chain only once.
+ * Whole blocks that sit next to each other on disk are gathered into a single
+ * block_readv/block_writev, only a partial first or last block goes through
+ * the bounce buffer.
+ * Holes read back as zeros; writing into a hole gives that block a data block,
+ * linked into the chain at its place in the file. Writing past the end of the
+ * file leaves the skipped whole blocks as a hole. A block shared with a
+ * clone or a snapshot is read where it is, and copied into the chain when it
+ * is written: only that block, the rest of the run stays shared. In dedup
+ * mode a whole block whose data is already on disk is shared instead of written.
+ * return number of bytes transferred
+*/
+long entryTransfer(int entryIndex, uint32_t pos, const struct iovec *iov, int iovcnt, size_t count, bool write)
+{
+	struct RootEntry *entry = &rootEntries[entryIndex];
+	struct HoleList *holes = &holeLists[entryIndex];
+	struct IovCursor cursor = { iov, iovcnt, 0, 0 };
+	char bounce[blockSize];
+	uint32_t oldSize = entry->fileSize;
+
+	// reads stop at the end of the file, writes at the largest file size
+	if (!write)
+	{
+		if (pos >= oldSize)
+		{
+			return 0;
+		}
+		if (oldSize - pos < count)
+		{
+			count = oldSize - pos;
+		}
+	}
+	else if (count > UINT32_MAX - pos)
+	{
+		count = UINT32_MAX - pos;
+	}
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	// a packed tail is read straight from its tail block, and moved back into the chain before a write
+	size_t tailBytes = 0;
+	if (entry->flags & ENTRY_TAIL)
+	{
+		if (write)
+		{
+			if (tailUnpack(entryIndex) == -1)
+			{
+				return 0;
+			}
+		}
+		else
+		{
+			uint32_t tailStart = oldSize / blockSize * blockSize;
+			if (pos + count > tailStart)
+			{
+				tailBytes = pos + count - (pos > tailStart ? pos : tailStart);
+				count -= tailBytes;
+			}
+		}
+	}
+
+	uint32_t block = pos / blockSize;
+	long offset = pos % blockSize;
+	if (write && pos > oldSize)
+	{
+		// the gap between the old end and pos reads back as zeros
+		uint32_t oldBlocks = (oldSize + blockSize - 1) / blockSize;
+		if (block > oldSize / blockSize && zeroTail(entryIndex) == -1)
+		{
+			return 0;
+		}
+		if (block > oldBlocks && holeAdd(entryIndex, oldBlocks, block - oldBlocks) == -1)
+		{
+			return 0;
+		}
+	}
+
+	// skip the holes before block, and find its place in the chain
+	int h = 0;
+	uint32_t holeBlocks = 0;
+	for (; h < holes->count && holes->holes[h].start + holes->holes[h].count <= block; h++)
+	{
+		holeBlocks += holes->holes[h].count;
+	}
+	uint32_t index = block - holeBlocks;
+	if (h < holes->count && holes->holes[h].start <= block)
+	{
+		index = holes->holes[h].start - holeBlocks;
+	}
+	int prev = FAT_EOC;
+	int FATIndex = entry->dataStartIndex;
+	for (uint32_t i = 0; i < index && FATIndex != FAT_EOC; i++)
+	{
+		prev = FATIndex;
+		FATIndex = FAT[FATIndex];
+	}
+
+	// pending run of whole blocks, contiguous on disk starting at runStart
+	struct iovec run[RUN_IOV_MAX];
+	int runPieces = 0, runStart = 0, runBlocks = 0;
+	size_t done = 0, runDone = 0;
+
+	for (; done < count; block++)
+	{
+		size_t n = blockSize - offset;
+		if (n > count - done)
+		{
+			n = count - done;
+		}
+
+		bool inHole = h < holes->count && holes->holes[h].start <= block;
+		int shared = FAT_EOC;
+		if (inHole && holes->holes[h].block != 0)
+		{
+			shared = holes->holes[h].block + (block - holes->holes[h].start);
+		}
+		if (inHole && shared == FAT_EOC && !write)
+		{
+			memset(bounce, 0, blockSize);
+			iovCopy(&cursor, bounce, n, true);
+			done += n;
+			offset = 0;
+			if (holes->holes[h].start + holes->holes[h].count == block + 1)
+			{
+				h++;
+			}
+			continue;
+		}
+
+		if (write && n == blockSize && blockHash != NULL)
+		{
+			// in dedup mode a block whose data is already on disk is shared, not written
+			struct IovCursor peek = cursor;
+			iovCopy(&peek, bounce, blockSize, false);
+			int old = inHole ? shared : FATIndex;
+			bool loaded = true;
+			int match = dedupFind(old, blockHashOf(bounce), bounce, &loaded);
+			if (match != -1 && holeListGrow(holes, holes->count + 2) == 0
+			&& freeCount >= metaReserve(sizeof(struct HoleRecord), sizeof(struct RefRecord), 0, false))
+			{
+				// the list has room, neither the fill nor the add can fail
+				if (inHole)
+				{
+					holeFill(entryIndex, h, block);
+				}
+				else if (FATIndex != FAT_EOC)
+				{
+					// the block leaves the chain
+					int next = FAT[FATIndex];
+					if (prev == FAT_EOC)
+					{
+						entry->dataStartIndex = next;
+					}
+					else
+					{
+						FAT[prev] = next;
+					}
+					FAT[FATIndex] = FAT_EOC;
+					FATIndex = next;
+				}
+				holeListAdd(holes, block, 1, match, false);
+				refGet(match);
+				if (old != FAT_EOC)
+				{
+					blockRelease(old);
+				}
+				// the run may have merged into the record before it
+				for (h = h > 0 ? h - 1 : 0; h < holes->count && holes->holes[h].start + holes->holes[h].count <= block + 1; h++);
+				cursor = peek;
+				done += n;
+				continue;
+			}
+		}
+
+		// a block that starts at or past the old end has nothing worth reading,
+		// neither has a hole; a shared block is read where it is
+		bool fresh = (uint64_t)block * blockSize >= oldSize || (inHole ? shared == FAT_EOC : FATIndex == FAT_EOC);
+		int dataIndex = inHole ? shared : FATIndex;
+		int oldIndex = dataIndex;
+		bool logged = !fresh && (superblock.features & FEATURE_LOG);
+		if (!write)
+		{
+			if (dataIndex == FAT_EOC)
+			{
+				break;
+			}
+		}
+		else if (shared != FAT_EOC && blockRefs[shared] == 0 && !logged)
+		{
+			// the last holder of a shared block takes it back into its chain
+			if (holeFill(entryIndex, h, block) == -1)
+			{
+				break;
+			}
+			FAT[shared] = FATIndex;
+			if (prev == FAT_EOC)
+			{
+				entry->dataStartIndex = shared;
+			}
+			else
+			{
+				FAT[prev] = shared;
+			}
+			FATIndex = dataIndex = shared;
+		}
+		else if (inHole || FATIndex == FAT_EOC || blockRefs[FATIndex] > 0 || logged)
+		{
+			// a new block for a hole, the end of the chain, a shared block, or the
+			// log, which never overwrites: the old one is released, its data is
+			// still read below if needed
+			int newIndex = blockAlloc(prev);
+			if (newIndex == -1)
+			{
+				break;
+			}
+			if (inHole && holeFill(entryIndex, h, block) == -1)
+			{
+				blockFree(newIndex);
+				break;
+			}
+			if (inHole || FATIndex == FAT_EOC)
+			{
+				// link the new block between prev and FATIndex
+				FAT[newIndex] = FATIndex;
+			}
+			else
+			{
+				// the new block takes the place of FATIndex
+				FAT[newIndex] = FAT[FATIndex];
+				FAT[FATIndex] = FAT_EOC;
+			}
+			if (prev == FAT_EOC)
+			{
+				entry->dataStartIndex = newIndex;
+			}
+			else
+			{
+				FAT[prev] = newIndex;
+			}
+			if (oldIndex != FAT_EOC)
+			{
+				blockRelease(oldIndex);
+			}
+			FATIndex = dataIndex = newIndex;
+		}
+		for (; h < holes->count && holes->holes[h].start + holes->holes[h].count <= block + 1; h++);
+		if (write)
+		{
+			blockGen[FATIndex] = superblock.generation;
+			dedupForget(FATIndex);
+			if (logTails[entryIndex].block == FATIndex)
+			{
+				// a block given back and allocated again, the copy is of its old data
+				logTails[entryIndex].block = FAT_EOC;
+			}
+		}
+
+		if (n == blockSize)
+		{
+			// flush the run if this block does not continue it
+			struct iovec pieces[RUN_IOV_MAX];
+			struct IovCursor saved = cursor;
+			int used = iovSlice(&cursor, blockSize, pieces, RUN_IOV_MAX);
+			if (runBlocks > 0 && (runStart + runBlocks != dataIndex || used == -1 || runPieces + used > RUN_IOV_MAX))
+			{
+				if (flushRun(runStart, run, runPieces, write) == -1)
+				{
+					done = runDone;
+					break;
+				}
+				runDone = done;
+				runPieces = runBlocks = 0;
+			}
+
+			if (used == -1)
+			{
+				// too scattered to gather, go through the bounce buffer
+				cursor = saved;
+				if (write)
+				{
+					iovCopy(&cursor, bounce, blockSize, false);
+					if (block_write(superblock.dataB_startIndex + dataIndex, bounce) == -1)
+					{
+						break;
+					}
+					if (blockHash != NULL)
+					{
+						dedupAdd(dataIndex, blockHashOf(bounce));
+					}
+				}
+				else
+				{
+					if (block_read(superblock.dataB_startIndex + dataIndex, bounce) == -1)
+					{
+						break;
+					}
+					iovCopy(&cursor, bounce, blockSize, true);
+				}
+				runDone = done + n;
+			}
+			else
+			{
+				if (write && blockHash != NULL)
+				{
+					// the run is written from the caller's buffers, hash a copy
+					struct IovCursor peek = saved;
+					iovCopy(&peek, bounce, blockSize, false);
+					dedupAdd(dataIndex, blockHashOf(bounce));
+				}
+				if (runBlocks == 0)
+				{
+					runStart = dataIndex;
+				}
+				memcpy(run + runPieces, pieces, sizeof(struct iovec) * used);
+				runPieces += used;
+				runBlocks++;
+			}
+		}
+		else
+		{
+			if (runBlocks > 0)
+			{
+				if (flushRun(runStart, run, runPieces, write) == -1)
+				{
+					done = runDone;
+					break;
+				}
+				runPieces = runBlocks = 0;
+			}
+
+			// partial block: only the bytes outside the range need to come from disk
+			if (fresh)
+			{
+				memset(bounce, 0, blockSize);
+			}
+			else
+			{
+				if (write && logTails[entryIndex].data != NULL && logTails[entryIndex].block == oldIndex)
+				{
+					memcpy(bounce, logTails[entryIndex].data, blockSize);
+				}
+				else if (block_read(superblock.dataB_startIndex + oldIndex, bounce) == -1)
+				{
+					break;
+				}
+				if (write && (uint64_t)(block + 1) * blockSize > oldSize)
+				{
+					// bytes past the old end may be stale
+					uint32_t tail = oldSize - block * blockSize;
+					memset(bounce + tail, 0, blockSize - tail);
+				}
+			}
+			iovCopy(&cursor, bounce + offset, n, !write);
+			if (write)
+			{
+				if (block_write(superblock.dataB_startIndex + dataIndex, bounce) == -1)
+				{
+					break;
+				}
+				if (blockHash != NULL)
+				{
+					dedupAdd(dataIndex, blockHashOf(bounce));
+				}
+				if (superblock.features & FEATURE_LOG)
+				{
+					logTailKeep(entryIndex, dataIndex, bounce);
+				}
+			}
+			runDone = done + n;
+		}
+
+		done += n;
+		offset = 0;
+		if (write || !inHole)
+		{
+			prev = FATIndex;
+			FATIndex = FAT[FATIndex];
+		}
+	}
+
+	if (runBlocks > 0 && flushRun(runStart, run, runPieces, write) == -1)
+	{
+		done = runDone;
+	}
+
+	if (tailBytes > 0 && done == count)
+	{
+		char *tail = tailLoad(entry->tailBlock);
+		if (tail != NULL)
+		{
+			iovCopy(&cursor, tail + entry->tailOffset + (pos + done) % blockSize, tailBytes, true);
+			done += tailBytes;
+		}
+	}
+
+	if (done > 0 && entry->fileSize < pos + done)
+	{
+		entry->fileSize = pos + done;
+	}
+	if (write && pos > oldSize)
+	{
+		// nothing landed past the gap if the write failed, keep holes inside the file
+		holeClip(entryIndex, (entry->fileSize + blockSize - 1) / blockSize);
+	}
+	return done;
+}
+
+/* Logical blocks per compressed chunk, a chunk is compressed and read as a whole */
+#define CHUNK_BLOCKS 8
+#define CHUNK_SIZE (CHUNK_BLOCKS * blockSize)
+
+/**
+ * Layout of a compressed file: chunk c covers logical blocks
+ * [c * CHUNK_BLOCKS, (c + 1) * CHUNK_BLOCKS) and keeps its data in the first m
+ * of them, the rest are holes. The hole list is the chunk map: m is found
+ * without any I/O, so a read only loads the chunks it needs.
+ * - m == 0: the chunk is all zeros
+ * - m < blocks of the chunk: a ChunkHeader then the lz stream, padded to m blocks
+ * - m == blocks of the chunk: stored raw, it did not compress
+*/
+struct __attribute__((__packed__)) ChunkHeader
+{
+	uint32_t length;
+};
+
+/**
+ * Last chunk loaded or stored, uncompressed, so that small sequential reads
+ * and writes do not decompress the same chunk again
+ * entryIndex is -1 while the cache is empty.
+*/
+struct ChunkCache
+{
+	int entryIndex;
+	uint32_t chunk;
+	uint32_t length;
+	char *data;
+};
+
+struct ChunkCache chunkCache = { -1, 0, 0, NULL };
+
+// compressed form of a chunk on its way to or from the disk
+char *chunkPacked;
+
+// a chunk each for compressedResize, compressedTransfer (two) and fs_compress to work in
+char *chunkEdge;
+char *chunkBuf;
+char *chunkEdgeBuf;
+char *chunkConvert;
+
+/**
+ * Allocate the caches and chunk buffers, sized from the volume's block size
+ * return 0 if successful, -1 if out of memory
+*/
+int chunkBuffersAlloc(void)
+{
+	tailCache.block = FAT_EOC;
+	tailCache.data = malloc(blockSize);
+	chunkCache.entryIndex = -1;
+	chunkCache.data = malloc(CHUNK_SIZE);
+	chunkPacked = malloc(CHUNK_SIZE);
+	chunkEdge = malloc(CHUNK_SIZE);
+	chunkBuf = malloc(CHUNK_SIZE);
+	chunkEdgeBuf = malloc(CHUNK_SIZE);
+	chunkConvert = malloc(CHUNK_SIZE);
+	return tailCache.data == NULL || chunkCache.data == NULL || chunkPacked == NULL || chunkEdge == NULL
+	|| chunkBuf == NULL || chunkEdgeBuf == NULL || chunkConvert == NULL ? -1 : 0;
+}
+
+void chunkBuffersFree(void)
+{
+	free(tailCache.data);
+	free(chunkCache.data);
+	free(chunkPacked);
+	free(chunkEdge);
+	free(chunkBuf);
+	free(chunkEdgeBuf);
+	free(chunkConvert);
+	tailCache.data = NULL;
+	chunkCache.data = NULL;
+	chunkPacked = NULL;
+	chunkEdge = NULL;
+	chunkBuf = NULL;
+	chunkEdgeBuf = NULL;
+	chunkConvert = NULL;
+}
+
+/**
+ * Forget the cached chunk of rootEntries[entryIndex], or whatever is cached if
+ * entryIndex is -1
+*/
+void chunkCacheDrop(int entryIndex)
+{
+	if (entryIndex == -1 || chunkCache.entryIndex == entryIndex)
+	{
+		chunkCache.entryIndex = -1;
+	}
+}
+
+/**
+ * Number of data blocks (not holes) among logical blocks [first, first + count)
+ * of rootEntries[entryIndex], in the chain or in shared runs
+*/
+uint32_t chunkDataBlocks(int entryIndex, uint32_t first, uint32_t count)
+{
+	const struct HoleList *holes = &holeLists[entryIndex];
+	uint32_t data = count;
+	for (int h = 0; h < holes->count; h++)
+	{
+		const struct Hole *hole = &holes->holes[h];
+		uint32_t start = hole->start > first ? hole->start : first;
+		uint32_t end = hole->start + hole->count < first + count ? hole->start + hole->count : first + count;
+		if (hole->block == 0 && start < end)
+		{
+			data -= end - start;
+		}
+	}
+	return data;
+}
+
+/**
+ * Number of shared blocks among logical blocks [first, first + count) of
+ * rootEntries[entryIndex]: those of shared runs, and chain blocks that a run
+ * also points at. Writing them takes new blocks, dropping them frees nothing.
+*/
+uint32_t chunkSharedBlocks(int entryIndex, uint32_t first, uint32_t count)
+{
+	const struct HoleList *holes = &holeLists[entryIndex];
+	int FATIndex = rootEntries[entryIndex].dataStartIndex;
+	for (uint32_t i = first - holeBlocksBelow(entryIndex, first); i > 0 && FATIndex != FAT_EOC; i--)
+	{
+		FATIndex = FAT[FATIndex];
+	}
+	uint32_t shared = 0;
+	for (uint32_t b = first; b < first + count; b++)
+	{
+		int h = holeIndex(holes, b);
+		if (h != -1)
+		{
+			shared += holes->holes[h].block != 0;
+		}
+		else if (FATIndex != FAT_EOC)
+		{
+			shared += blockRefs[FATIndex] > 0;
+			FATIndex = FAT[FATIndex];
+		}
+	}
+	return shared;
+}
+
+/**
+ * Turn logical blocks [first, first + count) of rootEntries[entryIndex] into a
+ * hole, cutting their data blocks out of the chain and freeing them; blocks of
+ * shared runs are released
+ * return 0 if successful, -1 if out of memory
+*/
+int chunkPunch(int entryIndex, uint32_t first, uint32_t count)
+{
+	struct RootEntry *entry = &rootEntries[entryIndex];
+	struct HoleList *holes = &holeLists[entryIndex];
+	uint32_t position = first - holeBlocksBelow(entryIndex, first);
+	uint32_t present = count - (holeBlocksBelow(entryIndex, first + count) - holeBlocksBelow(entryIndex, first));
+	for (uint32_t b = first; b < first + count; b++)
+	{
+		int h = holeIndex(holes, b);
+		if (h != -1 && holes->holes[h].block != 0)
+		{
+			int shared = holes->holes[h].block + (b - holes->holes[h].start);
+			if (holeFill(entryIndex, h, b) == -1)
+			{
+				return -1;
+			}
+			blockRelease(shared);
+			h = -1;
+		}
+		if (h == -1 && holeAdd(entryIndex, b, 1) == -1)
+		{
+			return -1;
+		}
+	}
+	if (present == 0)
+	{
+		return 0;
+	}
+
+	// the data blocks of the range sit next to each other in the chain
+	int prev = FAT_EOC;
+	int removed = entry->dataStartIndex;
+	for (uint32_t i = 0; i < position; i++)
+	{
+		prev = removed;
+		removed = FAT[removed];
+	}
+	int last = removed;
+	for (uint32_t i = 1; i < present; i++)
+	{
+		last = FAT[last];
+	}
+	int next = FAT[last];
+	FAT[last] = FAT_EOC;
+	if (prev == FAT_EOC)
+	{
+		entry->dataStartIndex = next;
+	}
+	else
+	{
+		FAT[prev] = next;
+	}
+	chainFree(removed);
+	return 0;
+}
+
+/**
+ * Read chunk number chunk of rootEntries[entryIndex] into buf, uncompressed
+ * compressed tells how the chunk is stored (a file changing modes has both)
+ * *length is set to the number of bytes of the file in the chunk.
+ * return 0 if successful, -1 on I/O error or if the chunk is corrupt
+*/
+int chunkLoad(int entryIndex, uint32_t chunk, char *buf, uint32_t *length, bool compressed)
+{
+	uint32_t size = rootEntries[entryIndex].fileSize;
+	uint64_t start = (uint64_t)chunk * CHUNK_SIZE;
+	*length = start >= size ? 0 : (size - start < CHUNK_SIZE ? size - start : CHUNK_SIZE);
+	if (*length == 0)
+	{
+		return 0;
+	}
+	if (chunkCache.entryIndex == entryIndex && chunkCache.chunk == chunk)
+	{
+		memcpy(buf, chunkCache.data, *length);
+		return 0;
+	}
+
+	uint32_t blocks = (*length + blockSize - 1) / blockSize;
+	uint32_t stored = chunkDataBlocks(entryIndex, chunk * CHUNK_BLOCKS, blocks);
+	if (!compressed || stored == blocks)
+	{
+		struct iovec iov = { buf, *length };
+		if (entryTransfer(entryIndex, start, &iov, 1, *length, false) != *length)
+		{
+			return -1;
+		}
+	}
+	else if (stored == 0)
+	{
+		memset(buf, 0, *length);
+	}
+	else
+	{
+		struct ChunkHeader header;
+		struct iovec iov = { chunkPacked, stored * blockSize };
+		if (entryTransfer(entryIndex, start, &iov, 1, iov.iov_len, false) != (long)iov.iov_len)
+		{
+			return -1;
+		}
+		memcpy(&header, chunkPacked, sizeof(header));
+		if (header.length > iov.iov_len - sizeof(header)
+		|| lz_decompress(chunkPacked + sizeof(header), header.length, buf, *length) != (int)*length)
+		{
+			return -1;
+		}
+	}
+
+	chunkCache.entryIndex = entryIndex;
+	chunkCache.chunk = chunk;
+	chunkCache.length = *length;
+	memcpy(chunkCache.data, buf, *length);
+	return 0;
+}
+
+/**
+ * Write the length bytes of buf as chunk number chunk of rootEntries[entryIndex],
+ * compressed if compressed is set; the file size must already cover them
+ * The chunk is shrunk to its new block count before it is written, so storing
+ * it never needs more free blocks than were checked for up front.
+ * return 0 if successful, -1 if the disk is full or on I/O error
+*/
+int chunkStore(int entryIndex, uint32_t chunk, const char *buf, uint32_t length, bool compressed)
+{
+	uint32_t first = chunk * CHUNK_BLOCKS;
+	uint32_t blocks = (length + blockSize - 1) / blockSize;
+	const char *data = buf;
+	size_t dataLength = length;
+	uint32_t stored = blocks;
+
+	bool zero = true;
+	for (uint32_t i = 0; i < length && zero; i++)
+	{
+		zero = buf[i] == 0;
+	}
+	if (zero)
+	{
+		stored = 0;
+	}
+	else if (compressed && blocks > 1)
+	{
+		// only worth it if it saves at least one block
+		int packed = lz_compress(buf, length, chunkPacked + sizeof(struct ChunkHeader),
+			(blocks - 1) * blockSize - sizeof(struct ChunkHeader));
+		if (packed != -1)
+		{
+			struct ChunkHeader header = { packed };
+			memcpy(chunkPacked, &header, sizeof(header));
+			stored = (sizeof(header) + packed + blockSize - 1) / blockSize;
+			dataLength = stored * blockSize;
+			memset(chunkPacked + sizeof(header) + packed, 0, dataLength - sizeof(header) - packed);
+			data = chunkPacked;
+		}
+	}
+
+	// check for space before anything changes, shared blocks are copied when written
+	uint32_t missing = stored - chunkDataBlocks(entryIndex, first, stored) + chunkSharedBlocks(entryIndex, first, stored);
+	uint32_t freed = chunkDataBlocks(entryIndex, first + stored, blocks - stored)
+		- chunkSharedBlocks(entryIndex, first + stored, blocks - stored);
+	if (missing > (uint32_t)blocksAvailable() + freed)
+	{
+		return -1;
+	}
+
+	chunkCacheDrop(entryIndex);
+	if (chunkPunch(entryIndex, first + stored, blocks - stored) == -1)
+	{
+		return -1;
+	}
+	if (stored > 0)
+	{
+		struct iovec iov = { (void *)data, dataLength };
+		if (entryTransfer(entryIndex, (uint64_t)chunk * CHUNK_SIZE, &iov, 1, dataLength, true) != (long)dataLength)
+		{
+			return -1;
+		}
+	}
+
+	chunkCache.entryIndex = entryIndex;
+	chunkCache.chunk = chunk;
+	chunkCache.length = length;
+	memcpy(chunkCache.data, buf, length);
+	return 0;
+}
+
+/**
+ * Set the size of compressed file rootEntries[entryIndex] to length bytes
+ * The chunk holding the end of the file is stored again for its new length,
+ * unless it is chunk keep, which the caller has loaded and will store itself.
+ * return 0 if successful, -1 if the disk is full or on I/O error
+*/
+int compressedResize(int entryIndex, uint32_t length, int64_t keep)
+{
+	char *edge = chunkEdge;
+	uint32_t size = rootEntries[entryIndex].fileSize;
+	uint32_t chunk = (length < size ? length : size) / CHUNK_SIZE;
+	uint32_t chunkStart = chunk * CHUNK_SIZE;
+	uint32_t edgeLength = 0;
+	if (length == size)
+	{
+		return 0;
+	}
+
+	// the chunk that the end of the file moves out of, or into
+	bool reload = chunk != keep && (length < size ? length : size) % CHUNK_SIZE != 0;
+	if (reload && chunkLoad(entryIndex, chunk, edge, &edgeLength, true) == -1)
+	{
+		return -1;
+	}
+	chunkCacheDrop(entryIndex);
+
+	if (length > size)
+	{
+		if (entryTruncate(entryIndex, length) == -1)
+		{
+			return -1;
+		}
+	}
+	else
+	{
+		// drop the edge chunk with the rest, then bring back what is left of it
+		if (entryTruncate(entryIndex, chunkStart) == -1
+		|| (reload && entryTruncate(entryIndex, length) == -1))
+		{
+			return -1;
+		}
+	}
+	if (!reload)
+	{
+		return 0;
+	}
+
+	uint32_t newLength = length - chunkStart < CHUNK_SIZE ? length - chunkStart : CHUNK_SIZE;
+	if (newLength > edgeLength)
+	{
+		memset(edge + edgeLength, 0, newLength - edgeLength);
+	}
+	return chunkStore(entryIndex, chunk, edge, newLength, true);
+}
+
+/**
+ * fileTransfer for compressed files: every chunk in the range is loaded, and
+ * on a write, patched and stored again
+ * return number of bytes transferred
+*/
+long compressedTransfer(int entryIndex, uint32_t pos, const struct iovec *iov, int iovcnt, size_t count, bool write)
+{
+	char *buf = chunkBuf, *edgeBuf = chunkEdgeBuf;
+	struct IovCursor cursor = { iov, iovcnt, 0, 0 };
+	uint32_t size = rootEntries[entryIndex].fileSize;
+
+	if (!write)
+	{
+		if (pos >= size)
+		{
+			return 0;
+		}
+		if (size - pos < count)
+		{
+			count = size - pos;
+		}
+	}
+	else if (count > UINT32_MAX - pos)
+	{
+		count = UINT32_MAX - pos;
+	}
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	uint32_t end = pos + count;
+	int64_t loaded = -1;
+	uint32_t length;
+	if (write && end > size)
+	{
+		// every chunk stored from here may end up raw with a hole record of its own,
+		// the chunk at the old end too, make sure they fit before the size moves
+		uint32_t edge = size / CHUNK_SIZE;
+		uint32_t first = (pos < size ? pos : size) / CHUNK_SIZE;
+		uint32_t last = (end - 1) / CHUNK_SIZE;
+		uint32_t oldBlocks = (size + blockSize - 1) / blockSize;
+		uint32_t blocks = (end + blockSize - 1) / blockSize - pos / CHUNK_SIZE * CHUNK_BLOCKS;
+		uint32_t chunks = last - pos / CHUNK_SIZE + 2;
+		if (first < pos / CHUNK_SIZE)
+		{
+			blocks += CHUNK_BLOCKS;
+			chunks++;
+		}
+		uint32_t kept = oldBlocks > first * CHUNK_BLOCKS ? oldBlocks - first * CHUNK_BLOCKS : 0;
+		blocks -= chunkDataBlocks(entryIndex, first * CHUNK_BLOCKS, kept)
+			- chunkSharedBlocks(entryIndex, first * CHUNK_BLOCKS, kept);
+		if ((int64_t)freeCount - metaReserve(sizeof(struct HoleRecord) * chunks, 0, 0, false) < blocks)
+		{
+			return 0;
+		}
+
+		// the chunk at the old end is stored for the old size, load it before the size moves
+		if (size % CHUNK_SIZE != 0 && pos < (edge + 1) * CHUNK_SIZE)
+		{
+			if (chunkLoad(entryIndex, edge, edgeBuf, &length, true) == -1)
+			{
+				return 0;
+			}
+			loaded = edge;
+		}
+		if (compressedResize(entryIndex, end, loaded) == -1)
+		{
+			return 0;
+		}
+	}
+
+	size_t done = 0;
+	for (uint32_t chunk = pos / CHUNK_SIZE; done < count; chunk++)
+	{
+		uint32_t offset = (pos + done) % CHUNK_SIZE;
+		size_t n = CHUNK_SIZE - offset < count - done ? CHUNK_SIZE - offset : count - done;
+		if (chunk != loaded && chunkLoad(entryIndex, chunk, buf, &length, true) == -1)
+		{
+			break;
+		}
+		if (chunk == loaded)
+		{
+			// grown with the file, the bytes past the old end are zeros
+			uint32_t oldLength = size - chunk * CHUNK_SIZE;
+			length = end - chunk * CHUNK_SIZE < CHUNK_SIZE ? end - chunk * CHUNK_SIZE : CHUNK_SIZE;
+			memcpy(buf, edgeBuf, oldLength);
+			memset(buf + oldLength, 0, length - oldLength);
+		}
+
+		iovCopy(&cursor, buf + offset, n, !write);
+		if (write && chunkStore(entryIndex, chunk, buf, length, true) == -1)
+		{
+			break;
+		}
+		done += n;
+	}
+
+	if (write && pos + done < end)
+	{
+		// the write fell short, the file only keeps what made it to disk
+		uint32_t kept = done > 0 && pos + done > size ? pos + done : size;
+		if (loaded != -1 && kept < (loaded + 1) * CHUNK_SIZE)
+		{
+			// the chunk at the old end did not make it and may not load, put back its old bytes
+			uint32_t chunkStart = loaded * CHUNK_SIZE;
+			chunkCacheDrop(entryIndex);
+			if (entryTruncate(entryIndex, chunkStart) == 0 && entryTruncate(entryIndex, size) == 0)
+			{
+				chunkStore(entryIndex, loaded, edgeBuf, size - chunkStart, true);
+			}
+		}
+		else
+		{
+			compressedResize(entryIndex, kept, -1);
+		}
+	}
+	return done;
+}
+
+/**
+ * The FAT and root directory blocks, disk blocks 1 to metaSlots, are metadata
+ * slots 0 to metaSlots - 1. metaDisk holds each slot as it is on disk, or as
+ * it will be once the writeback queued so far is done: the slots that differ
+ * from it are the dirty ones.
+*/
+char *metaDisk;
+int metaSlots;
+
+/**
+ * Get the in-memory content of metadata slot s, straight from the FAT, or
+ * built in tmp (one block) for the root directory blocks
+*/
+const char *metaSlotData(int s, char *tmp)
+{
+	if (s < superblock.FATLen)
+	{
+		return (const char *)&FAT[s * FAT_PER_BLOCK];
+	}
+	size_t offset = (size_t)(s - superblock.FATLen) * blockSize;
+	size_t length = sizeof(rootEntries) - offset < blockSize ? sizeof(rootEntries) - offset : blockSize;
+	memset(tmp, 0, blockSize);
+	memcpy(tmp, (char *)rootEntries + offset, length);
+	return tmp;
+}
+
+bool metaSlotDirty(int s, char *tmp)
+{
+	return memcmp(metaSlotData(s, tmp), metaDisk + (size_t)s * blockSize, blockSize) != 0;
+}
+
+/**
+ * Write the dirty metadata slots, or all of them if everything is, and wait
+ * return 0 if successful, -1 on I/O error
+*/
+int metaWrite(bool everything)
+{
+	char tmp[blockSize];
+	int ret = 0;
+	for (int s = 0; s < metaSlots; s++)
+	{
+		if (!everything && !metaSlotDirty(s, tmp))
+		{
+			continue;
+		}
+		const char *data = metaSlotData(s, tmp);
+		if (block_write(1 + s, data) == -1)
+		{
+			ret = -1;
+			continue;
+		}
+		memcpy(metaDisk + (size_t)s * blockSize, data, blockSize);
+	}
+	return ret;
+}
+
+/* Least time between two scans of the metadata for dirty slots */
+#define WRITEBACK_SCAN_MS 1
+
+/**
+ * Metadata slots queued for the flusher, with their content when they were
+ * queued. A slot queued again before the batch is written is overwritten.
+*/
+struct WritebackBatch
+{
+	int count;
+	bool *queued;
+	char *data;
+};
+
+/**
+ * Background writeback, see fs_writeback. Modifying calls queue the dirty
+ * slots in batch[fill] while the flusher thread writes the other batch, then
+ * it takes batch[fill] if anything was queued in the meantime. Once the
+ * oldest change is dirty_age_ms old without a call to queue it, the flusher
+ * queues it itself. Everything but lastScan is protected by lock, which is
+ * taken after meta, except by the flusher, which only tries meta.
+*/
+struct Writeback
+{
+	bool running;
+	pthread_t thread;
+	// held by calls while they change the FAT and root directory, and by the flusher while it reads them
+	pthread_mutex_t meta;
+	pthread_mutex_t lock;
+	// signalled when the flusher has a batch to write or has to stop
+	pthread_cond_t wake;
+	// signalled when the flusher is done with its batches
+	pthread_cond_t idle;
+	struct WritebackBatch batch[2];
+	int fill;
+	// the flusher is writing batch[!fill]
+	bool busy;
+	bool stop;
+	// a write failed, the disk may not hold what metaDisk says
+	bool failed;
+	struct fs_writeback params;
+	// time of the first change not queued yet, 0 if there is none
+	uint64_t dirtySince;
+	uint64_t lastScan;
+};
+
+struct Writeback wb = {
+	.meta = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+};
+
+uint64_t monotonicMs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Write a batch in block order, each run of neighbouring slots as one request
+ * return 0 if successful, -1 on I/O error
+*/
+int writebackBatchWrite(struct WritebackBatch *batch)
+{
+	int ret = 0;
+	for (int s = 0; s < metaSlots; s++)
+	{
+		if (!batch->queued[s])
+		{
+			continue;
+		}
+		int run = 1;
+		while (s + run < metaSlots && batch->queued[s + run])
+		{
+			run++;
+		}
+		struct iovec iov = { batch->data + (size_t)s * blockSize, (size_t)run * blockSize };
+		if (block_writev(1 + s, &iov, 1) == -1)
+		{
+			ret = -1;
+		}
+		s += run;
+	}
+	return ret;
+}
+
+/**
+ * Copy the dirty slots to the batch being filled and hand it to the flusher
+ * if it is idle, with wb.lock held
+*/
+void writebackQueue(void)
+{
+	char tmp[blockSize];
+	struct WritebackBatch *batch = &wb.batch[wb.fill];
+	for (int s = 0; s < metaSlots; s++)
+	{
+		if (!metaSlotDirty(s, tmp))
+		{
+			continue;
+		}
+		const char *data = metaSlotData(s, tmp);
+		memcpy(batch->data + (size_t)s * blockSize, data, blockSize);
+		memcpy(metaDisk + (size_t)s * blockSize, data, blockSize);
+		batch->count += !batch->queued[s];
+		batch->queued[s] = true;
+	}
+	wb.dirtySince = 0;
+	if (!wb.busy && batch->count > 0)
+	{
+		wb.fill = !wb.fill;
+		wb.busy = true;
+		pthread_cond_signal(&wb.wake);
+	}
+}
+
+/**
+ * Keep the flusher off the FAT and root directory while the calling thread
+ * changes them
+*/
+void writebackHold(void)
+{
+	pthread_mutex_lock(&wb.meta);
+}
+
+void writebackRelease(void)
+{
+	pthread_mutex_unlock(&wb.meta);
+}
+
+/**
+ * Wait on wb.wake for at most ms milliseconds, with wb.lock held
+*/
+void writebackSleep(uint64_t ms)
+{
+	// the condition waits on the realtime clock
+	struct timespec until;
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += ms / 1000;
+	until.tv_nsec += (ms % 1000) * 1000000;
+	if (until.tv_nsec >= 1000000000)
+	{
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&wb.wake, &wb.lock, &until);
+}
+
+/**
+ * Wait for a batch or for the stop, with wb.lock held, queueing the dirty
+ * slots once the oldest change is old enough however idle the calls are
+*/
+void writebackWait(void)
+{
+	while (!wb.busy && !wb.stop)
+	{
+		uint64_t age = wb.params.dirty_age_ms;
+		if (wb.dirtySince == 0 || age == 0)
+		{
+			pthread_cond_wait(&wb.wake, &wb.lock);
+			continue;
+		}
+		uint64_t now = monotonicMs();
+		if (now - wb.dirtySince < age)
+		{
+			writebackSleep(wb.dirtySince + age - now);
+		}
+		// no call came to queue the aged changes, the metadata can only be read between calls
+		else if (pthread_mutex_trylock(&wb.meta) == 0)
+		{
+			writebackQueue();
+			writebackRelease();
+		}
+		else
+		{
+			// the call that holds it may wait for this thread, so do not block on it
+			writebackSleep(WRITEBACK_SCAN_MS);
+		}
+	}
+}
+
+void *writebackThread(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&wb.lock);
+	for (;;)
+	{
+		writebackWait();
+		if (!wb.busy)
+		{
+			break;
+		}
+
+		struct WritebackBatch *batch = &wb.batch[!wb.fill];
+		pthread_mutex_unlock(&wb.lock);
+		int ret = writebackBatchWrite(batch);
+		pthread_mutex_lock(&wb.lock);
+
+		if (ret == -1)
+		{
+			wb.failed = true;
+		}
+		memset(batch->queued, 0, metaSlots);
+		batch->count = 0;
+		if (wb.batch[wb.fill].count > 0)
+		{
+			wb.fill = !wb.fill;
+		}
+		else
+		{
+			wb.busy = false;
+			pthread_cond_broadcast(&wb.idle);
+		}
+	}
+	pthread_mutex_unlock(&wb.lock);
+	return NULL;
+}
+
+/**
+ * Called after calls that modify the metadata, with the hold taken: queue the
+ * dirty slots for the flusher once there are enough of them or they are old
+ * enough, and wait for the flusher when it is too far behind
+*/
+void writebackCheck(void)
+{
+	if (!wb.running)
+	{
+		return;
+	}
+	uint64_t now = monotonicMs();
+	uint64_t age = wb.params.dirty_age_ms;
+	bool aged = wb.dirtySince != 0 && age != 0 && now - wb.dirtySince >= age;
+	if (now - wb.lastScan < WRITEBACK_SCAN_MS && !aged)
+	{
+		// this call may have changed something, the flusher looks once that is old enough
+		if (wb.dirtySince == 0)
+		{
+			pthread_mutex_lock(&wb.lock);
+			wb.dirtySince = now;
+			pthread_cond_signal(&wb.wake);
+			pthread_mutex_unlock(&wb.lock);
+		}
+		return;
+	}
+	wb.lastScan = now;
+
+	char tmp[blockSize];
+	unsigned int dirty = 0;
+	for (int s = 0; s < metaSlots; s++)
+	{
+		dirty += metaSlotDirty(s, tmp);
+	}
+	pthread_mutex_lock(&wb.lock);
+	if (dirty == 0)
+	{
+		wb.dirtySince = 0;
+		pthread_mutex_unlock(&wb.lock);
+		return;
+	}
+	if (wb.dirtySince == 0)
+	{
+		// the flusher times the age of the changes from now
+		wb.dirtySince = now;
+		pthread_cond_signal(&wb.wake);
+	}
+	aged = age != 0 && now - wb.dirtySince >= age;
+
+	while (wb.busy && (dirty + wb.batch[0].count + wb.batch[1].count) * 100 >= wb.params.hard_ratio * (unsigned int)metaSlots)
+	{
+		pthread_cond_wait(&wb.idle, &wb.lock);
+	}
+	if (aged || dirty * 100 >= wb.params.dirty_ratio * (unsigned int)metaSlots)
+	{
+		writebackQueue();
+	}
+	pthread_mutex_unlock(&wb.lock);
+}
+
+/**
+ * Queue everything dirty and wait until the flusher has written it
+ * return 0 if successful, -1 if any of the flusher's writes failed
+*/
+int writebackDrain(void)
+{
+	pthread_mutex_lock(&wb.lock);
+	writebackQueue();
+	while (wb.busy)
+	{
+		pthread_cond_wait(&wb.idle, &wb.lock);
+	}
+	int ret = wb.failed ? -1 : 0;
+	pthread_mutex_unlock(&wb.lock);
+	return ret;
+}
+
+/**
+ * Stop the flusher once it has written everything queued
+ * return 0 if successful, -1 if any of its writes failed
+*/
+int writebackStop(void)
+{
+	if (!wb.running)
+	{
+		return 0;
+	}
+	pthread_mutex_lock(&wb.lock);
+	wb.stop = true;
+	pthread_cond_signal(&wb.wake);
+	pthread_mutex_unlock(&wb.lock);
+	pthread_join(wb.thread, NULL);
+
+	for (int i = 0; i < 2; i++)
+	{
+		free(wb.batch[i].queued);
+		free(wb.batch[i].data);
+	}
+	wb.running = false;
+	return wb.failed ? -1 : 0;
+}
+
+int fs_writeback(const struct fs_writeback *params)
+{
+	if (!mount)
+	{
+		return -1;
+	}
+	if (params == NULL)
+	{
+		// after a failed write the disk may hold anything, rewrite it all
+		bool failed = writebackStop() == -1;
+		return metaWrite(failed);
+	}
+	// the journal decides when the metadata reaches its place, see journalCheckpoint
+	if (params->hard_ratio < params->dirty_ratio || params->hard_ratio > 100 || superblock.journalBlocks != 0)
+	{
+		return -1;
+	}
+	if (wb.running)
+	{
+		// the flusher may be timing the age of the changes with the old thresholds
+		pthread_mutex_lock(&wb.lock);
+		wb.params = *params;
+		pthread_cond_signal(&wb.wake);
+		pthread_mutex_unlock(&wb.lock);
+		return 0;
+	}
+	wb.params = *params;
+
+	memset(wb.batch, 0, sizeof(wb.batch));
+	for (int i = 0; i < 2; i++)
+	{
+		wb.batch[i].queued = calloc(metaSlots, sizeof(bool));
+		wb.batch[i].data = malloc((size_t)metaSlots * blockSize);
+	}
+	wb.fill = 0;
+	wb.busy = false;
+	wb.stop = false;
+	wb.failed = false;
+	wb.dirtySince = 0;
+	wb.lastScan = 0;
+	if (wb.batch[0].queued == NULL || wb.batch[0].data == NULL || wb.batch[1].queued == NULL
+	|| wb.batch[1].data == NULL || pthread_create(&wb.thread, NULL, writebackThread, NULL) != 0)
+	{
+		for (int i = 0; i < 2; i++)
+		{
+			free(wb.batch[i].queued);
+			free(wb.batch[i].data);
+		}
+		return -1;
+	}
+	wb.running = true;
+	return 0;
+}
+
+
+/**
+ * Move count bytes between rootEntries[entryIndex], from offset, and the
+ * buffers in iov, whether the file is compressed or not
+ * return number of bytes transferred
+*/
+long entryIO(int entryIndex, size_t offset, const struct iovec *iov, int iovcnt, size_t count, bool write)
+{
+	long done;
+	if (rootEntries[entryIndex].flags & ENTRY_COMPRESSED)
+	{
+		done = compressedTransfer(entryIndex, offset, iov, iovcnt, count, write);
+	}
+	else
+	{
+		done = entryTransfer(entryIndex, offset, iov, iovcnt, count, write);
+	}
+	if (write && done > 0)
+	{
+		written[entryIndex] = true;
+	}
+	return done;
+}
+
+/**
+ * Move count bytes between the file pointed to by fd (from its current offset)
+ * and the buffers in iov, and move the offset past them
+ * return number of bytes transferred
+*/
+long fileTransfer(int fd, const struct iovec *iov, int iovcnt, size_t count, bool write)
+{
+	if (!write)
+	{
+		long done = entryIO(fdTable[fd].entryIndex, fdTable[fd].offset, iov, iovcnt, count, false);
+		fdTable[fd].offset += done;
+		return done;
+	}
+	writebackHold();
+	long done = entryIO(fdTable[fd].entryIndex, fdTable[fd].offset, iov, iovcnt, count, true);
+	if (done > 0)
+	{
+		writebackCheck();
+	}
+	writebackRelease();
+	fdTable[fd].offset += done;
+	return done;
+}
+
+/* Number of blocks copied per vectored write while defragmenting */
+#define DEFRAG_BATCH 32
+
+// root entry fs_defrag resumes from
+int defragNext;
+
+/**
+ * Move the chain of rootEntries[entryIndex] into one run of contiguous blocks
+ * The data is copied first and the FAT and root entry are only switched over
+ * once every block is in place, so a failed copy leaves the file untouched.
+ * Blocks that other files or snapshots share move too: their runs are pointed
+ * at the new blocks, which take over the references.
+ * return 1 if the file was moved, 0 if it was already contiguous or there is
+ * no free run long enough or no room for the runs, -1 on I/O error or if out
+ * of memory
+*/
+int defragFile(int entryIndex)
+{
+	struct RootEntry *entry = &rootEntries[entryIndex];
+	int n = 0;
+	bool contiguous = true;
+	bool shared = false;
+	for (int b = entry->dataStartIndex; b != FAT_EOC; b = FAT[b])
+	{
+		if (FAT[b] != FAT_EOC && FAT[b] != b + 1)
+		{
+			contiguous = false;
+		}
+		shared = shared || blockRefs[b] > 0;
+		n++;
+	}
+	if (contiguous)
+	{
+		return 0;
+	}
+
+	int runStart = freeRunFind(n);
+	if (runStart == -1)
+	{
+		return 0;
+	}
+
+	char (*batch)[blockSize] = malloc(DEFRAG_BATCH * blockSize);
+	uint16_t *from = malloc(sizeof(uint16_t) * n);
+	if (batch == NULL || from == NULL)
+	{
+		free(batch);
+		free(from);
+		return -1;
+	}
+	struct iovec iov = { batch, 0 };
+	int b = entry->dataStartIndex;
+	for (int done = 0; done < n; )
+	{
+		int count = 0;
+		for (; count < DEFRAG_BATCH && done + count < n; count++, b = FAT[b])
+		{
+			from[done + count] = b;
+			if (block_read(superblock.dataB_startIndex + b, batch[count]) == -1)
+			{
+				free(batch);
+				free(from);
+				return -1;
+			}
+		}
+		iov.iov_len = count * blockSize;
+		if (block_writev(superblock.dataB_startIndex + runStart + done, &iov, 1) == -1)
+		{
+			free(batch);
+			free(from);
+			return -1;
+		}
+		done += count;
+	}
+	free(batch);
+
+	// the runs pointing at shared blocks are remapped aside, and swapped in once they all fit
+	int lists = (snapshotCount + 1) * FS_FILE_MAX_COUNT;
+	struct HoleList *remapped = NULL;
+	if (shared)
+	{
+		uint16_t *moved = calloc(FATLength, sizeof(uint16_t));
+		remapped = calloc(lists, sizeof(struct HoleList));
+		int ret = moved == NULL || remapped == NULL ? -1 : 0;
+		for (int i = 0; i < n && ret == 0; i++)
+		{
+			moved[from[i]] = blockRefs[from[i]] > 0 ? runStart + i : 0;
+		}
+		int64_t liveExtra = 0, snapshotExtra = 0;
+		for (int l = 0; l < lists && ret == 0; l++)
+		{
+			struct HoleList *list = l < FS_FILE_MAX_COUNT ? &holeLists[l] : &snapshots[l / FS_FILE_MAX_COUNT - 1].holes[l % FS_FILE_MAX_COUNT];
+			ret = holeListRemap(&remapped[l], list, moved);
+			if (ret == 1)
+			{
+				*(l < FS_FILE_MAX_COUNT ? &liveExtra : &snapshotExtra) += remapped[l].count - list->count;
+				ret = 0;
+			}
+		}
+		free(moved);
+		if (ret == 0 && (int64_t)freeCount - n < metaReserve(sizeof(struct HoleRecord) * (liveExtra > 0 ? liveExtra : 0), 0,
+			sizeof(struct HoleRecord) * (snapshotExtra > 0 ? snapshotExtra : 0), false))
+		{
+			ret = 1;
+		}
+		if (ret != 0)
+		{
+			for (int l = 0; remapped != NULL && l < lists; l++)
+			{
+				free(remapped[l].holes);
+			}
+			free(remapped);
+			free(from);
+			return ret == -1 ? -1 : 0;
+		}
+		for (int l = 0; l < lists; l++)
+		{
+			struct HoleList *list = l < FS_FILE_MAX_COUNT ? &holeLists[l] : &snapshots[l / FS_FILE_MAX_COUNT - 1].holes[l % FS_FILE_MAX_COUNT];
+			if (remapped[l].count > 0)
+			{
+				free(list->holes);
+				*list = remapped[l];
+			}
+		}
+		free(remapped);
+		snapshotBytes += sizeof(struct HoleRecord) * snapshotExtra;
+	}
+
+	// every block is copied, switch the file over to the new run
+	int old = entry->dataStartIndex;
+	for (int i = 0; i < n; i++)
+	{
+		blockTake(runStart + i);
+		FAT[runStart + i] = i + 1 < n ? runStart + i + 1 : FAT_EOC;
+		blockGen[runStart + i] = blockGen[from[i]];
+		blockRefs[runStart + i] = blockRefs[from[i]];
+		blockRefs[from[i]] = 0;
+	}
+	free(from);
+	entry->dataStartIndex = runStart;
+	chainFree(old);
+	return 1;
+}
+
+int fs_defrag(unsigned int budget_ms, int *moved)
+{
+	if (!mount)
+	{
+		return -1;
+	}
+
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int count = 0;
+
+	for (; defragNext < FS_FILE_MAX_COUNT; defragNext++)
+	{
+		if (budget_ms > 0)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			long elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+			if (elapsed >= budget_ms)
+			{
+				break;
+			}
+		}
+		if (rootEntries[defragNext].filename[0] == '\0')
+		{
+			continue;
+		}
+
+		writebackHold();
+		int ret = defragFile(defragNext);
+		writebackRelease();
+		if (ret == -1)
+		{
+			return -1;
+		}
+		count += ret;
+	}
+
+	if (moved != NULL)
+	{
+		*moved = count;
+	}
+	if (defragNext < FS_FILE_MAX_COUNT)
+	{
+		return 1;
+	}
+	// pass complete, the next call starts over
+	defragNext = 0;
+	return 0;
+}
+
+int fs_log(int enable)
+{
+	if (!mount)
+	{
+		return -1;
+	}
+	if (!enable)
+	{
+		// blocks stay where the log put them, new ones are allocated first-fit again
+		superblock.features &= ~FEATURE_LOG;
+		logTailDrop(-1);
+		return 0;
+	}
+	superblock.features |= FEATURE_LOG;
+	return 0;
+}
+
+// blocks per segment of the log, the unit the cleaner empties: one word of freeMap
+#define LOG_SEGMENT 64
+
+// segments with more live blocks than this are not worth cleaning
+#define LOG_CLEAN_LIVE (LOG_SEGMENT * 3 / 4)
+
+// marks a block the cleaner must leave in place, see logPredBuild
+#define LOG_PINNED -1
+
+/**
+ * Map every block the cleaner may move to what links to it: the FAT index of
+ * the block before it in its chain, or -2 - entryIndex for the first block of
+ * rootEntries[entryIndex]. The other blocks are LOG_PINNED: shared blocks, tail
+ * blocks and metadata tables, which have more than one link or links the
+ * cleaner does not track.
+ * return malloc'ed map, or NULL if out of memory
+*/
+int *logPredBuild(void)
+{
+	int *pred = malloc(sizeof(int) * FATLength);
+	if (pred == NULL)
+	{
+		return NULL;
+	}
+	for (int i = 0; i < FATLength; i++)
+	{
+		pred[i] = LOG_PINNED;
+	}
+	for (int e = 0; e < FS_FILE_MAX_COUNT; e++)
+	{
+		if (rootEntries[e].filename[0] == '\0')
+		{
+			continue;
+		}
+		int prev = -2 - e;
+		int steps = 0;
+		for (int b = rootEntries[e].dataStartIndex; b != FAT_EOC && b > 0 && b < FATLength && FAT[b] != 0
+		&& steps < FATLength; prev = b, b = FAT[b], steps++)
+		{
+			if (blockRefs[b] == 0)
+			{
+				pred[b] = prev;
+			}
+		}
+	}
+	return pred;
+}
+
+/**
+ * Pick the segment the cleaner empties next: the one with the fewest live
+ * blocks, all of which can move, among the segments not yet cleaned or written
+ * to in this pass (done) and away from the log head
+ * return index of the segment, or -1 if none is worth cleaning
+*/
+int logVictim(const int *pred, const bool *done)
+{
+	int words = (FATLength + 63) / 64;
+	int headWord = superblock.logHead / 64;
+	int best = -1, bestLive = LOG_CLEAN_LIVE + 1;
+	for (int w = 0; w < words; w++)
+	{
+		int size = FATLength - w * 64 < 64 ? FATLength - w * 64 : 64;
+		int live = size - __builtin_popcountll(freeMap[w]);
+		if (done[w] || w == headWord || live == 0 || live >= bestLive || freeCount - (size - live) < live)
+		{
+			continue;
+		}
+		bool movable = true;
+		for (int i = w * 64; i < w * 64 + size && movable; i++)
+		{
+			movable = (freeMap[w] & ((uint64_t)1 << (i % 64))) || pred[i] != LOG_PINNED;
+		}
+		if (movable)
+		{
+			best = w;
+			bestLive = live;
+		}
+	}
+	return best;
+}
+
+/**
+ * Move the live blocks of segment w to the log head, in one read of the whole
+ * segment and one write per run of new blocks, and relink them
+ * The data is copied before any link changes, so a failed copy leaves the
+ * files untouched. Segments the blocks land in are marked in done.
+ * return 0 if successful, -1 on I/O error
+*/
+int logCleanSegment(int *pred, int w, char *buf, bool *done)
+{
+	int first = w * 64;
+	int size = FATLength - first < 64 ? FATLength - first : 64;
+	uint64_t holes = freeMap[w];
+	struct iovec iov = { buf, (size_t)size * blockSize };
+	if (block_readv(superblock.dataB_startIndex + first, &iov, 1) == -1)
+	{
+		return -1;
+	}
+
+	// keep the allocator out of the segment while its blocks move out of it
+	freeMap[w] = 0;
+	freeCount -= __builtin_popcountll(holes);
+	int dest[LOG_SEGMENT];
+	int n = 0;
+	for (int i = 0; i < size; i++)
+	{
+		if (!(holes & ((uint64_t)1 << i)))
+		{
+			// there is room outside the segment, logVictim checked
+			dest[i] = logAlloc();
+			done[dest[i] / 64] = true;
+			n++;
+		}
+	}
+
+	// blocks that land next to each other on disk go out in one request
+	struct iovec run[LOG_SEGMENT];
+	int runStart = -1, runBlocks = 0;
+	int ret = 0;
+	for (int i = 0; i <= size && ret == 0; i++)
+	{
+		bool live = i < size && !(holes & ((uint64_t)1 << i));
+		if (runBlocks > 0 && (!live || dest[i] != runStart + runBlocks))
+		{
+			ret = block_writev(superblock.dataB_startIndex + runStart, run, runBlocks);
+			runBlocks = 0;
+		}
+		if (live)
+		{
+			if (runBlocks == 0)
+			{
+				runStart = dest[i];
+			}
+			run[runBlocks].iov_base = buf + (size_t)i * blockSize;
+			run[runBlocks].iov_len = blockSize;
+			runBlocks++;
+		}
+	}
+	if (ret == -1)
+	{
+		for (int i = 0; i < size; i++)
+		{
+			if (!(holes & ((uint64_t)1 << i)))
+			{
+				blockFree(dest[i]);
+			}
+		}
+		freeMap[w] = holes;
+		freeCount += __builtin_popcountll(holes);
+		return -1;
+	}
+
+	// every block is copied, switch the links over
+	for (int i = 0; i < size; i++)
+	{
+		if (holes & ((uint64_t)1 << i))
+		{
+			continue;
+		}
+		int old = first + i, to = dest[i], p = pred[old], next = FAT[old];
+		FAT[to] = next;
+		if (p >= 1)
+		{
+			FAT[p] = to;
+		}
+		else
+		{
+			rootEntries[-2 - p].dataStartIndex = to;
+		}
+		if (next != FAT_EOC && pred[next] == old)
+		{
+			pred[next] = to;
+		}
+		pred[to] = p;
+		pred[old] = LOG_PINNED;
+		blockGen[to] = blockGen[old];
+		if (blockHash != NULL)
+		{
+			dedupAdd(to, blockHashOf(buf + (size_t)i * blockSize));
+		}
+		blockFree(old);
+	}
+
+	// the whole segment is free now, but for blocks the journal still links
+	freeMap[w] |= holes;
+	freeCount += __builtin_popcountll(holes);
+	if (w < freeHint)
+	{
+		freeHint = w;
+	}
+	return 0;
+}
+
+int fs_clean(unsigned int budget_ms, int *freed)
+{
+	if (!mount || !(superblock.features & FEATURE_LOG))
+	{
+		return -1;
+	}
+
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int words = (FATLength + 63) / 64;
+	int *pred = logPredBuild();
+	char *buf = malloc((size_t)LOG_SEGMENT * blockSize);
+	bool *done = calloc(words, sizeof(bool));
+	int count = 0, ret = 0;
+	if (pred == NULL || buf == NULL || done == NULL)
+	{
+		ret = -1;
+	}
+
+	while (ret == 0)
+	{
+		if (budget_ms > 0)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			long elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+			if (elapsed >= budget_ms)
+			{
+				ret = 1;
+				break;
+			}
+		}
+		// each segment is cleaned or filled at most once, so the pass ends
+		int w = logVictim(pred, done);
+		if (w == -1)
+		{
+			break;
+		}
+		done[w] = true;
+		writebackHold();
+		int cleaned = logCleanSegment(pred, w, buf, done);
+		writebackRelease();
+		if (cleaned == -1)
+		{
+			ret = -1;
+			break;
+		}
+		count++;
+	}
+
+	free(done);
+	free(buf);
+	free(pred);
+	if (freed != NULL)
+	{
+		*freed = count;
+	}
+	if (ret != -1)
+	{
+		writebackHold();
+		writebackCheck();
+		writebackRelease();
+	}
+	return ret;
+}
+
+/**
+ * Share the blocks of the chain of rootEntries[entryIndex] with blocks
+ * elsewhere that hold the same data, and free its own copies
+ * Each block with a match leaves the chain for a shared run of one block
+ * pointing at the match, which merges with the runs around it when the
+ * matches follow each other on disk. Blocks that are already shared stay.
+ * The blocks were already written, this only gives back the space of copies.
+ * return number of blocks freed, or -1 if out of memory
+*/
+int dedupFile(int entryIndex)
+{
+	struct RootEntry *entry = &rootEntries[entryIndex];
+	struct HoleList *holes = &holeLists[entryIndex];
+	char buf[blockSize];
+	int freed = 0;
+	int prev = FAT_EOC;
+	int b = entry->dataStartIndex;
+	uint32_t block = 0;
+	int h = 0;
+	for (int steps = 0; b != FAT_EOC && steps < FATLength; steps++)
+	{
+		// the logical block of b is the next one past the holes and runs
+		for (; h < holes->count && holes->holes[h].start <= block; h++)
+		{
+			uint32_t end = holes->holes[h].start + holes->holes[h].count;
+			block = end > block ? end : block;
+		}
+
+		int next = FAT[b];
+		bool loaded = false;
+		if (blockHash[b] == 0)
+		{
+			if (block_read(superblock.dataB_startIndex + b, buf) == -1)
+			{
+				break;
+			}
+			loaded = true;
+			dedupAdd(b, blockHashOf(buf));
+		}
+		int match = blockRefs[b] > 0 ? -1 : dedupFind(b, blockHash[b], buf, &loaded);
+		if (match == -1 || freeCount < metaReserve(sizeof(struct HoleRecord), sizeof(struct RefRecord), 0, false))
+		{
+			prev = b;
+			b = next;
+			block++;
+			continue;
+		}
+
+		// the match takes the place of b, which leaves the chain
+		if (holeListAdd(holes, block, 1, match, false) == -1)
+		{
+			return -1;
+		}
+		refGet(match);
+		if (prev == FAT_EOC)
+		{
+			entry->dataStartIndex = next;
+		}
+		else
+		{
+			FAT[prev] = next;
+		}
+		blockFree(b);
+		freed++;
+		b = next;
+		block++;
+		// the run may have merged into the record before it
+		h = h > 0 ? h - 1 : 0;
+	}
+	return freed;
+}
+
+/**
+ * Free the content index and leave dedup mode
+*/
+void dedupIndexFree(void)
+{
+	free(blockHash);
+	blockHash = NULL;
+	free(dedupNext);
+	dedupNext = NULL;
+	free(dedupBuckets);
+	dedupBuckets = NULL;
+}
+
+/**
+ * Build the content index by reading and hashing every block in use
+ * The blocks of the metadata tables are left out, they are rewritten at unmount.
+ * return 0 if successful, -1 if out of memory or on I/O error
+*/
+int dedupIndexBuild(void)
+{
+	int buckets = 1;
+	while (buckets < FATLength)
+	{
+		buckets <<= 1;
+	}
+	blockHash = calloc(FATLength, sizeof(uint64_t));
+	dedupNext = malloc(FATLength * sizeof(uint16_t));
+	dedupBuckets = malloc(buckets * sizeof(uint16_t));
+	uint64_t *meta = calloc((FATLength + 63) / 64, sizeof(uint64_t));
+	char (*batch)[blockSize] = malloc(DEFRAG_BATCH * blockSize);
+	if (blockHash == NULL || dedupNext == NULL || dedupBuckets == NULL || meta == NULL || batch == NULL)
+	{
+		free(meta);
+		free(batch);
+		dedupIndexFree();
+		return -1;
+	}
+	memset(dedupBuckets, 0xff, buckets * sizeof(uint16_t));
+	dedupMask = buckets - 1;
+
+	for (int t = 0; t < META_TABLE_COUNT; t++)
+	{
+		int b = superblock.metaHead[t];
+		for (int steps = 0; b != 0 && b != FAT_EOC && b < FATLength && steps < FATLength; steps++, b = FAT[b])
+		{
+			meta[b / 64] |= (uint64_t)1 << (b % 64);
+		}
+	}
+	// nor are tail blocks, which change as tails are packed into them
+	for (int t = 0; t < tailBlockCount; t++)
+	{
+		meta[tailBlocks[t].block / 64] |= (uint64_t)1 << (tailBlocks[t].block % 64);
+	}
+
+	int ret = 0;
+	for (int i = 1; i < FATLength; )
+	{
+		int count = 0;
+		for (; count < DEFRAG_BATCH && i + count < FATLength && FAT[i + count] != 0
+		&& !(meta[(i + count) / 64] & ((uint64_t)1 << ((i + count) % 64))); count++);
+		if (count == 0)
+		{
+			i++;
+			continue;
+		}
+
+		struct iovec iov = { batch, count * blockSize };
+		if (block_readv(superblock.dataB_startIndex + i, &iov, 1) == -1)
+		{
+			ret = -1;
+			break;
+		}
+		for (int k = 0; k < count; k++)
+		{
+			dedupAdd(i + k, blockHashOf(batch[k]));
+		}
+		i += count;
+	}
+	free(meta);
+	free(batch);
+	if (ret == -1)
+	{
+		dedupIndexFree();
+	}
+	return ret;
+}
+
+int fs_dedup(int enable)
+{
+	if (!mount)
+	{
+		return -1;
+	}
+	if (!enable)
+	{
+		// blocks already shared stay shared, they are copied on write as usual
+		dedupIndexFree();
+		superblock.features &= ~FEATURE_DEDUP;
+		return 0;
+	}
+
+	if (blockHash == NULL && dedupIndexBuild() == -1)
+	{
+		return -1;
+	}
+	superblock.features |= FEATURE_DEDUP;
+
+	// share what the files already have in common
+	int freed = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if (rootEntries[i].filename[0] == '\0')
+		{
+			continue;
+		}
+		writebackHold();
+		int ret = dedupFile(i);
+		writebackRelease();
+		if (ret == -1)
+		{
+			return -1;
+		}
+		freed += ret;
+	}
+	return freed;
+}
+
+/**
+ * Read or write the root directory, which takes the ROOT_BLOCKS blocks from
+ * rootDir_Index and is padded with zeros when blocks are larger than it
+ * return 0 if successful, -1 on I/O error
+*/
+int rootTransfer(bool write)
+{
+	char buf[ROOT_BLOCKS * blockSize];
+	struct iovec iov = { buf, sizeof(buf) };
+	if (!write)
+	{
+		if (block_readv(superblock.rootDir_Index, &iov, 1) == -1)
+		{
+			return -1;
+		}
+		memcpy(rootEntries, buf, sizeof(rootEntries));
+		return 0;
+	}
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, rootEntries, sizeof(rootEntries));
+	return block_writev(superblock.rootDir_Index, &iov, 1);
+}
+
+/**
+ * Build the on-disk superblock in buf (one block), cut to the block size or
+ * padded with zeros
+*/
+void superblockImage(char *buf)
+{
+	memset(buf, 0, blockSize);
+	memcpy(buf, &superblock, sizeof(superblock) < blockSize ? sizeof(superblock) : blockSize);
+}
+
+/**
+ * Write the superblock to block 0
+ * return 0 if successful, -1 on I/O error
+*/
+int superblockWrite(void)
+{
+	char buf[blockSize];
+	superblockImage(buf);
+	return block_write(0, buf);
+}
+
+/**
+ * Metadata journal, in the first superblock.journalBlocks reserved blocks.
+ * Each transaction is a header block listing the metadata slots it holds,
+ * followed by their content, written with one request. Transactions follow
+ * each other from the start of the journal with consecutive sequence
+ * numbers, mount replays them from superblock.journalSeq on. Once the journal
+ * is full, the metadata as of the last transaction is written in place and
+ * the journal starts over with a new superblock.journalSeq, which retires the
+ * transactions it held, so that the metadata is never half-written in place.
+ * The superblock goes in the transactions too, as slot metaSlots, so that the
+ * table heads it holds change together with the FAT.
+*/
+#define JOURNAL_MAGIC 0x4c4e524a
+
+// slot number of the superblock in a transaction header
+#define JOURNAL_SUPERBLOCK 0xffff
+
+struct __attribute__((__packed__)) JournalHeader
+{
+	uint32_t magic;
+	uint32_t seq;
+	uint16_t count;
+	// over the sequence number, slot numbers and slot contents
+	uint64_t checksum;
+	uint16_t slots[];
+};
+
+// most slots a transaction holds, as many as the header block can list
+#define JOURNAL_SLOTS_MAX ((blockSize - sizeof(struct JournalHeader)) / sizeof(uint16_t))
+
+// next free block of the journal, and sequence number of the next transaction
+uint32_t journalPos;
+uint32_t journalNext;
+
+uint64_t journalChecksum(const struct JournalHeader *header, const char *images)
+{
+	uint64_t h = (header->seq + 1) * 0x9e3779b97f4a7c15ULL;
+	for (int i = 0; i < header->count; i++)
+	{
+		h = (h ^ header->slots[i]) * 0xff51afd7ed558ccdULL;
+		h = (h ^ blockHashOf(images + (size_t)i * blockSize)) * 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+uint32_t journalStart(void)
+{
+	return superblock.rootDir_Index + ROOT_BLOCKS;
+}
+
+/**
+ * Get the in-memory content of journal slot s, a metadata slot or the
+ * superblock for s == metaSlots, built in tmp (one block) if needed
+*/
+const char *journalSlotData(int s, char *tmp)
+{
+	if (s == metaSlots)
+	{
+		superblockImage(tmp);
+		return tmp;
+	}
+	return metaSlotData(s, tmp);
+}
+
+/**
+ * Write the metadata as of the last transaction in place and retire the
+ * journal's transactions, what changed since stays for the next one
+ * return 0 if successful, -1 on I/O error
+*/
+int journalCheckpoint(void)
+{
+	// only committed images go in place, a crash in between replays the same ones
+	for (int s = 0; s < metaSlots; s++)
+	{
+		char *image = metaJournal + (size_t)s * blockSize;
+		if (memcmp(image, metaDisk + (size_t)s * blockSize, blockSize) != 0)
+		{
+			if (block_write(1 + s, image) == -1)
+			{
+				return -1;
+			}
+			memcpy(metaDisk + (size_t)s * blockSize, image, blockSize);
+		}
+	}
+	if (block_disk_flush() == -1)
+	{
+		return -1;
+	}
+
+	// the metadata has to be in place before the transactions stop being replayed
+	struct Superblock committed;
+	char *image = metaJournal + (size_t)metaSlots * blockSize;
+	memcpy(&committed, image, sizeof(committed) < blockSize ? sizeof(committed) : blockSize);
+	committed.journalSeq = journalNext;
+	memcpy(image, &committed, sizeof(committed) < blockSize ? sizeof(committed) : blockSize);
+	if (block_write(0, image) == -1 || block_disk_flush() == -1)
+	{
+		return -1;
+	}
+	superblock.journalSeq = journalNext;
+	journalPos = 0;
+	return 0;
+}
+
+/**
+ * Log every metadata slot changed since the last transaction as a new one,
+ * with a single write, and flush the disk
+ * return 0 if successful, -1 on I/O error or if out of memory
+*/
+int journalCommit(void)
+{
+	char tmp[blockSize];
+	char headerBlock[blockSize];
+	struct JournalHeader *header = (struct JournalHeader *)headerBlock;
+	memset(headerBlock, 0, blockSize);
+	for (int s = 0; s <= metaSlots; s++)
+	{
+		if (memcmp(journalSlotData(s, tmp), metaJournal + (size_t)s * blockSize, blockSize) != 0)
+		{
+			header->slots[header->count++] = s == metaSlots ? JOURNAL_SUPERBLOCK : s;
+		}
+	}
+	if (header->count == 0)
+	{
+		return block_disk_flush();
+	}
+	// mount makes sure the journal holds the largest transaction, once it is full
+	// what it holds goes in place and this transaction starts it over
+	if (journalPos + 1 + header->count > superblock.journalBlocks && journalCheckpoint() == -1)
+	{
+		return -1;
+	}
+
+	char *images = malloc((size_t)header->count * blockSize);
+	if (images == NULL)
+	{
+		return -1;
+	}
+	for (int i = 0; i < header->count; i++)
+	{
+		int s = header->slots[i] == JOURNAL_SUPERBLOCK ? metaSlots : header->slots[i];
+		memcpy(images + (size_t)i * blockSize, journalSlotData(s, tmp), blockSize);
+	}
+	header->magic = JOURNAL_MAGIC;
+	header->seq = journalNext;
+	header->checksum = journalChecksum(header, images);
+
+	struct iovec iov[2] = {
+		{ headerBlock, blockSize },
+		{ images, (size_t)header->count * blockSize },
+	};
+	// the data and table blocks the transaction links have to be on disk before it is
+	if (block_disk_flush() == -1 || block_writev(journalStart() + journalPos, iov, 2) == -1 || block_disk_flush() == -1)
+	{
+		free(images);
+		return -1;
+	}
+	for (int i = 0; i < header->count; i++)
+	{
+		int s = header->slots[i] == JOURNAL_SUPERBLOCK ? metaSlots : header->slots[i];
+		memcpy(metaJournal + (size_t)s * blockSize, images + (size_t)i * blockSize, blockSize);
+	}
+	free(images);
+	journalPos += 1 + header->count;
+	journalNext++;
+	pendingRelease();
+	return 0;
+}
+
+/**
+ * Write the metadata of the transactions left in the journal in place, up to
+ * the first one that is incomplete, then retire them
+ * return 0 if successful, -1 on I/O error or if out of memory
+*/
+int journalReplay(void)
+{
+	int slots = superblock.FATLen + ROOT_BLOCKS;
+	char headerBlock[blockSize];
+	struct JournalHeader *header = (struct JournalHeader *)headerBlock;
+	char *images = malloc((size_t)superblock.journalBlocks * blockSize);
+	if (images == NULL)
+	{
+		return -1;
+	}
+
+	uint32_t pos = 0;
+	uint32_t seq = superblock.journalSeq;
+	while (pos < superblock.journalBlocks)
+	{
+		if (block_read(journalStart() + pos, headerBlock) == -1)
+		{
+			free(images);
+			return -1;
+		}
+		if (header->magic != JOURNAL_MAGIC || header->seq != seq || header->count == 0
+		|| header->count > JOURNAL_SLOTS_MAX || pos + 1 + header->count > superblock.journalBlocks)
+		{
+			break;
+		}
+		bool valid = true;
+		for (int i = 0; i < header->count; i++)
+		{
+			valid = valid && (header->slots[i] < slots || header->slots[i] == JOURNAL_SUPERBLOCK);
+		}
+		struct iovec iov = { images, (size_t)header->count * blockSize };
+		if (!valid || block_readv(journalStart() + pos + 1, &iov, 1) == -1
+		|| journalChecksum(header, images) != header->checksum)
+		{
+			break;
+		}
+		for (int i = 0; i < header->count; i++)
+		{
+			const char *image = images + (size_t)i * blockSize;
+			if (header->slots[i] == JOURNAL_SUPERBLOCK)
+			{
+				// the table heads and the rest of the superblock as of this transaction
+				uint32_t journalSeq = superblock.journalSeq;
+				memcpy(&superblock, image, sizeof(superblock) < blockSize ? sizeof(superblock) : blockSize);
+				superblock.journalSeq = journalSeq;
+			}
+			if (block_write(header->slots[i] == JOURNAL_SUPERBLOCK ? 0 : 1 + header->slots[i], image) == -1)
+			{
+				free(images);
+				return -1;
+			}
+		}
+		pos += 1 + header->count;
+		seq++;
+	}
+	free(images);
+
+	if (seq != superblock.journalSeq)
+	{
+		if (block_disk_flush() == -1)
+		{
+			return -1;
+		}
+		superblock.journalSeq = seq;
+		if (superblockWrite() == -1 || block_disk_flush() == -1)
+		{
+			return -1;
+		}
+	}
+	journalPos = 0;
+	journalNext = superblock.journalSeq;
+	return 0;
+}
+
+int fs_sync(void)
+{
+	// the tables take data blocks, their chains and heads go out with the FAT and superblock
+	if (!mount)
+	{
+		return -1;
+	}
+	writebackHold();
+	int saved = metaTablesSave();
+	writebackRelease();
+	if (saved == -1)
+	{
+		return -1;
+	}
+	if (superblock.journalBlocks != 0)
+	{
+		return journalCommit();
+	}
+
+	// without a journal the metadata goes straight to its place, one block at a time
+	int ret = wb.running ? writebackDrain() : metaWrite(false);
+	if (superblockWrite() == -1 || block_disk_flush() == -1)
+	{
+		return -1;
+	}
+	return ret;
+}
+
+int fs_mount(const char *diskname)
+{
+	/* TODO: Phase 1 */
+	// open disk
+	int out = block_disk_open(diskname);
+	if (out == -1)
+	{
+		return -1;
+	}
+	
+	// read superblock, the disk starts with BLOCK_SIZE blocks whatever the volume's block size,
+	// and perform signature checking
+	char* signature = "ECS150FS";
+	if (block_read(0, &superblock) == -1 || strncmp((char *)&superblock.signature, signature, 8) != 0)
+	{
+		block_disk_close();
+		return -1;
+	}
+
+	// switch the disk over to the volume's block size
+	blockSize = BLOCK_SIZE;
+	if (superblock.blockShift != 0)
+	{
+		blockSize = superblock.blockShift < 32 ? (uint32_t)1 << superblock.blockShift : 0;
+	}
+	if (block_disk_set_block_size(blockSize) == -1)
+	{
+		block_disk_close();
+		return -1;
+	}
+
+	// check if number of blocks is correct
+	if (block_disk_count() != superblock.blockCount)
+	{
+		block_disk_close();
+		return -1;
+	}
+
+	// check the validity of FAT and Root blocks
+	uint32_t FATLen = (uint32_t)superblock.dataBCount * 2 / blockSize;
+	if ((uint32_t)superblock.dataBCount * 2 % blockSize != 0)
+	{
+		FATLen += 1;
+	}
+	if (FATLen != superblock.FATLen || FATLen + 1 != superblock.rootDir_Index 
+	|| superblock.rootDir_Index + ROOT_BLOCKS + superblock.reservedCount != superblock.dataB_startIndex
+	|| superblock.journalBlocks > superblock.reservedCount
+	|| (superblock.journalBlocks != 0 && superblock.journalBlocks < FATLen + ROOT_BLOCKS + 2))
+	{
+		block_disk_close();
+		return -1;
+	}
+
+	// bring the FAT and Root directory up to date with what was committed before the last crash
+	if (superblock.journalBlocks != 0 && journalReplay() == -1)
+	{
+		block_disk_close();
+		return -1;
+	}
+
+	// initialize FAT
+	FATLength = superblock.dataBCount;
+	FAT = malloc(sizeof(uint16_t) * superblock.FATLen * FAT_PER_BLOCK);
+	bool loaded = FAT != NULL;
+	for (unsigned int i = 0; loaded && i < superblock.FATLen; i++)
+	{
+		loaded = block_read(i+1, &FAT[i * FAT_PER_BLOCK]) != -1;
+	}
+
+	// read root block
+	loaded = loaded && rootTransfer(false) != -1;
+
+	// the disk holds exactly what was just read
+	metaSlots = superblock.FATLen + ROOT_BLOCKS;
+	metaDisk = loaded ? malloc((size_t)metaSlots * blockSize) : NULL;
+	for (int s = 0; metaDisk != NULL && s < metaSlots; s++)
+	{
+		char tmp[blockSize];
+		memcpy(metaDisk + (size_t)s * blockSize, metaSlotData(s, tmp), blockSize);
+	}
+	metaJournal = NULL;
+	if (metaDisk != NULL && superblock.journalBlocks != 0)
+	{
+		metaJournal = malloc((size_t)(metaSlots + 1) * blockSize);
+		if (metaJournal != NULL)
+		{
+			memcpy(metaJournal, metaDisk, (size_t)metaSlots * blockSize);
+			superblockImage(metaJournal + (size_t)metaSlots * blockSize);
+		}
+	}
+
+	// initialize fdTable so that all entries are available
+	fdTable = NULL;
+	fdTableSize = 0;
+	fdFreeHead = FD_EMPTY;
+	blockRefs = NULL;
+	blockGen = NULL;
+	snapshots = NULL;
+	snapshotCount = 0;
+	memset(metaChainBlocks, 0, sizeof(metaChainBlocks));
+	if (metaDisk == NULL || (superblock.journalBlocks != 0 && metaJournal == NULL) || fdTableGrow(FS_OPEN_MAX_COUNT) == -1 || chunkBuffersAlloc() == -1 || freeMapBuild() == -1 || holeTableLoad() == -1
+	|| refTableLoad() == -1 || genTableLoad() == -1 || snapshotTableLoad() == -1 || tailTableBuild() == -1
+	|| ((superblock.features & FEATURE_DEDUP) && dedupIndexBuild() == -1))
+	{
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+		{
+			holeClear(i);
+		}
+		for (int i = 0; i < snapshotCount; i++)
+		{
+			snapshotClear(&snapshots[i]);
+		}
+		free(snapshots);
+		free(blockGen);
+		free(blockRefs);
+		dedupIndexFree();
+		tailTableClear();
+		chunkBuffersFree();
+		free(freeMap);
+		free(freePending);
+		freePending = NULL;
+		free(fdTable);
+		free(metaJournal);
+		free(metaDisk);
+		free(FAT);
+		block_disk_close();
+		return -1;
+	}
+	memset(openCount, 0, sizeof(openCount));
+	memset(reserved, 0, sizeof(reserved));
+	memset(written, 0, sizeof(written));
+	chunkCacheDrop(-1);
+	defragNext = 0;
+
+	mount = true;
+
+	return 0;
+}
+
+int fs_umount(void)
+{
+	/* TODO: Phase 1 */
+	// Check if disk was mounted
+	if (!mount)
+	{
+		return -1;
+	}
+	// Give back blocks reserved past the end of files that were left open
+	writebackHold();
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if (reserved[i])
+		{
+			chainTrim(i);
+			reserved[i] = false;
+		}
+		if (written[i])
+		{
+			tailPack(i);
+			if (blockHash != NULL)
+			{
+				dedupFile(i);
+			}
+		}
+		written[i] = false;
+	}
+
+	// The metadata tables take data blocks, so they are stored before the FAT is written
+	int saved = metaTablesSave();
+	writebackRelease();
+	if (saved == -1)
+	{
+		return -1;
+	}
+
+	// Copy the superblock, and whatever changed in the FAT and Root directory, back to the original disk
+	// a journal is retired after the metadata is in place, so that nothing is replayed at the next mount
+	// the volume is released whatever happens, a failed write is reported once it is
+	int ret = 0;
+	if (superblock.journalBlocks != 0 && (journalCommit() == -1 || journalCheckpoint() == -1))
+	{
+		ret = -1;
+	}
+	// the superblock holds the new table heads, it goes out once the FAT links their chains
+	bool failed = writebackStop() == -1;
+	if (metaWrite(failed) == -1 || superblockWrite() == -1 || block_disk_flush() == -1)
+	{
+		ret = -1;
+	}
+
+	// try to close the disk file
+	if (block_disk_close() == -1) 
+	{
+		ret = -1;
+	}
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		holeClear(i);
+	}
+	free(FAT);
+	free(metaDisk);
+	metaDisk = NULL;
+	free(metaJournal);
+	metaJournal = NULL;
+	free(freeMap);
+	freeMap = NULL;
+	free(freePending);
+	freePending = NULL;
+	free(blockRefs);
+	blockRefs = NULL;
+	free(blockGen);
+	blockGen = NULL;
+	dedupIndexFree();
+	tailTableClear();
+	chunkBuffersFree();
+	logTailDrop(-1);
+	for (int i = 0; i < snapshotCount; i++)
+	{
+		snapshotClear(&snapshots[i]);
+	}
+	free(snapshots);
+	snapshots = NULL;
+	snapshotCount = 0;
+	snapshotBytes = 0;
+	free(fdTable);
+	fdTable = NULL;
+	mount = false;
+	return ret;
+}
+
+int fs_statfs(struct fs_statfs *info)
+{
+	if (!mount || info == NULL)
+	{
+		return -1;
+	}
+
+	int freeRootEntries = 0;
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if (rootEntries[i].filename[0] == '\0') {
+			freeRootEntries++;
+		}
+	}
+
+	info->total_blk_count = superblock.blockCount;
+	info->fat_blk_count = superblock.FATLen;
+	info->rdir_blk = superblock.rootDir_Index;
+	info->data_blk = superblock.dataB_startIndex;
+	info->data_blk_count = superblock.dataBCount;
+	info->fat_free = freeCount + pendingCount;
+	info->rdir_free = freeRootEntries;
+	info->block_size = blockSize;
+	return 0;
+}
+
+int fs_info(void)
+{
+	/* TODO: Phase 1 */
+	struct fs_statfs info;
+	if (fs_statfs(&info) == -1)
+	{
+		return -1;
+	}
+
+	printf("FS Info:\ntotal_blk_count=%d\nfat_blk_count=%d\nrdir_blk=%d\ndata_blk=%d\ndata_blk_count=%d\n"
+	"fat_free_ratio=%d/%d\nrdir_free_ratio=%d/%d\n", info.total_blk_count, info.fat_blk_count, info.rdir_blk,
+	info.data_blk, info.data_blk_count, info.fat_free, info.data_blk_count, info.rdir_free, FS_FILE_MAX_COUNT);
+
+	return 0;
+}
+
+/**
+ * Make the free rootEntries[i] an empty file named filename
+*/
+void entryCreate(int i, const char *filename)
+{
+	strcpy(rootEntries[i].filename, filename);
+	rootEntries[i].fileSize = 0;
+	rootEntries[i].dataStartIndex = FAT_EOC;
+	rootEntries[i].flags = 0;
+	logTailDrop(i);
+}
+
+/**
+ * Free the blocks of the file in rootEntries[i], which is not open, and its entry
+*/
+void entryDelete(int i)
+{
+	chainFree(rootEntries[i].dataStartIndex);
+	if (rootEntries[i].flags & ENTRY_TAIL)
+	{
+		tailSlotPut(rootEntries[i].tailBlock, rootEntries[i].tailOffset);
+	}
+	holeListRelease(&holeLists[i]);
+	holeClear(i);
+	chunkCacheDrop(i);
+	logTailDrop(i);
+
+	// also reset the filename to show a space is free in rootEntries
+	// setting first character to \0 is sufficient
+	rootEntries[i].filename[0] = '\0';
+}
+
+int fs_create(const char *filename)
+{
+	/* TODO: Phase 2 */
+	// fixed the conditions:
+	// added strlen() to filename when checking length
+	// block_disk_count is not used for checking maximum number of files, therefore deleted
+	// checking of number of files is implemented in the last part of the function
+	if (!mount || strlen(filename) >= FS_FILENAME_LEN || filename == NULL)
+	{
+		return -1;
+	}
+
+	int i = 0;
+	while(i < FS_FILE_MAX_COUNT)
+	{
+		if (strcmp(rootEntries[i].filename, filename) == 0)
+		{
+			return -1;
+		}
+		i++;
+	}
+
+	i = 0;
+	while (i < FS_FILE_MAX_COUNT)
+	{
+		// cannot use filename == NULL to check for \0, use strlen instead
+		if (strlen(rootEntries[i].filename) == 0)  
+		{
+			// -> is not the way to access elements in an array, change all of them to index
+			writebackHold();
+			entryCreate(i, filename);
+			writebackCheck();
+			writebackRelease();
+			return 0;
+		}
+		i++;
+	}
+
+	// Reaching this line means no free space in rootEntries can be found
+	// Therefore meaning that there already exists 128 files
+	return -1;
+}
+
+
+int fs_delete(const char *filename)
+{
+	/* TODO: Phase 2 */
+	// same checking as fs_create
+	if (!mount || strlen(filename) >= FS_FILENAME_LEN || filename == NULL)
+	{
+		return -1;
+	}
+
+	int i = 0;
+	while (i < FS_FILE_MAX_COUNT) // replace filename null check with index i's checking
+	{
+		if (strcmp(rootEntries[i].filename, filename) == 0) // strcmp returns 0 if two strings match
+		{
+			// cannot delete a file that is currently open
+			if (openCount[i] > 0)
+			{
+				return -1;
+			}
+
+			writebackHold();
+			entryDelete(i);
+			writebackCheck();
+			writebackRelease();
+			return 0;
+		}
+		i++;
+	}
+
+	// file name is not in rootEntries
+	return -1;
+}
+
+/**
+ * Fill a directory entry from rootEntries[i]
+*/
+void fillDirent(int i, struct fs_dirent *ent)
+{
+	memcpy(ent->filename, rootEntries[i].filename, FS_FILENAME_LEN);
+	ent->filename[FS_FILENAME_LEN - 1] = '\0';
+	ent->size = rootEntries[i].fileSize;
+	ent->first_block = rootEntries[i].dataStartIndex;
+}
+
+/**
+ * Find filename in root directory
+ * return index in rootEntries, or -1 if there is no such file
+*/
+int findEntry(const char *filename)
+{
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if (rootEntries[i].filename[0] != '\0' && strcmp(rootEntries[i].filename, filename) == 0)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+int fs_opendir(struct fs_dir *dir)
+{
+	if (!mount || dir == NULL)
+	{
+		return -1;
+	}
+	dir->next = 0;
+	return 0;
+}
+
+int fs_readdir(struct fs_dir *dir, struct fs_dirent *ent)
+{
+	// dir->next is only ever moved by fs_opendir() and fs_readdir()
+	if (!mount || dir == NULL || ent == NULL || dir->next < 0 || dir->next > FS_FILE_MAX_COUNT)
+	{
+		return -1;
+	}
+
+	// skip over the free slots in rootEntries
+	while (dir->next < FS_FILE_MAX_COUNT && rootEntries[dir->next].filename[0] == '\0')
+	{
+		dir->next++;
+	}
+	if (dir->next == FS_FILE_MAX_COUNT)
+	{
+		return 0;
+	}
+
+	fillDirent(dir->next, ent);
+	dir->next++;
+	return 1;
+}
+
+int fs_stat_by_name(const char **filenames, struct fs_dirent *ents, int count)
+{
+	if (!mount || filenames == NULL || ents == NULL || count < 0)
+	{
+		return -1;
+	}
+
+	int found = 0;
+	for (int i = 0; i < count; i++)
+	{
+		int index = filenames[i] == NULL ? -1 : findEntry(filenames[i]);
+		if (index == -1)
+		{
+			// mark missing files with an empty name
+			memset(&ents[i], 0, sizeof(struct fs_dirent));
+			continue;
+		}
+		fillDirent(index, &ents[i]);
+		found++;
+	}
+	return found;
+}
+
+/**
+ * Create an empty file named filename in the first free root entry, as
+ * fs_create does, for calls that already hold the flusher off
+ * return index of the entry, or -1 if the name is invalid or taken, or the
+ * root directory is full
+*/
+int entryNew(const char *filename)
+{
+	if (filename[0] == '\0' || strlen(filename) >= FS_FILENAME_LEN || findEntry(filename) != -1)
+	{
+		return -1;
+	}
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if (rootEntries[i].filename[0] == '\0')
+		{
+			entryCreate(i, filename);
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Create file dst sharing the data blocks of entry, whose holes and shared runs
+ * are in holes: dst has no chain, every block of its data is in a shared run
+ * return 0 if successful, -1 if dst cannot be created, the tables would not fit or out of memory
+*/
+int cloneEntry(const struct RootEntry *entry, const struct HoleList *holes, const char *dst)
+{
+	struct HoleList runs = { NULL, 0, 0 };
+	if (holeListFreeze(&runs, entry, holes) == -1)
+	{
+		return -1;
+	}
+	// the clone's runs go in the hole table, and each block they share in the reference table
+	int to = -1;
+	if (freeCount >= metaReserve(sizeof(struct HoleRecord) * runs.count, sizeof(struct RefRecord) * holeListShared(&runs), 0, false))
+	{
+		to = entryNew(dst);
+	}
+	if (to == -1)
+	{
+		free(runs.holes);
+		return -1;
+	}
+
+	// blocks are copied when either file writes them
+	holeListHold(&runs);
+	holeLists[to] = runs;
+	rootEntries[to].fileSize = entry->fileSize;
+	rootEntries[to].dataStartIndex = FAT_EOC;
+	rootEntries[to].flags = entry->flags;
+	rootEntries[to].tailBlock = entry->tailBlock;
+	rootEntries[to].tailOffset = entry->tailOffset;
+	if (entry->flags & ENTRY_TAIL)
+	{
+		// the slot already exists, taking another reference cannot fail
+		tailSlotGet(entry->tailBlock, entry->tailOffset, entry->fileSize % blockSize);
+	}
+	return 0;
+}
+
+/**
+ * Give back the blocks that rootEntries[entryIndex] has reserved past its end,
+ * before it is cloned or snapshotted
+*/
+void reserveDrop(int entryIndex)
+{
+	if (reserved[entryIndex])
+	{
+		chainTrim(entryIndex);
+		reserved[entryIndex] = false;
+	}
+}
+
+int fs_clone(const char *src, const char *dst)
+{
+	if (!mount || src == NULL || dst == NULL)
+	{
+		return -1;
+	}
+	int from = findEntry(src);
+	if (from == -1)
+	{
+		return -1;
+	}
+	writebackHold();
+	reserveDrop(from);
+	int ret = cloneEntry(&rootEntries[from], &holeLists[from], dst);
+	writebackCheck();
+	writebackRelease();
+	return ret;
+}
+
+/**
+ * Find the snapshot taken at generation id
+ * return index in snapshots, or -1 if there is none
+*/
+int snapshotFind(int id)
+{
+	for (int i = 0; i < snapshotCount; i++)
+	{
+		if (id >= 0 && snapshots[i].generation == (uint32_t)id)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Take a snapshot of every file, see fs_snapshot_create
+ * return generation of the snapshot, or -1 if there is no room for it
+*/
+int snapshotCreate(void)
+{
+	struct Snapshot *grown = realloc(snapshots, sizeof(struct Snapshot) * (snapshotCount + 1));
+	if (grown == NULL)
+	{
+		return -1;
+	}
+	snapshots = grown;
+	struct Snapshot *snap = &snapshots[snapshotCount];
+	memcpy(snap->entries, rootEntries, sizeof(rootEntries));
+	memset(snap->holes, 0, sizeof(snap->holes));
+	uint32_t shared = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if (rootEntries[i].filename[0] == '\0')
+		{
+			continue;
+		}
+		reserveDrop(i);
+		snap->entries[i].dataStartIndex = FAT_EOC;
+		if (holeListFreeze(&snap->holes[i], &rootEntries[i], &holeLists[i]) == -1)
+		{
+			snapshotClear(snap);
+			return -1;
+		}
+		shared += holeListShared(&snap->holes[i]);
+	}
+
+	// the snapshot goes in the snapshot table, and each block it shares in the reference table
+	size_t len = snapshotLen(snap->holes);
+	if (freeCount < metaReserve(0, sizeof(struct RefRecord) * shared, len, true))
+	{
+		snapshotClear(snap);
+		return -1;
+	}
+
+	// the snapshot shares every block and tail, so from now on writes copy the blocks
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		struct RootEntry *entry = &snap->entries[i];
+		holeListHold(&snap->holes[i]);
+		if (entry->filename[0] != '\0' && (entry->flags & ENTRY_TAIL))
+		{
+			tailSlotGet(entry->tailBlock, entry->tailOffset, entry->fileSize % blockSize);
+		}
+	}
+	snap->generation = superblock.generation++;
+	snapshotCount++;
+	snapshotBytes += len;
+	return snap->generation;
+}
+
+int fs_snapshot_create(void)
+{
+	if (!mount || superblock.generation >= INT32_MAX)
+	{
+		return -1;
+	}
+	writebackHold();
+	int ret = snapshotCreate();
+	writebackCheck();
+	writebackRelease();
+	return ret;
+}
+
+int fs_snapshot_delete(int id)
+{
+	int index = snapshotFind(id);
+	if (!mount || index == -1)
+	{
+		return -1;
+	}
+
+	writebackHold();
+	struct Snapshot *snap = &snapshots[index];
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if (snap->entries[i].filename[0] != '\0')
+		{
+			holeListRelease(&snap->holes[i]);
+			if (snap->entries[i].flags & ENTRY_TAIL)
+			{
+				tailSlotPut(snap->entries[i].tailBlock, snap->entries[i].tailOffset);
+			}
+		}
+	}
+	snapshotBytes -= snapshotLen(snap->holes);
+	snapshotClear(snap);
+	memmove(snap, snap + 1, sizeof(struct Snapshot) * (snapshotCount - index - 1));
+	snapshotCount--;
+	writebackCheck();
+	writebackRelease();
+	return 0;
+}
+
+int fs_snapshot_list(int *ids, int max)
+{
+	if (!mount || (ids == NULL && max > 0))
+	{
+		return -1;
+	}
+	for (int i = 0; i < snapshotCount && i < max; i++)
+	{
+		ids[i] = snapshots[i].generation;
+	}
+	return snapshotCount;
+}
+
+int fs_snapshot_clone(int id, const char *filename, const char *newname)
+{
+	int index = snapshotFind(id);
+	if (!mount || index == -1 || filename == NULL || newname == NULL)
+	{
+		return -1;
+	}
+	struct Snapshot *snap = &snapshots[index];
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if (snap->entries[i].filename[0] != '\0' && strncmp(snap->entries[i].filename, filename, FS_FILENAME_LEN) == 0)
+		{
+			writebackHold();
+			int ret = cloneEntry(&snap->entries[i], &snap->holes[i], newname);
+			writebackCheck();
+			writebackRelease();
+			return ret;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Set the bit of every block of the chain starting at FATIndex in marked,
+ * if it was written after generation since (or always if all is set)
+*/
+void diffChain(uint64_t *marked, int FATIndex, bool all, uint32_t since)
+{
+	// the length bound stops a looping chain on a corrupt image
+	for (int n = 0; FATIndex >= 1 && FATIndex < FATLength && n < FATLength; n++)
+	{
+		if (all || blockGen[FATIndex] > since)
+		{
+			marked[FATIndex / 64] |= (uint64_t)1 << (FATIndex % 64);
+		}
+		FATIndex = FAT[FATIndex];
+	}
+}
+
+int fs_snapshot_diff(int from, int to, size_t *blocks, int max)
+{
+	int fromIndex = snapshotFind(from);
+	int toIndex = snapshotFind(to);
+	if (!mount || (from != -1 && fromIndex == -1) || (to != -1 && toIndex == -1) || (blocks == NULL && max > 0))
+	{
+		return -1;
+	}
+	bool all = from == -1;
+	uint32_t since = all ? 0 : snapshots[fromIndex].generation;
+
+	uint64_t *marked = calloc((FATLength + 63) / 64, sizeof(uint64_t));
+	if (marked == NULL)
+	{
+		return -1;
+	}
+	int count = 0;
+	if (to == -1)
+	{
+		// the whole volume: its metadata, which is rewritten in place, then every block in use
+		for (uint32_t b = 0; b < superblock.rootDir_Index + ROOT_BLOCKS; b++, count++)
+		{
+			if (count < max)
+			{
+				blocks[count] = b;
+			}
+		}
+		for (int i = 0; i < META_TABLE_COUNT; i++)
+		{
+			if (superblock.metaHead[i] != 0)
+			{
+				diffChain(marked, superblock.metaHead[i], true, 0);
+			}
+		}
+		for (int i = 1; i < FATLength; i++)
+		{
+			if (FAT[i] != 0 && (all || blockGen[i] > since))
+			{
+				marked[i / 64] |= (uint64_t)1 << (i % 64);
+			}
+		}
+	}
+	else
+	{
+		struct Snapshot *snap = &snapshots[toIndex];
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+		{
+			struct RootEntry *entry = &snap->entries[i];
+			if (entry->filename[0] == '\0')
+			{
+				continue;
+			}
+			// a snapshot has no chains, its data is all in shared runs
+			const struct HoleList *list = &snap->holes[i];
+			for (int h = 0; h < list->count; h++)
+			{
+				for (uint32_t b = list->holes[h].block; list->holes[h].block != 0 && b < list->holes[h].block + list->holes[h].count; b++)
+				{
+					if (all || blockGen[b] > since)
+					{
+						marked[b / 64] |= (uint64_t)1 << (b % 64);
+					}
+				}
+			}
+			if ((entry->flags & ENTRY_TAIL) && tailValid(entry) && (all || blockGen[entry->tailBlock] > since))
+			{
+				marked[entry->tailBlock / 64] |= (uint64_t)1 << (entry->tailBlock % 64);
+			}
+		}
+	}
+
+	// report in disk order, so the caller reads the image front to back
+	for (int i = 1; i < FATLength; i++)
+	{
+		if (marked[i / 64] & ((uint64_t)1 << (i % 64)))
+		{
+			if (count < max)
+			{
+				blocks[count] = superblock.dataB_startIndex + i;
+			}
+			count++;
+		}
+	}
+	free(marked);
+	return count;
+}
+
+int fs_ls(void)
+{
+	/* TODO: Phase 2 */
+	struct fs_dir dir;
+	struct fs_dirent ent;
+	if (fs_opendir(&dir) == -1)
+	{
+		return -1;
+	}
+	printf("FS Ls:\n");
+	while (fs_readdir(&dir, &ent) == 1)
+	{
+		printf("file: %s, size: %zu, data_blk: %d\n", ent.filename, ent.size, ent.first_block);
+	}
+	return 0;
+}
+
+int fs_open(const char *filename)
+{
+	/* TODO: Phase 3 */
+	// return -1 if disk is not mounted and filename is invalid
+	if (!mount || strlen(filename) == 0 || strlen(filename) >= FS_FILENAME_LEN)
+	{
+		return -1;
+	}
+
+	// Find filename in root directory
+	int fileIndex = findEntry(filename);
+	
+	// Condition for if file not found in root directory
+	if (fileIndex == -1)
+	{
+		return -1;
+	}
+
+	// Take a free fd off the free list, growing the table if there is none left
+	if (fdFreeHead == FD_EMPTY && fdTableGrow(fdTableSize * 2) == -1)
+	{
+		return -1;
+	}
+	int fd = fdFreeHead;
+	fdFreeHead = fdTable[fd].nextFree;
+	fdTable[fd].entryIndex = fileIndex;
+	fdTable[fd].offset = 0;
+	openCount[fileIndex]++;
+	
+	return fd;
+}
+
+/**
+ * Once the last fd of rootEntries[entryIndex] is closed, give back the blocks
+ * reserved past its end and, if it was written, pack its tail and share its
+ * blocks in dedup mode
+*/
+void entrySettle(int entryIndex)
+{
+	if (openCount[entryIndex] == 0 && reserved[entryIndex])
+	{
+		chainTrim(entryIndex);
+		reserved[entryIndex] = false;
+	}
+	if (openCount[entryIndex] == 0 && written[entryIndex])
+	{
+		tailPack(entryIndex);
+		if (blockHash != NULL)
+		{
+			dedupFile(entryIndex);
+		}
+		written[entryIndex] = false;
+	}
+}
+
+int fs_close(int fd)
+{
+	/* TODO: Phase 3 */
+	// Check if fd is valid and if disk is mounted
+	if (!fdValid(fd))
+	{
+		return -1;
+	}
+
+	int entryIndex = fdTable[fd].entryIndex;
+	openCount[entryIndex]--;
+	writebackHold();
+	entrySettle(entryIndex);
+	writebackCheck();
+	writebackRelease();
+	fdTable[fd].entryIndex = FD_EMPTY;
+	fdTable[fd].nextFree = fdFreeHead;
+	fdFreeHead = fd;
+	return 0;
+}
+
+int fs_stat(int fd)
+{
+	/* TODO: Phase 3 */
+	// Check if fd is valid and if disk is mounted
+	if (!fdValid(fd))
+	{
+		return -1;
+	}
+
+	return rootEntries[fdTable[fd].entryIndex].fileSize;
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	/* TODO: Phase 3 */
+	// Check if fd is valid and if disk is mounted
+	if (!fdValid(fd))
+	{
+		return -1;
+	}
+
+	// Offsets past the end are allowed, a write there leaves a hole, but file sizes are 32-bit
+	if (offset > UINT32_MAX)
+	{
+		return -1;
+	}
+
+	fdTable[fd].offset = offset;
+	return 0;
+}
+
+/**
+ * Allocate the blocks the file pointed to by fd needs to hold size bytes,
+ * see fs_reserve
+ * return 0 if successful, -1 if there are not enough free blocks
+*/
+int fileReserve(int fd, size_t size)
+{
+	// walk to the current end of the chain, with the packed tail back in it
+	int entryIndex = fdTable[fd].entryIndex;
+	if (tailUnpack(entryIndex) == -1)
+	{
+		return -1;
+	}
+	size_t blocks = 0;
+	int FATEnd = rootEntries[entryIndex].dataStartIndex;
+	if (FATEnd != FAT_EOC)
+	{
+		for (blocks = 1; FAT[FATEnd] != FAT_EOC; FATEnd = FAT[FATEnd], blocks++);
+	}
+
+	if (size > UINT32_MAX)
+	{
+		return -1;
+	}
+	size_t needed = chainBlocksFor(entryIndex, size);
+	if (needed <= blocks)
+	{
+		return 0;
+	}
+	if (needed - blocks > (size_t)blocksAvailable())
+	{
+		return -1;
+	}
+
+	for (; blocks < needed; blocks++)
+	{
+		FATEnd = falloc(fd, FATEnd);
+	}
+	reserved[entryIndex] = true;
+	return 0;
+}
+
+int fs_reserve(int fd, size_t size)
+{
+	if (!fdValid(fd))
+	{
+		return -1;
+	}
+	writebackHold();
+	int ret = fileReserve(fd, size);
+	writebackCheck();
+	writebackRelease();
+	return ret;
+}
+
+/**
+ * Set the size of rootEntries[entryIndex] to length, compressed or not
+ * return 0 if successful, -1 if out of space or on I/O error
+*/
+int entryResize(int entryIndex, size_t length)
+{
+	written[entryIndex] = true;
+	if (rootEntries[entryIndex].flags & ENTRY_COMPRESSED)
+	{
+		return compressedResize(entryIndex, length, -1);
+	}
+	return entryTruncate(entryIndex, length);
+}
+
+int fs_truncate(int fd, size_t length)
+{
+	if (!fdValid(fd) || length > UINT32_MAX)
+	{
+		return -1;
+	}
+
+	writebackHold();
+	int ret = entryResize(fdTable[fd].entryIndex, length);
+	writebackCheck();
+	writebackRelease();
+	return ret;
+}
+
+/**
+ * Exchange rootEntries[entryIndex] and its hole list with *entry and *holes
+*/
+void entrySwap(int entryIndex, struct RootEntry *entry, struct HoleList *holes)
+{
+	struct RootEntry swapEntry = rootEntries[entryIndex];
+	rootEntries[entryIndex] = *entry;
+	*entry = swapEntry;
+	struct HoleList swapHoles = holeLists[entryIndex];
+	holeLists[entryIndex] = *holes;
+	*holes = swapHoles;
+}
+
+/**
+ * Convert the file pointed to by fd to or from compressed chunks, see fs_compress
+ * The chunks are stored in new blocks, and the file only switches over to them
+ * once all of them are, so that a failure leaves it as it was.
+ * return 0 if successful, -1 if out of space or on I/O error
+*/
+int fileCompress(int fd, int enable)
+{
+	int entryIndex = fdTable[fd].entryIndex;
+	struct RootEntry *entry = &rootEntries[entryIndex];
+	bool from = entry->flags & ENTRY_COMPRESSED;
+	if (from == (enable != 0))
+	{
+		return 0;
+	}
+	if (tailUnpack(entryIndex) == -1)
+	{
+		return -1;
+	}
+	// either way a chunk may end up stored raw, and each one may leave a hole record
+	uint32_t blocks = (entry->fileSize + blockSize - 1) / blockSize;
+	uint32_t chunks = (entry->fileSize + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	if ((int64_t)freeCount - metaReserve(sizeof(struct HoleRecord) * (chunks + 1), 0, 0, false) < blocks)
+	{
+		return -1;
+	}
+
+	// the converted file starts as one hole of the same size, the old one is swapped in to be read
+	struct RootEntry old = *entry;
+	struct HoleList oldHoles = holeLists[entryIndex];
+	memset(&holeLists[entryIndex], 0, sizeof(struct HoleList));
+	entry->dataStartIndex = FAT_EOC;
+	entry->flags ^= ENTRY_COMPRESSED;
+	char *buf = chunkConvert;
+	chunkCacheDrop(entryIndex);
+	logTailDrop(entryIndex);
+	int ret = blocks > 0 ? holeAdd(entryIndex, 0, blocks) : 0;
+	for (uint32_t chunk = 0; chunk < chunks && ret == 0; chunk++)
+	{
+		uint32_t length;
+		entrySwap(entryIndex, &old, &oldHoles);
+		ret = chunkLoad(entryIndex, chunk, buf, &length, from);
+		entrySwap(entryIndex, &old, &oldHoles);
+		if (ret == 0)
+		{
+			ret = chunkStore(entryIndex, chunk, buf, length, !from);
+		}
+	}
+	chunkCacheDrop(entryIndex);
+	logTailDrop(entryIndex);
+
+	// whichever version is left over gives its blocks back
+	if (ret == -1)
+	{
+		entrySwap(entryIndex, &old, &oldHoles);
+	}
+	chainFree(old.dataStartIndex);
+	holeListRelease(&oldHoles);
+	free(oldHoles.holes);
+	if (ret == -1)
+	{
+		return -1;
+	}
+	written[entryIndex] = true;
+	return 0;
+}
+
+int fs_compress(int fd, int enable)
+{
+	if (!fdValid(fd))
+	{
+		return -1;
+	}
+	writebackHold();
+	int ret = fileCompress(fd, enable);
+	writebackCheck();
+	writebackRelease();
+	return ret;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	/* TODO: Phase 4 */
+	// Check if fd is valid and if disk is mounted
+	if (!fdValid(fd) || buf == NULL)
+	{
+		return -1;
+	}
+
+	struct iovec iov = { buf, count };
+	return fileTransfer(fd, &iov, 1, count, true);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	/* TODO: Phase 4 */
+	if (!fdValid(fd) || buf == NULL) {
+		return -1;
+	}
+
+	struct iovec iov = { buf, count };
+	return fileTransfer(fd, &iov, 1, count, false);
+}
+
+/**
+ * Check an iovec array passed to fs_writev/fs_readv
+ * return total number of bytes it describes, or -1 if a buffer is NULL
+*/
+long iovTotal(const struct iovec *iov, int iovcnt)
+{
+	long total = 0;
+	for (int i = 0; i < iovcnt; i++)
+	{
+		if (iov[i].iov_base == NULL && iov[i].iov_len != 0)
+		{
+			return -1;
+		}
+		total += iov[i].iov_len;
+	}
+	return total;
+}
+
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	if (!fdValid(fd) || iov == NULL || iovcnt < 0)
+	{
+		return -1;
+	}
+
+	long count = iovTotal(iov, iovcnt);
+	if (count == -1)
+	{
+		return -1;
+	}
+	return fileTransfer(fd, iov, iovcnt, count, true);
+}
+
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	if (!fdValid(fd) || iov == NULL || iovcnt < 0)
+	{
+		return -1;
+	}
+
+	long count = iovTotal(iov, iovcnt);
+	if (count == -1)
+	{
+		return -1;
+	}
+	return fileTransfer(fd, iov, iovcnt, count, false);
+}
+
+// Buckets of the root directory index of fs_submit(), twice the number of
+// entries so that probe sequences stay short
+#define BATCH_BUCKETS (2 * FS_FILE_MAX_COUNT)
+#define BATCH_EMPTY -1
+#define BATCH_DELETED -2
+
+/**
+ * Index of the root directory built once per batch, so that each operation
+ * finds its file or a free entry without scanning rootEntries
+*/
+struct BatchIndex
+{
+	// entry index, BATCH_EMPTY, or BATCH_DELETED once its file is deleted
+	int buckets[BATCH_BUCKETS];
+	// free entries, the lowest on top as fs_create() would pick it
+	int freeEntries[FS_FILE_MAX_COUNT];
+	int freeCount;
+};
+
+/**
+ * FNV-1a hash of filename, as a bucket of the batch index
+*/
+unsigned int batchHash(const char *filename)
+{
+	uint32_t hash = 2166136261u;
+	for (const char *c = filename; *c != '\0'; c++)
+	{
+		hash = (hash ^ (unsigned char)*c) * 16777619u;
+	}
+	return hash % BATCH_BUCKETS;
+}
 
-			// also reset the filename to show a space is free in rootEntries
-			// setting first character to \0 is sufficient
-			rootEntries[i].filename[0] = '\0';
-			return 0;
+/**
+ * Find the bucket of filename in the batch index
+ * return the bucket, or -1 if there is no such file
+*/
+int batchFind(const struct BatchIndex *index, const char *filename)
+{
+	unsigned int b = batchHash(filename);
+	for (int probe = 0; probe < BATCH_BUCKETS; probe++, b = (b + 1) % BATCH_BUCKETS)
+	{
+		int entry = index->buckets[b];
+		if (entry == BATCH_EMPTY)
+		{
+			break;
+		}
+		if (entry >= 0 && strcmp(rootEntries[entry].filename, filename) == 0)
+		{
+			return b;
 		}
-		i++;
 	}
-
-	// file name is not in rootEntries
 	return -1;
 }
 
-int fs_ls(void)
+/**
+ * Add rootEntries[entry] to the batch index, reusing buckets of deleted files
+ * there is always a bucket left as they outnumber the entries
+*/
+void batchInsert(struct BatchIndex *index, int entry)
 {
-	/* TODO: Phase 2 */
-	if (!mount)
+	unsigned int b = batchHash(rootEntries[entry].filename);
+	while (index->buckets[b] >= 0)
 	{
-		return -1;
-	}
-	int i = 0;
-	printf("FS Ls:\n");
-	while (i < FS_FILE_MAX_COUNT)
-	{
-		//maybe need a loop for filename[]
-		if (strlen(rootEntries[i].filename) != 0)
-			printf("file: %s, size: %d, data_blk: %d\n", rootEntries[i].filename, rootEntries[i].fileSize, rootEntries[i].dataStartIndex);
-		i++;
+		b = (b + 1) % BATCH_BUCKETS;
 	}
-	return 0;
+	index->buckets[b] = entry;
 }
 
-int fs_open(const char *filename)
+/**
+ * Apply one operation of a batch
+ * return its result, -1 on failure
+*/
+int batchApply(struct BatchIndex *index, const struct fs_op *op, bool *touched)
 {
-	/* TODO: Phase 3 */
-	// return -1 if disk is not mounted and filename is invalid
-	if (!mount || strlen(filename) == 0 || strlen(filename) >= FS_FILENAME_LEN)
+	if (op->filename == NULL || strlen(op->filename) >= FS_FILENAME_LEN)
 	{
 		return -1;
 	}
 
-	// Find filename in root directory
-	int fileIndex = 0;
-	while (fileIndex < FS_FILE_MAX_COUNT && strcmp(rootEntries[fileIndex].filename, filename) != 0)
+	int b = batchFind(index, op->filename);
+	int entry = b == -1 ? -1 : index->buckets[b];
+	if (op->type == FS_OP_CREATE)
 	{
-		fileIndex++;
+		if (entry != -1 || op->filename[0] == '\0' || index->freeCount == 0)
+		{
+			return -1;
+		}
+		entry = index->freeEntries[--index->freeCount];
+		entryCreate(entry, op->filename);
+		batchInsert(index, entry);
+		return 0;
 	}
-	
-	// Condition for if file not found in root directory
-	if (fileIndex == FS_FILE_MAX_COUNT)
+	if (entry == -1)
 	{
 		return -1;
 	}
 
-	// Find a valid fd
-	int fd = 0;
-	for (; fd < FS_OPEN_MAX_COUNT && fdTable[fd].entryIndex != FD_EMPTY; fd++);
-	if (fd == FS_OPEN_MAX_COUNT)
+	switch (op->type)
+	{
+	case FS_OP_DELETE:
+		// cannot delete a file that is currently open
+		if (openCount[entry] > 0)
+		{
+			return -1;
+		}
+		entryDelete(entry);
+		written[entry] = false;
+		touched[entry] = false;
+		index->buckets[b] = BATCH_DELETED;
+		index->freeEntries[index->freeCount++] = entry;
+		return 0;
+	case FS_OP_WRITE:
 	{
+		if (op->buf == NULL || op->offset > UINT32_MAX)
+		{
+			return -1;
+		}
+		struct iovec iov = { (void *)op->buf, op->count };
+		touched[entry] = true;
+		return entryIO(entry, op->offset, &iov, 1, op->count, true);
+	}
+	case FS_OP_TRUNCATE:
+		if (op->offset > UINT32_MAX)
+		{
+			return -1;
+		}
+		touched[entry] = true;
+		return entryResize(entry, op->offset);
+	default:
 		return -1;
 	}
-	fdTable[fd].entryIndex = fileIndex;
-	fdTable[fd].offset = 0;
-	
-	return fd;
 }
 
-int fs_close(int fd)
+int fs_submit(struct fs_op *ops, int count, int sync)
 {
-	/* TODO: Phase 3 */
-	// Check if fd is valid and if disk is mounted
-	if (!mount || fd < 0 || fd >= FS_OPEN_MAX_COUNT || fdTable[fd].entryIndex == FD_EMPTY)
+	if (!mount || ops == NULL || count < 0)
 	{
 		return -1;
 	}
 
-	fdTable[fd].entryIndex = FD_EMPTY;
+	// one pass over the root directory for the whole batch
+	struct BatchIndex index;
+	for (int b = 0; b < BATCH_BUCKETS; b++)
+	{
+		index.buckets[b] = BATCH_EMPTY;
+	}
+	index.freeCount = 0;
+	for (int i = FS_FILE_MAX_COUNT - 1; i >= 0; i--)
+	{
+		if (rootEntries[i].filename[0] == '\0')
+		{
+			index.freeEntries[index.freeCount++] = i;
+		}
+		else
+		{
+			batchInsert(&index, i);
+		}
+	}
 
-	return 0;
+	bool touched[FS_FILE_MAX_COUNT] = { false };
+	int done = 0;
+	writebackHold();
+	for (int i = 0; i < count; i++)
+	{
+		ops[i].result = batchApply(&index, &ops[i], touched);
+		done += ops[i].result != -1;
+	}
+
+	// files not open elsewhere are packed once, whatever the number of writes
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if (touched[i] && openCount[i] == 0)
+		{
+			entrySettle(i);
+		}
+	}
+	writebackCheck();
+	writebackRelease();
+
+	if (sync && fs_sync() == -1)
+	{
+		return -1;
+	}
+	return done;
 }
 
-int fs_stat(int fd)
+/**
+ * Number of logical blocks of rootEntries[entryIndex] covered by the first
+ * chainLength blocks of its chain together with the holes in between
+*/
+uint32_t logicalBlocksFor(int entryIndex, uint32_t chainLength)
 {
-	/* TODO: Phase 3 */
-	// Check if fd is valid and if disk is mounted
-	if (!mount || fd < 0 || fd >= FS_OPEN_MAX_COUNT || fdTable[fd].entryIndex == FD_EMPTY)
+	struct HoleList *list = &holeLists[entryIndex];
+	uint32_t blocks = 0;
+	for (int i = 0; i < list->count; i++)
 	{
-		return -1;
+		uint32_t gap = list->holes[i].start - blocks;
+		if (chainLength <= gap)
+		{
+			break;
+		}
+		chainLength -= gap;
+		blocks = list->holes[i].start + list->holes[i].count;
 	}
+	return blocks + chainLength;
+}
 
-	return rootEntries[fdTable[fd].entryIndex].fileSize;
+/**
+ * State shared by the fs_check workers
+ * visited has one bit per FAT entry, set by the first chain that reaches the block
+*/
+struct CheckState
+{
+	uint64_t *visited;
+	int nextEntry;
+	int nthreads;
+	int worker;
+	struct fs_check_report report;
+};
+
+/**
+ * Mark block i as reached by a chain
+ * return true if another chain (or this one, for a loop) got there first
+*/
+bool checkVisit(uint64_t *visited, int i)
+{
+	uint64_t bit = (uint64_t)1 << (i % 64);
+	return __atomic_fetch_or(&visited[i / 64], bit, __ATOMIC_RELAXED) & bit;
 }
 
-int fs_lseek(int fd, size_t offset)
+/**
+ * Walk the chain starting at FATIndex, stopping at the first block that is
+ * out of range, free, or already owned
+ * *length is set to the number of good blocks and *last to the last of them
+ * return true if the chain ended cleanly with FAT_EOC
+*/
+bool checkChain(uint64_t *visited, int FATIndex, uint32_t *length, int *last, struct fs_check_report *report)
 {
-	/* TODO: Phase 3 */
-	// Check if fd is valid and if disk is mounted
-	if (!mount || fd < 0 || fd >= FS_OPEN_MAX_COUNT || fdTable[fd].entryIndex == FD_EMPTY)
+	*length = 0;
+	*last = FAT_EOC;
+	while (FATIndex != FAT_EOC)
 	{
-		return -1;
+		if (FATIndex < 1 || FATIndex >= FATLength || FAT[FATIndex] == 0)
+		{
+			__atomic_add_fetch(&report->bad_links, 1, __ATOMIC_RELAXED);
+			return false;
+		}
+		if (checkVisit(visited, FATIndex) || *length == (uint32_t)FATLength)
+		{
+			__atomic_add_fetch(&report->cross_linked, 1, __ATOMIC_RELAXED);
+			return false;
+		}
+		(*length)++;
+		*last = FATIndex;
+		FATIndex = FAT[FATIndex];
 	}
+	return true;
+}
 
-	// Check if new offset is greater than current file size
-	if (offset > rootEntries[fdTable[fd].entryIndex].fileSize)
+/**
+ * Phase 1 worker: take root entries one at a time and walk their chains
+*/
+void *checkEntries(void *arg)
+{
+	struct CheckState *state = arg;
+	int i;
+	while ((i = __atomic_fetch_add(&state->nextEntry, 1, __ATOMIC_RELAXED)) < FS_FILE_MAX_COUNT)
 	{
-		return -1;
+		if (rootEntries[i].filename[0] == '\0')
+		{
+			continue;
+		}
+		__atomic_add_fetch(&state->report.files_checked, 1, __ATOMIC_RELAXED);
+
+		uint32_t length;
+		int last;
+		if (checkChain(state->visited, rootEntries[i].dataStartIndex, &length, &last, &state->report)
+		&& length != chainBlocksFor(i, rootEntries[i].fileSize))
+		{
+			__atomic_add_fetch(&state->report.size_mismatch, 1, __ATOMIC_RELAXED);
+		}
 	}
+	return NULL;
+}
 
-	fdTable[fd].offset = offset;
-	return 0;
+/**
+ * Phase 2 worker: count allocated blocks in this worker's slice of the FAT that no chain reached
+*/
+void *checkLeaks(void *arg)
+{
+	struct CheckState *state = arg;
+	int worker = __atomic_fetch_add(&state->worker, 1, __ATOMIC_RELAXED);
+	int words = (FATLength + 63) / 64;
+	int per = (words + state->nthreads - 1) / state->nthreads;
+	int leaked = 0;
+	for (int w = worker * per; w < (worker + 1) * per && w < words; w++)
+	{
+		for (int i = w == 0 ? 1 : w * 64; i < (w + 1) * 64 && i < FATLength; i++)
+		{
+			if (FAT[i] != 0 && !(state->visited[w] & ((uint64_t)1 << (i % 64))))
+			{
+				leaked++;
+			}
+		}
+	}
+	__atomic_add_fetch(&state->report.leaked_blocks, leaked, __ATOMIC_RELAXED);
+	return NULL;
 }
 
-int fs_write(int fd, void *buf, size_t count)
+/**
+ * Count the holders of every block: the root entries, the metadata heads and
+ * the FAT for the chain it is in, and each shared run of the files and
+ * snapshots over it. Compare them with blockRefs, bringing blockRefs in line if
+ * fix is set
+ * return number of blocks whose reference count was wrong, or -1 if out of memory
+*/
+int checkRefs(bool fix)
 {
-	/* TODO: Phase 4 */
-	// Check if fd is valid and if disk is mounted
-	if (!mount || fd < 0 || fd >= FS_OPEN_MAX_COUNT || fdTable[fd].entryIndex == FD_EMPTY || buf == NULL)
+	uint16_t *links = calloc(FATLength, sizeof(uint16_t));
+	if (links == NULL)
 	{
 		return -1;
 	}
-
-	if (count == 0) 
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
 	{
-		return 0;
+		int head = rootEntries[i].dataStartIndex;
+		if (rootEntries[i].filename[0] != '\0' && head >= 1 && head < FATLength)
+		{
+			links[head]++;
+		}
+	}
+	for (int i = 0; i < META_TABLE_COUNT; i++)
+	{
+		if (superblock.metaHead[i] >= 1 && superblock.metaHead[i] < FATLength)
+		{
+			links[superblock.metaHead[i]]++;
+		}
+	}
+	for (int s = -1; s < snapshotCount; s++)
+	{
+		struct HoleList *lists = s == -1 ? holeLists : snapshots[s].holes;
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+		{
+			for (int h = 0; h < lists[i].count; h++)
+			{
+				struct Hole *hole = &lists[i].holes[h];
+				for (uint32_t b = hole->block; hole->block != 0 && b < hole->block + hole->count && b < (uint32_t)FATLength; b++)
+				{
+					links[b]++;
+				}
+			}
+		}
+	}
+	for (int i = 1; i < FATLength; i++)
+	{
+		if (FAT[i] != 0 && FAT[i] < FATLength)
+		{
+			links[FAT[i]]++;
+		}
 	}
 
-	long remainingByte = count;
-	//printf("Remaining: %ld\n", remainingByte);
-	char bounce[BLOCK_SIZE];
-	// Find block location of offset to start
-	long offset = fdTable[fd].offset;
-	int FATIndex = findFATStart(fd, &offset);
-	if (FATIndex == FAT_EOC)
+	int wrong = 0;
+	sharedCount = 0;
+	for (int i = 1; i < FATLength; i++)
 	{
-		int result = falloc(fd);
-		if (result == -1)
+		uint16_t refs = FAT[i] != 0 && links[i] > 1 ? links[i] - 1 : 0;
+		if (blockRefs[i] != refs)
 		{
-			//need to fix??
-			fdTable[fd].offset += count - remainingByte;
-			if (rootEntries[fdTable[fd].entryIndex].fileSize < fdTable[fd].offset)
+			wrong++;
+			if (fix)
 			{
-				rootEntries[fdTable[fd].entryIndex].fileSize = fdTable[fd].offset;
+				blockRefs[i] = refs;
 			}
-			return count - remainingByte;
 		}
-		FATIndex = rootEntries[fdTable[fd].entryIndex].dataStartIndex;
+		sharedCount += blockRefs[i] > 0;
 	}
-	block_read(superblock.dataB_startIndex + FATIndex, bounce);
+	free(links);
+	return wrong;
+}
 
-	// Case 1: write first block
-	long readByte;
-	if (BLOCK_SIZE - offset < remainingByte)
+/**
+ * Mark the tail blocks of the packed files and snapshot files as in use, once
+ * the chains have been walked
+ * A tail is bad if it lies outside of an allocated block or in a block that a
+ * chain reached; with repair set the file is cut before its tail.
+ * return number of bad tails, or -1 if out of memory
+*/
+int checkTails(uint64_t *visited, bool repair)
+{
+	uint64_t *tails = calloc((FATLength + 63) / 64, sizeof(uint64_t));
+	if (tails == NULL)
 	{
-		readByte = BLOCK_SIZE - offset;
+		return -1;
 	}
-	else 
+	int bad = 0;
+	for (int s = -1; s < snapshotCount; s++)
 	{
-		readByte = count;
+		struct RootEntry *entries = s == -1 ? rootEntries : snapshots[s].entries;
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+		{
+			struct RootEntry *entry = &entries[i];
+			if (entry->filename[0] == '\0' || !(entry->flags & ENTRY_TAIL))
+			{
+				continue;
+			}
+			int b = entry->tailBlock;
+			uint64_t bit = (uint64_t)1 << (b % 64);
+			if (tailValid(entry) && (!(visited[b / 64] & bit) || (tails[b / 64] & bit)))
+			{
+				visited[b / 64] |= bit;
+				tails[b / 64] |= bit;
+				continue;
+			}
+			bad++;
+			if (repair)
+			{
+				entry->fileSize = entry->fileSize / blockSize * blockSize;
+				entry->flags &= ~ENTRY_TAIL;
+			}
+		}
 	}
-	remainingByte -= readByte;
-	//printf("Remaining: %ld\n", remainingByte);
-	memcpy(bounce + offset, buf, readByte);
-	block_write(superblock.dataB_startIndex + FATIndex, bounce);
-	
-	// Case 2: write intermediate full blocks
-	while (remainingByte > BLOCK_SIZE)
+	free(tails);
+	return bad;
+}
+
+/**
+ * Mark the blocks that the shared runs of the files and snapshots point at as
+ * in use, once the chains and tails have been walked: they belong to chains
+ * or to other runs too, so they may have been reached already
+ * A run is bad if it points at a block that is out of range or free; with
+ * repair set it becomes a hole.
+ * return number of bad runs
+*/
+int checkRuns(uint64_t *visited, bool repair)
+{
+	int bad = 0;
+	for (int s = -1; s < snapshotCount; s++)
 	{
-		if (FAT[FATIndex] == FAT_EOC)
+		struct HoleList *lists = s == -1 ? holeLists : snapshots[s].holes;
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
 		{
-			int result = falloc(fd);
-			if (result == -1)
+			for (int h = 0; h < lists[i].count; h++)
 			{
-				//need to fix??
-				fdTable[fd].offset += count - remainingByte;
-				if (rootEntries[fdTable[fd].entryIndex].fileSize < fdTable[fd].offset)
+				struct Hole *hole = &lists[i].holes[h];
+				bool good = hole->block + hole->count <= (uint32_t)FATLength;
+				for (uint32_t b = hole->block; hole->block != 0 && good && b < hole->block + hole->count; b++)
+				{
+					good = FAT[b] != 0;
+				}
+				if (!good)
 				{
-					rootEntries[fdTable[fd].entryIndex].fileSize = fdTable[fd].offset;
+					bad++;
+					if (repair)
+					{
+						hole->block = 0;
+					}
+					continue;
+				}
+				for (uint32_t b = hole->block; hole->block != 0 && b < hole->block + hole->count; b++)
+				{
+					visited[b / 64] |= (uint64_t)1 << (b % 64);
 				}
-				return count - remainingByte;
 			}
 		}
-		FATIndex = FAT[FATIndex];
-		block_write(superblock.dataB_startIndex + FATIndex, buf + (count - remainingByte));
-		remainingByte -= BLOCK_SIZE;
-		//printf("Remaining: %ld\n", remainingByte);
+	}
+	return bad;
+}
+
+/**
+ * Run fn on nthreads threads and wait for all of them
+*/
+void checkRun(struct CheckState *state, void *(*fn)(void *))
+{
+	pthread_t *threads = malloc(sizeof(pthread_t) * state->nthreads);
+	int started = 0;
+	state->worker = 0;
+	for (; threads != NULL && started < state->nthreads; started++)
+	{
+		if (pthread_create(&threads[started], NULL, fn, state) != 0)
+		{
+			break;
+		}
+	}
+	// whatever could not get a thread of its own runs here
+	for (int i = started; i < state->nthreads; i++)
+	{
+		fn(state);
+	}
+	for (int i = 0; i < started; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+}
+
+/**
+ * Fix what fs_check found, one file at a time in root directory order so the
+ * outcome does not depend on thread timing: a chain is cut before the first
+ * bad or already owned block, sizes are brought in line with the chains, and
+ * unreachable blocks are freed
+ * return number of fixes made
+*/
+int checkRepair(uint64_t *visited)
+{
+	int words = (FATLength + 63) / 64;
+	struct fs_check_report scratch;
+	int fixes = 0;
+	chunkCacheDrop(-1);
+	memset(&scratch, 0, sizeof(scratch));
+	memset(visited, 0, sizeof(uint64_t) * words);
+
+	// metadata tables are rewritten from memory at umount, their chains only need to stay walkable
+	for (int i = 0; i < META_TABLE_COUNT; i++)
+	{
+		uint32_t length;
+		int last;
+		if (superblock.metaHead[i] != 0 && !checkChain(visited, superblock.metaHead[i], &length, &last, &scratch))
+		{
+			if (last == FAT_EOC)
+			{
+				superblock.metaHead[i] = 0;
+			}
+			else
+			{
+				FAT[last] = FAT_EOC;
+			}
+			fixes++;
+		}
 	}
 
-	// Case 3: write last block
-	if (remainingByte > 0)
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
 	{
-		if (FAT[FATIndex] == FAT_EOC)
+		if (rootEntries[i].filename[0] == '\0')
+		{
+			continue;
+		}
+		struct RootEntry *entry = &rootEntries[i];
+		uint32_t length;
+		int last;
+		if (!checkChain(visited, entry->dataStartIndex, &length, &last, &scratch))
+		{
+			if (last == FAT_EOC)
+			{
+				entry->dataStartIndex = FAT_EOC;
+			}
+			else
+			{
+				FAT[last] = FAT_EOC;
+			}
+			fixes++;
+		}
+
+		uint32_t needed = chainBlocksFor(i, entry->fileSize);
+		if (length < needed)
 		{
-			int result = falloc(fd);
-			if (result == -1)
+			// keep the part of the file that the chain and holes still cover
+			uint32_t blocks = logicalBlocksFor(i, length);
+			entry->fileSize = blocks * blockSize;
+			entry->flags &= ~ENTRY_TAIL;
+			// the references are counted again after the repair
+			holeListClip(&holeLists[i], blocks);
+			fixes++;
+		}
+		else if (length > needed)
+		{
+			// the blocks past the end are freed by the leak sweep below
+			int keep = entry->dataStartIndex;
+			if (needed == 0)
+			{
+				entry->dataStartIndex = FAT_EOC;
+			}
+			else
 			{
-				//need to fix??
-				fdTable[fd].offset += count - remainingByte;
-				if (rootEntries[fdTable[fd].entryIndex].fileSize < fdTable[fd].offset)
+				for (uint32_t k = 1; k < needed; k++)
 				{
-					rootEntries[fdTable[fd].entryIndex].fileSize = fdTable[fd].offset;
+					keep = FAT[keep];
 				}
-				return count - remainingByte;
+				int extra = FAT[keep];
+				FAT[keep] = FAT_EOC;
+				keep = extra;
 			}
+			for (; keep != FAT_EOC; keep = FAT[keep])
+			{
+				visited[keep / 64] &= ~((uint64_t)1 << (keep % 64));
+			}
+			fixes++;
 		}
-		FATIndex = FAT[FATIndex];
-		block_read(superblock.dataB_startIndex + FATIndex, bounce);
-		memcpy(bounce,  buf + (count - remainingByte), remainingByte);
-		block_write(superblock.dataB_startIndex + FATIndex, bounce);
-		remainingByte -= remainingByte;
-		//printf("Remaining: %ld\n", remainingByte);
 	}
 
-	fdTable[fd].offset += count - remainingByte;
-	if (rootEntries[fdTable[fd].entryIndex].fileSize < fdTable[fd].offset)
+	// without the tails and runs marked, the sweep would free their blocks
+	int tails = checkTails(visited, true);
+	fixes += checkRuns(visited, true);
+	for (int i = 1; i < FATLength && tails != -1; i++)
 	{
-		rootEntries[fdTable[fd].entryIndex].fileSize = fdTable[fd].offset;
+		if (FAT[i] != 0 && !(visited[i / 64] & ((uint64_t)1 << (i % 64))))
+		{
+			FAT[i] = 0;
+			fixes++;
+		}
 	}
-	return count - remainingByte;
+	fixes += tails > 0 ? tails : 0;
+
+	free(freeMap);
+	freeMapBuild();
+	return fixes;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+int fs_check(struct fs_check_report *report, int nthreads, int repair)
 {
-	/* TODO: Phase 4 */
-	if (!mount || fd < 0 || fd >= FS_OPEN_MAX_COUNT || fdTable[fd].entryIndex == FD_EMPTY || buf == NULL) {
+	if (!mount || report == NULL)
+	{
 		return -1;
 	}
-	
-	long remainingByte = count;
-	long readByte = 0;
-	char bounce[BLOCK_SIZE];
-	long offset = fdTable[fd].offset; // starting offset from the first reading
-	int FATIndex = findFATStart(fd, &offset);
 
-	if (rootEntries[fdTable[fd].entryIndex].fileSize - fdTable[fd].offset < remainingByte) {
-		remainingByte = rootEntries[fdTable[fd].entryIndex].fileSize - fdTable[fd].offset;
+	// repairs rewrite chains, which open files may be in the middle of
+	if (repair)
+	{
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+		{
+			if (openCount[i] > 0)
+			{
+				return -1;
+			}
+		}
 	}
-	readByte = remainingByte;
 
-	if (readByte == 0) {
-		return 0;
+	struct CheckState state;
+	memset(&state, 0, sizeof(state));
+	// more threads than CPUs only contend for the bitmap, and each leak worker needs a word of it
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	state.nthreads = nthreads > 0 && nthreads < cpus ? nthreads : cpus;
+	if (state.nthreads > (FATLength + 63) / 64)
+	{
+		state.nthreads = (FATLength + 63) / 64;
+	}
+	if (state.nthreads < 1)
+	{
+		state.nthreads = 1;
+	}
+	state.visited = calloc((FATLength + 63) / 64, sizeof(uint64_t));
+	if (state.visited == NULL)
+	{
+		return -1;
 	}
 
-	//first read
-	block_read(superblock.dataB_startIndex + FATIndex, bounce);
-	// the first read block is not the end of file but reading ends in a block
-	if(remainingByte < (BLOCK_SIZE - offset)) {
-		memcpy(buf, bounce + offset, remainingByte);
-		fdTable[fd].offset += readByte;
-		return readByte;
+	// metadata chains own their blocks like files do
+	for (int i = 0; i < META_TABLE_COUNT; i++)
+	{
+		uint32_t length;
+		int last;
+		if (superblock.metaHead[i] != 0)
+		{
+			checkChain(state.visited, superblock.metaHead[i], &length, &last, &state.report);
+		}
 	}
-	// read until the end of the first block
-	else {
-		memcpy(buf, bounce + offset, (BLOCK_SIZE - offset)); 
-		remainingByte = remainingByte - (BLOCK_SIZE - offset);
-		FATIndex = FAT[FATIndex];
+
+	checkRun(&state, checkEntries);
+	int tails = checkTails(state.visited, false);
+	if (tails == -1)
+	{
+		free(state.visited);
+		return -1;
 	}
-	while (remainingByte > BLOCK_SIZE) {
-		// read whole block
-		block_read(superblock.dataB_startIndex + FATIndex, buf + (readByte - remainingByte));
-		remainingByte = remainingByte - BLOCK_SIZE;
-		FATIndex = FAT[FATIndex];
+	state.report.bad_links += tails + checkRuns(state.visited, false);
+	checkRun(&state, checkLeaks);
+	state.report.bad_refcounts = checkRefs(false);
+	if (state.report.bad_refcounts == -1)
+	{
+		free(state.visited);
+		return -1;
 	}
-	// read end of block 
-	if(remainingByte > 0) {
-		block_read(superblock.dataB_startIndex + FATIndex, bounce);
-		memcpy(buf + (readByte - remainingByte), bounce, remainingByte);
+
+	*report = state.report;
+	if (repair && (report->bad_links || report->cross_linked || report->size_mismatch || report->leaked_blocks
+	|| report->bad_refcounts))
+	{
+		writebackHold();
+		report->repaired = checkRepair(state.visited);
+		// chains may have been cut, count the references again
+		int fixed = checkRefs(true);
+		report->repaired += fixed > 0 ? fixed : 0;
+		tailTableClear();
+		tailTableBuild();
+		writebackCheck();
+		writebackRelease();
 	}
 
-	// file size and actual file offset. 
-	fdTable[fd].offset += readByte;
-	return readByte;
+	free(state.visited);
+	return 0;
 }
-
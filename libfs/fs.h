@@ -2,6 +2,7 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -9,9 +10,89 @@
 /** Maximum number of files in the root directory */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/** Initial number of open file slots (the table grows on demand) */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Information about a file of the root directory, see fs_readdir() */
+struct fs_dirent {
+	/** NULL-terminated file name */
+	char filename[FS_FILENAME_LEN];
+	/** File size in bytes */
+	size_t size;
+	/** Index of the first data block, or 65535 for an empty file */
+	int first_block;
+};
+
+/** Position in the root directory, see fs_opendir() */
+struct fs_dir {
+	int next;
+};
+
+/** Information about the mounted file system, see fs_statfs() */
+struct fs_statfs {
+	int total_blk_count;
+	int fat_blk_count;
+	int rdir_blk;
+	int data_blk;
+	int data_blk_count;
+	/** Number of free entries in the FAT */
+	int fat_free;
+	/** Number of free entries in the root directory */
+	int rdir_free;
+	/** Size of a block in bytes */
+	int block_size;
+};
+
+/** Problems found by fs_check() */
+struct fs_check_report {
+	/** Number of files whose chain was walked */
+	int files_checked;
+	/** Chains that point outside the data region or at a free block */
+	int bad_links;
+	/** Chains that run into a block already used by another chain */
+	int cross_linked;
+	/** Files whose size does not match the length of their chain */
+	int size_mismatch;
+	/** Allocated blocks that no file reaches */
+	int leaked_blocks;
+	/** Blocks whose reference count does not match the files sharing them */
+	int bad_refcounts;
+	/** Number of fixes applied when repairing */
+	int repaired;
+};
+
+/** Operations of a batch, see fs_submit() */
+#define FS_OP_CREATE 0
+#define FS_OP_DELETE 1
+#define FS_OP_WRITE 2
+#define FS_OP_TRUNCATE 3
+
+/** One operation of a batch passed to fs_submit() */
+struct fs_op {
+	/** One of the FS_OP_ values */
+	int type;
+	/** Name of the file the operation applies to */
+	const char *filename;
+	/** Data to write, for FS_OP_WRITE */
+	const void *buf;
+	/** Number of bytes of @buf to write, for FS_OP_WRITE */
+	size_t count;
+	/** Offset to write at for FS_OP_WRITE, new size for FS_OP_TRUNCATE */
+	size_t offset;
+	/** Set to -1 on failure, to the bytes written for FS_OP_WRITE, 0 otherwise */
+	int result;
+};
+
+/** Thresholds of background metadata writeback, see fs_writeback() */
+struct fs_writeback {
+	/** Percentage of the metadata blocks that may be dirty before writeback */
+	unsigned int dirty_ratio;
+	/** Milliseconds a change may wait before writeback, 0 for no limit */
+	unsigned int dirty_age_ms;
+	/** Percentage of dirty or queued metadata blocks at which callers wait */
+	unsigned int hard_ratio;
+};
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -20,6 +101,9 @@
  * contains. A file system needs to be mounted before files can be read from it
  * with fs_read() or written to it with fs_write().
  *
+ * The block device driver is selected by prefixing @diskname with its name,
+ * as in "mmap:disk.fs" or "ram:disk.fs", see block_disk_open().
+ *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
@@ -29,7 +113,8 @@ int fs_mount(const char *diskname);
  * fs_umount - Unmount file system
  *
  * Unmount the currently mounted file system and close the underlying virtual
- * disk file.
+ * disk file. Files never take the blocks the metadata tables (holes, shared
+ * blocks, snapshots and generations) need, so a full disk still unmounts.
  *
  * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
  * closed, or if there are still open file descriptors. 0 otherwise.
@@ -45,6 +130,17 @@ int fs_umount(void);
  */
 int fs_info(void);
 
+/**
+ * fs_statfs - Get information about file system
+ * @info: Structure to be filled
+ *
+ * Fill @info with the same information that fs_info() displays, without any
+ * formatting.
+ *
+ * Return: -1 if no FS is currently mounted, or if @info is NULL. 0 otherwise.
+ */
+int fs_statfs(struct fs_statfs *info);
+
 /**
  * fs_create - Create a new file
  * @filename: File name
@@ -73,6 +169,103 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_clone - Clone a file
+ * @src: Name of the file to clone
+ * @dst: Name of the new file
+ *
+ * Create a new file named @dst with the same contents as file @src, without
+ * copying any data: both files share the same data blocks, and when one of the
+ * files writes to a block, only that block is copied. Blocks that @src had
+ * reserved with fs_reserve() past its end are given back first.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no file named @src,
+ * or if @dst cannot be created (see fs_create()), or if the disk has no room
+ * left for the metadata of the clone. 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
+/**
+ * fs_snapshot_create - Take a snapshot of the file system
+ *
+ * Freeze the current root directory and the contents of every file. No data is
+ * copied: the snapshot shares the data blocks of the files, and from then on
+ * a file that writes to one of them gets its own copy of that block only.
+ * Blocks that files had reserved with fs_reserve() past their end are given
+ * back first.
+ *
+ * Each snapshot is named by the generation of the file system it was taken
+ * at. Every block records the generation it was last written in, which is what
+ * fs_snapshot_diff() compares.
+ *
+ * Return: -1 if no FS is currently mounted, or if the disk has no room left
+ * for the metadata of the snapshot, or if out of memory. Otherwise return the
+ * id of the new snapshot.
+ */
+int fs_snapshot_create(void);
+
+/**
+ * fs_snapshot_delete - Delete a snapshot
+ * @id: Snapshot id
+ *
+ * Delete snapshot @id. Its data blocks are freed unless a file or another
+ * snapshot still uses them.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no snapshot @id. 0
+ * otherwise.
+ */
+int fs_snapshot_delete(int id);
+
+/**
+ * fs_snapshot_list - List snapshots
+ * @ids: Array to fill with snapshot ids, oldest first
+ * @max: Number of entries in @ids
+ *
+ * Return: -1 if no FS is currently mounted, or if @ids is NULL while @max is
+ * not 0. Otherwise return the number of snapshots, which can be larger than
+ * @max.
+ */
+int fs_snapshot_list(int *ids, int max);
+
+/**
+ * fs_snapshot_clone - Restore a file from a snapshot
+ * @id: Snapshot id
+ * @filename: Name of the file in the snapshot
+ * @newname: Name of the new file
+ *
+ * Create file @newname with the contents that file @filename had when snapshot
+ * @id was taken. Like fs_clone(), no data is copied.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no snapshot @id or
+ * no file @filename in it, or if @newname cannot be created (see fs_create()),
+ * or if the disk has no room left for the metadata of the clone. 0 otherwise.
+ */
+int fs_snapshot_clone(int id, const char *filename, const char *newname);
+
+/**
+ * fs_snapshot_diff - List the blocks that changed since a snapshot
+ * @from: Snapshot id to compare against, or -1 to list every block
+ * @to: Snapshot id to list the blocks of, or -1 for the whole volume
+ * @blocks: Array to fill with block numbers on the virtual disk, in disk order
+ * @max: Number of entries in @blocks
+ *
+ * List the data blocks of snapshot @to that were written after snapshot @from
+ * was taken.
+ *
+ * With @to set to -1, the list covers the whole volume as it is on disk: the
+ * superblock, FAT and root directory, the metadata kept in data blocks, and
+ * every data block in use that was written after snapshot @from was taken.
+ * Copying these blocks over an image taken at any time after snapshot @from
+ * gives back the current image, as long as nothing was written since the
+ * volume was mounted.
+ *
+ * Return: -1 if no FS is currently mounted, or if @from or @to is not a
+ * snapshot id or -1, or if @blocks is NULL while @max is not 0, or if out of
+ * memory. Otherwise return the number of blocks, which can be larger than
+ * @max.
+ */
+int fs_snapshot_diff(int from, int to, size_t *blocks, int max);
+
 /**
  * fs_ls - List files on file system
  *
@@ -82,6 +275,48 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_opendir - Start listing the root directory
+ * @dir: Directory position to initialize
+ *
+ * Set @dir to the beginning of the root directory. Files are then retrieved
+ * one at a time with fs_readdir(). Nothing is allocated, so there is no
+ * matching close call.
+ *
+ * Return: -1 if no FS is currently mounted, or if @dir is NULL. 0 otherwise.
+ */
+int fs_opendir(struct fs_dir *dir);
+
+/**
+ * fs_readdir - Get next file of the root directory
+ * @dir: Directory position, initialized by fs_opendir()
+ * @ent: Structure to be filled with the file's information
+ *
+ * Fill @ent with the name, size and first data block of the next file after
+ * position @dir, and move @dir past it. Files are returned in the order in
+ * which they sit in the root directory.
+ *
+ * Return: -1 if no FS is currently mounted, if @dir or @ent is NULL, or if
+ * @dir does not hold a position set by fs_opendir() or fs_readdir(). 0 if
+ * there are no more files, 1 if @ent was filled.
+ */
+int fs_readdir(struct fs_dir *dir, struct fs_dirent *ent);
+
+/**
+ * fs_stat_by_name - Get information about files without opening them
+ * @filenames: Array of @count file names
+ * @ents: Array of @count structures to be filled
+ * @count: Number of files to look up
+ *
+ * For each name in @filenames, fill the matching entry of @ents with the file's
+ * information. The entry of a file that does not exist is zeroed, so its
+ * filename is the empty string.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filenames or @ents is NULL.
+ * Otherwise return the number of files that were found.
+ */
+int fs_stat_by_name(const char **filenames, struct fs_dirent *ents, int count);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -91,13 +326,12 @@ int fs_ls(void);
  * that is used subsequently to access the contents of the file. The file offset
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * descriptors. The descriptor table starts with %FS_OPEN_MAX_COUNT slots and
+ * grows as needed, so the number of open files is only limited by memory.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * there is no file named @filename to open, or if there are already
- * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
- * descriptor.
+ * there is no file named @filename to open, or if the descriptor table cannot
+ * be grown. Otherwise, return the file descriptor.
  */
 int fs_open(const char *filename);
 
@@ -107,6 +341,12 @@ int fs_open(const char *filename);
  *
  * Close file descriptor @fd.
  *
+ * When the last file descriptor of a file that was written is closed, a last
+ * block holding no more than half a block of data is packed together with the
+ * last blocks of other files into a shared tail block, so that small files do
+ * not take a block each. The tail is moved back into a block of its own the
+ * next time the file is written.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open). 0 otherwise.
  */
@@ -133,12 +373,70 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * The offset may be set past the end of the file, a following write then
+ * leaves a hole between the old end of the file and @offset.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
- * than the current file size. 0 otherwise.
+ * invalid (i.e., out of bounds, or not currently open), or if @offset does not
+ * fit in 32 bits. 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
+/**
+ * fs_reserve - Preallocate space for a file
+ * @fd: File descriptor
+ * @size: Number of bytes the file is expected to hold
+ *
+ * Allocate data blocks so that the file referenced by file descriptor @fd can
+ * grow to @size bytes without any further allocation. The blocks are taken in
+ * one pass, as contiguous as the free space allows, and the file size is left
+ * unchanged. Blocks that are still unused past the end of the file when its
+ * last file descriptor is closed are given back.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if there is not enough
+ * free space for @size bytes. 0 otherwise.
+ */
+int fs_reserve(int fd, size_t size);
+
+/**
+ * fs_truncate - Set the size of a file
+ * @fd: File descriptor
+ * @length: New size of the file in bytes
+ *
+ * Set the size of the file referenced by file descriptor @fd to @length bytes.
+ * A file that shrinks loses its data past @length and the blocks that held it
+ * are freed, including any reserved with fs_reserve(). A file that grows is
+ * extended with a hole that reads back as zeros. File offsets are left as they
+ * are, even if they end up past the end of the file.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @length does not fit in
+ * 32 bits, or on I/O error. 0 otherwise.
+ */
+int fs_truncate(int fd, size_t length);
+
+/**
+ * fs_compress - Turn compression of a file on or off
+ * @fd: File descriptor
+ * @enable: Non-zero to store the file compressed, 0 to store it raw
+ *
+ * Set how the file referenced by file descriptor @fd is stored. A compressed
+ * file is cut in 32 KiB chunks, each compressed on its own with a built-in LZ
+ * codec and kept in as few blocks as it needs. Reads only decompress the
+ * chunks they cover, writes compress the chunks again. Chunks that do not
+ * compress are stored raw, and chunks of zeros take no space. The data already
+ * in the file is converted into new blocks, and the file only switches over to
+ * them, freeing the old ones, once every chunk is stored.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), if there is not enough free
+ * space to store every chunk of the file raw, holes included, besides the
+ * blocks the file holds now, or on I/O error; the file is then left as it
+ * was. 0 otherwise.
+ */
+int fs_compress(int fd, int enable);
+
 /**
  * fs_write - Write to a file
  * @fd: File descriptor
@@ -150,7 +448,9 @@ int fs_lseek(int fd, size_t offset);
  * least @count bytes.
  *
  * When the function attempts to write past the end of the file, the file is
- * automatically extended to hold the additional bytes. If the underlying disk
+ * automatically extended to hold the additional bytes. If the file offset is
+ * past the end of the file, the gap becomes a hole: it reads back as zeros and
+ * whole blocks inside it take no space on disk. If the underlying disk
  * runs out of space while performing a write operation, fs_write() should write
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
@@ -182,4 +482,240 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Array of data buffers to write in the file
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Write the buffers of @iov, in order, into the file referenced by file
+ * descriptor @fd as if they were a single buffer passed to fs_write(). The
+ * whole request is performed as one operation: the FAT chain is walked once and
+ * whole blocks that are contiguous on disk are written with a single vectored
+ * block request.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov is NULL, or if one
+ * of the buffers is NULL. Otherwise return the number of bytes actually
+ * written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Array of data buffers to be filled with data
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Read from the file referenced by file descriptor @fd into the buffers of
+ * @iov, in order, as if they were a single buffer passed to fs_read().
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov is NULL, or if one
+ * of the buffers is NULL. Otherwise return the number of bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_defrag - Make files contiguous on disk
+ * @budget_ms: Time budget in milliseconds, or 0 for no limit
+ * @moved: Set to the number of files moved by this call (can be NULL)
+ *
+ * Go through the files of the root directory and move each file whose blocks
+ * are scattered into the first run of free blocks long enough to hold it
+ * whole, so that it can then be read sequentially. A file's data is copied
+ * before its FAT links and first block are switched over, and its old blocks
+ * are only freed afterwards. Blocks the file shares with clones or snapshots
+ * move too, and the other files and snapshots follow them. Files for which no
+ * long enough free run exists are left in place. Files may stay open during
+ * defragmentation.
+ *
+ * The pass stops once @budget_ms has elapsed, and the next call resumes where
+ * it stopped, so defragmentation can be spread over many short calls.
+ *
+ * Return: -1 if no FS is currently mounted or if an I/O error occurred. 1 if the
+ * budget ran out before the pass was over, 0 once the pass is complete.
+ */
+int fs_defrag(unsigned int budget_ms, int *moved);
+
+/**
+ * fs_dedup - Turn block deduplication of the file system on or off
+ * @enable: Non-zero to share identical blocks between files, 0 to stop
+ *
+ * In dedup mode, an index of the hashes of the data blocks is kept in memory
+ * and rebuilt from the data blocks when the file system is mounted. Each whole
+ * block that a file writes is hashed before it goes to the disk: if a block
+ * elsewhere already holds the same data, the file shares that block, the same
+ * way as clones share blocks, and nothing is written. A candidate is read back
+ * and compared before it is shared, so a block whose hash matches costs a read
+ * instead of a write. Blocks are matched one at a time, wherever they are in
+ * the files.
+ *
+ * Partial blocks are written as usual. When the last file descriptor of a file
+ * that was written is closed, each of its blocks that holds the same data as a
+ * block elsewhere is shared with it, and its own copy is freed.
+ *
+ * Turning the mode on deduplicates the files already on the file system. The
+ * mode is recorded in the superblock and stays on across mounts. Turning it
+ * off keeps the blocks that are already shared.
+ *
+ * Return: -1 if no FS is currently mounted, or if the index could not be
+ * built (out of memory or I/O error). Otherwise the number of blocks freed.
+ */
+int fs_dedup(int enable);
+
+/**
+ * fs_log - Turn log-structured allocation of the file system on or off
+ * @enable: Non-zero to append every block at the log head, 0 to stop
+ *
+ * In log mode, data blocks are never written in place. Every new block, and
+ * the new version of every block that is written again, is taken from a head
+ * that moves forward through the data region and wraps around at its end, and
+ * the previous version is freed. Files written at the same time share the head,
+ * so the disk sees one sequential stream of writes whatever their number. The
+ * metadata tables are appended the same way when they are saved, and the FAT
+ * and root directory go through the journal on volumes made with one
+ * (fs_make.x -j). The last partial block written to each file is kept in
+ * memory, so small appends do not read it back from the disk.
+ *
+ * Freed blocks leave holes behind the head, which fs_clean() gathers into
+ * whole free segments. The mode and the position of the head are recorded in
+ * the superblock and stay on across mounts.
+ *
+ * Return: -1 if no FS is currently mounted. 0 otherwise.
+ */
+int fs_log(int enable);
+
+/**
+ * fs_clean - Reclaim free space for the log
+ * @budget_ms: Time budget in milliseconds, or 0 for no limit
+ * @freed: Set to the number of segments emptied by this call (can be NULL)
+ *
+ * The data region is cut in segments of 64 blocks. Pick the segments with the
+ * fewest blocks in use, at most three quarters of them, read each one whole,
+ * append the blocks in use at the log head and relink them, so that the
+ * segment is left entirely free for the log to write sequentially. Segments
+ * holding blocks shared between files, tail blocks, metadata tables or blocks
+ * only snapshots use are left in place. Data is copied before any link
+ * changes. Files may stay open during cleaning.
+ *
+ * Each segment is cleaned or written to at most once per call. The call stops
+ * once @budget_ms has elapsed, and the next call picks the segments again.
+ *
+ * Return: -1 if no FS is currently mounted, if it is not in log mode, or on I/O
+ * error or if out of memory. 1 if the budget ran out, 0 once no segment is
+ * worth cleaning.
+ */
+int fs_clean(unsigned int budget_ms, int *freed);
+
+/**
+ * fs_check - Verify the consistency of the file system
+ * @report: Structure to be filled with the problems found
+ * @nthreads: Number of worker threads, or 0 for one per online CPU (larger
+ * counts are capped to that)
+ * @repair: Whether problems should be fixed
+ *
+ * Walk the FAT chain of every file of the root directory, on @nthreads threads
+ * sharing a bitmap of the blocks already reached, then mark the blocks that
+ * files and snapshots share with each other, and sweep the FAT for allocated
+ * blocks that nothing reaches. Cross-linked chains, links to free or out of
+ * range blocks (from a chain or a shared run), file sizes that disagree with
+ * their chain, and leaked blocks are counted in @report.
+ *
+ * If @repair is set and problems were found, every chain is cut before its
+ * first bad link or the first block that another chain already reached. The
+ * metadata tables are walked first, then the files in root directory order, so
+ * the first of them keeps a cross-linked block. Shared runs that point at bad
+ * blocks read back as zeros, and the reference counts of shared blocks are
+ * recomputed. Sizes are clamped to what the chains hold, extra blocks past
+ * the end of a file are freed, and leaked blocks are freed.
+ * Repairs only touch the in-memory copy; they reach the disk at fs_umount().
+ *
+ * Return: -1 if no FS is currently mounted, if @report is NULL, or if @repair
+ * is set while files are open. 0 otherwise.
+ */
+int fs_check(struct fs_check_report *report, int nthreads, int repair);
+
+/**
+ * fs_writeback - Start or stop background metadata writeback
+ * @params: Writeback thresholds, or NULL to stop
+ *
+ * The FAT and root directory are kept in memory and written when the file
+ * system is unmounted. With background writeback, a flusher thread writes
+ * their changed blocks while the file system is in use, in block order and
+ * merging neighbouring blocks into one request, so fs_umount() only has what
+ * changed since the last writeback left to write.
+ *
+ * Modifying calls check how many metadata blocks differ from the disk. Once
+ * that reaches @params->dirty_ratio percent of them, or the oldest change is
+ * @params->dirty_age_ms old, the changed blocks are copied to the flusher's
+ * queue and the call returns without waiting for them to be written. Only
+ * when the dirty and queued blocks together reach @params->hard_ratio percent
+ * does a call wait for the flusher to finish its current batch. If no call
+ * comes to queue changes that are @params->dirty_age_ms old, the flusher
+ * queues them itself between calls, so an idle file system does not keep
+ * dirty blocks. With @params->dirty_age_ms at 0, changes wait for the next
+ * modifying call or for fs_umount().
+ *
+ * Calling fs_writeback() again changes the thresholds. Stopping writes the
+ * changed blocks and waits for them. Writeback stops at fs_umount().
+ *
+ * Only the FAT and root directory are written back. The superblock and the
+ * tables of holes, shared blocks, snapshots and generations are not, so what
+ * the flusher wrote is only consistent with them after fs_sync() or
+ * fs_umount().
+ *
+ * Return: -1 if no FS is currently mounted, if @params->hard_ratio is lower
+ * than @params->dirty_ratio or above 100, if the file system has a journal,
+ * or if the flusher cannot be started (or, when stopping, if a write failed).
+ * 0 otherwise.
+ */
+int fs_writeback(const struct fs_writeback *params);
+
+/**
+ * fs_sync - Make the changes made so far durable
+ *
+ * Data blocks are written to the virtual disk as files are written, but the
+ * FAT, root directory, superblock and the tables of holes, shared blocks,
+ * snapshots and generations are only written at fs_umount(). Write them now
+ * and flush the virtual disk.
+ *
+ * On a file system made with a journal (fs_make.x -j), the tables are stored
+ * in free data blocks, then every FAT and root directory block changed since
+ * the previous fs_sync() is logged with the superblock as one transaction,
+ * with a single sequential write to the journal, so that all the changes made
+ * in between are committed together. The blocks are only
+ * written in place once the journal is full, or at fs_umount(), and only as
+ * of the last transaction, which is still replayed if that is cut short. The
+ * journal needs room for every FAT and root directory block, the superblock
+ * and a header. Blocks freed since the last fs_sync() that it left in use are
+ * only handed out again once the next one commits, so that a crash cannot
+ * bring a file back onto blocks rewritten in between. Committed
+ * transactions that did not reach their place are replayed by fs_mount()
+ * after a crash, and an incomplete transaction is ignored. Without a journal,
+ * the blocks are written in place, so a crash during fs_sync() may leave
+ * only some of them written.
+ *
+ * Return: -1 if no FS is currently mounted, or on I/O error. 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_submit - Apply a batch of operations
+ * @ops: Array of @count operations
+ * @count: Number of operations in @ops
+ * @sync: Whether to make the batch durable before returning
+ *
+ * Apply the operations of @ops in order, as fs_create(), fs_delete(),
+ * fs_write() at an offset and fs_truncate() would, without opening the files.
+ * The root directory is indexed once for the whole batch instead of being
+ * scanned by every operation, files written or truncated are packed once at
+ * the end, and, with @sync set, the metadata is written once with fs_sync().
+ * A failed operation sets its result to -1 and does not stop the batch.
+ *
+ * Return: -1 if no FS is currently mounted, if @ops is NULL, or if @sync is set
+ * and fs_sync() fails. Otherwise return the number of operations that succeeded.
+ */
+int fs_submit(struct fs_op *ops, int count, int sync);
+
 #endif /* _FS_H */
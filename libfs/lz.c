@@ -0,0 +1,165 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* Size of the match finder's hash table, as a power of two */
+#define LZ_HASH_BITS 12
+
+/* Longest distance a 16-bit offset can reach back */
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t lz_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Write the extra bytes of a length that did not fit in its nibble */
+static int lz_put_length(uint8_t *dst, int op, int cap, int len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op >= cap)
+			return -1;
+		dst[op++] = 255;
+	}
+	if (op >= cap)
+		return -1;
+	dst[op++] = len;
+	return op;
+}
+
+/* Emit one sequence; offset 0 marks the last one, which has no match */
+static int lz_put_sequence(uint8_t *dst, int op, int cap, const uint8_t *lit,
+			   int lit_len, int offset, int match_len)
+{
+	int ml = offset ? match_len - LZ_MIN_MATCH : 0;
+	uint8_t *token;
+
+	if (op >= cap)
+		return -1;
+	token = &dst[op++];
+	*token = (lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15);
+	if (lit_len >= 15 && (op = lz_put_length(dst, op, cap, lit_len - 15)) < 0)
+		return -1;
+
+	if (lit_len > cap - op)
+		return -1;
+	memcpy(dst + op, lit, lit_len);
+	op += lit_len;
+	if (!offset)
+		return op;
+
+	if (cap - op < 2)
+		return -1;
+	dst[op++] = offset & 0xff;
+	dst[op++] = offset >> 8;
+	if (ml >= 15 && (op = lz_put_length(dst, op, cap, ml - 15)) < 0)
+		return -1;
+	return op;
+}
+
+int lz_compress(const void *src, int len, void *dst, int cap)
+{
+	const uint8_t *in = src;
+	uint8_t *out = dst;
+	int table[1 << LZ_HASH_BITS];
+	int ip = 0, anchor = 0, op = 0;
+
+	memset(table, 0xff, sizeof(table));
+
+	while (ip + LZ_MIN_MATCH <= len) {
+		uint32_t h = lz_hash(lz_read32(in + ip));
+		int ref = table[h];
+		int match_len;
+
+		table[h] = ip;
+		if (ref < 0 || ip - ref > LZ_MAX_OFFSET ||
+		    lz_read32(in + ref) != lz_read32(in + ip)) {
+			ip++;
+			continue;
+		}
+
+		match_len = LZ_MIN_MATCH;
+		while (ip + match_len < len && in[ref + match_len] == in[ip + match_len])
+			match_len++;
+
+		op = lz_put_sequence(out, op, cap, in + anchor, ip - anchor,
+				     ip - ref, match_len);
+		if (op < 0)
+			return -1;
+		/* Index the positions the match covers, later data often repeats them */
+		for (int i = ip + 1; i < ip + match_len && i + LZ_MIN_MATCH <= len; i++)
+			table[lz_hash(lz_read32(in + i))] = i;
+		ip += match_len;
+		anchor = ip;
+	}
+
+	return lz_put_sequence(out, op, cap, in + anchor, len - anchor, 0, 0);
+}
+
+/* Read the extra bytes of a length whose nibble was 15 */
+static int lz_get_length(const uint8_t *src, int *ip, int len, int *value)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= len)
+			return -1;
+		b = src[(*ip)++];
+		*value += b;
+	} while (b == 255);
+	return 0;
+}
+
+int lz_decompress(const void *src, int len, void *dst, int cap)
+{
+	const uint8_t *in = src;
+	uint8_t *out = dst;
+	int ip = 0, op = 0;
+
+	while (ip < len) {
+		int token = in[ip++];
+		int lit_len = token >> 4;
+		int match_len = token & 15;
+		int offset;
+
+		if (lit_len == 15 && lz_get_length(in, &ip, len, &lit_len))
+			return -1;
+		if (lit_len > len - ip || lit_len > cap - op)
+			return -1;
+		memcpy(out + op, in + ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		/* The last sequence ends with the input */
+		if (ip == len)
+			return op;
+
+		if (len - ip < 2)
+			return -1;
+		offset = in[ip] | in[ip + 1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > op)
+			return -1;
+		if (match_len == 15 && lz_get_length(in, &ip, len, &match_len))
+			return -1;
+		match_len += LZ_MIN_MATCH;
+		if (match_len > cap - op)
+			return -1;
+
+		/* Byte by byte, the match may overlap what it is copying */
+		for (int i = 0; i < match_len; i++, op++)
+			out[op] = out[op - offset];
+	}
+
+	/* An empty input is not a valid stream, there is always a last sequence */
+	return -1;
+}
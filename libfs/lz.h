@@ -0,0 +1,39 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+/*
+ * Byte-oriented LZ77 codec. A compressed stream is a list of sequences, each
+ * made of a token byte (literal count in the high nibble, match length minus
+ * LZ_MIN_MATCH in the low nibble, 15 meaning more length bytes follow), the
+ * literals, then a 16-bit little-endian match offset. The last sequence has
+ * literals only.
+ */
+
+/** Shortest match the encoder emits */
+#define LZ_MIN_MATCH 4
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @len: Number of bytes in @src
+ * @dst: Buffer to hold the compressed stream
+ * @cap: Number of bytes available in @dst
+ *
+ * Return: -1 if the compressed stream does not fit in @cap bytes. Otherwise
+ * return the length of the compressed stream.
+ */
+int lz_compress(const void *src, int len, void *dst, int cap);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @src: Compressed stream
+ * @len: Number of bytes in @src
+ * @dst: Buffer to hold the decompressed data
+ * @cap: Number of bytes available in @dst
+ *
+ * Return: -1 if the stream is corrupt or decompresses to more than @cap bytes.
+ * Otherwise return the number of decompressed bytes.
+ */
+int lz_decompress(const void *src, int len, void *dst, int cap);
+
+#endif /* _LZ_H */
@@ -0,0 +1,416 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "disk.h"
+
+#define raid0_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Most images a striped disk can span */
+#define RAID0_MEMBERS_MAX 16
+
+/* Most segments a single preadv/pwritev accepts (UIO_MAXIOV on Linux) */
+#define RAID0_IOV_MAX 1024
+
+/* Requests split in fewer segments than this do not allocate */
+#define RAID0_SEGS_INLINE 64
+
+/* Part of a request that falls on one member, contiguous in that member */
+struct raid0_part {
+	size_t offset;
+	size_t len;
+	struct iovec *iov;
+	int iovcnt;
+	int write;
+	int result;
+};
+
+struct raid0;
+
+/* One image of the striped disk and the thread issuing its requests */
+struct raid0_member {
+	int fd;
+	pthread_t thread;
+	struct raid0 *raid;
+	/* Part handed to the thread, NULL when it is idle */
+	struct raid0_part *part;
+};
+
+struct raid0 {
+	/* Stripe unit in bytes, consecutive units go to consecutive members */
+	size_t stripe;
+	size_t size;
+	int count;
+	/* Held by the request that is using the member threads */
+	pthread_mutex_t busy;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	/* Parts handed to the threads and not finished yet */
+	int pending;
+	int stop;
+	struct raid0_member members[];
+};
+
+/* Issue a part on member image @fd, in chunks the system call accepts */
+static int raid0_part_io(int fd, struct raid0_part *part)
+{
+	size_t offset = part->offset;
+
+	for (int i = 0; i < part->iovcnt; ) {
+		int n = part->iovcnt - i < RAID0_IOV_MAX ?
+			part->iovcnt - i : RAID0_IOV_MAX;
+		size_t len = 0;
+		ssize_t ret;
+
+		for (int j = i; j < i + n; j++)
+			len += part->iov[j].iov_len;
+
+		if (part->write)
+			ret = pwritev(fd, part->iov + i, n, offset);
+		else
+			ret = preadv(fd, part->iov + i, n, offset);
+		if (ret != (ssize_t)len) {
+			perror(part->write ? "pwritev" : "preadv");
+			return -1;
+		}
+
+		offset += len;
+		i += n;
+	}
+
+	return 0;
+}
+
+static void *raid0_worker(void *arg)
+{
+	struct raid0_member *member = arg;
+	struct raid0 *raid = member->raid;
+
+	pthread_mutex_lock(&raid->lock);
+	for (;;) {
+		struct raid0_part *part;
+
+		while (!member->part && !raid->stop)
+			pthread_cond_wait(&raid->start, &raid->lock);
+		if (!(part = member->part))
+			break;
+
+		pthread_mutex_unlock(&raid->lock);
+		part->result = raid0_part_io(member->fd, part);
+		pthread_mutex_lock(&raid->lock);
+
+		member->part = NULL;
+		if (!--raid->pending)
+			pthread_cond_signal(&raid->done);
+	}
+	pthread_mutex_unlock(&raid->lock);
+
+	return NULL;
+}
+
+/*
+ * Walk the byte range [@offset, @offset + @len) of the striped disk and add
+ * each stripe unit piece to the part of its member. The pieces of a member
+ * are contiguous in its image, so a part is a single vectored request. With
+ * @fill unset, only count the segments each part needs.
+ */
+static void raid0_split(struct raid0 *raid, size_t offset,
+			const struct iovec *iov, size_t len,
+			struct raid0_part *parts, int fill)
+{
+	size_t in = 0;
+	int i = 0;
+
+	while (len) {
+		size_t unit = offset / raid->stripe;
+		size_t within = offset % raid->stripe;
+		size_t piece = raid->stripe - within < len ?
+			raid->stripe - within : len;
+		struct raid0_part *part = &parts[unit % raid->count];
+
+		if (!part->len)
+			part->offset = unit / raid->count * raid->stripe + within;
+		part->len += piece;
+		offset += piece;
+		len -= piece;
+
+		while (piece) {
+			size_t n = iov[i].iov_len - in < piece ?
+				iov[i].iov_len - in : piece;
+
+			if (n) {
+				if (fill) {
+					part->iov[part->iovcnt].iov_base =
+						(char *)iov[i].iov_base + in;
+					part->iov[part->iovcnt].iov_len = n;
+				}
+				part->iovcnt++;
+			}
+			in += n;
+			piece -= n;
+			if (in == iov[i].iov_len) {
+				i++;
+				in = 0;
+			}
+		}
+	}
+}
+
+static int raid0_io(void *dev, size_t offset, const struct iovec *iov,
+		    int iovcnt, size_t len, int write)
+{
+	struct raid0 *raid = dev;
+	struct raid0_part parts[RAID0_MEMBERS_MAX];
+	struct iovec segs_inline[RAID0_SEGS_INLINE], *segs = segs_inline;
+	int nsegs = 0, used = 0, first = -1, ret = 0;
+
+	(void)iovcnt;
+	memset(parts, 0, sizeof(parts));
+	raid0_split(raid, offset, iov, len, parts, 0);
+
+	for (int m = 0; m < raid->count; m++)
+		nsegs += parts[m].iovcnt;
+	if (nsegs > RAID0_SEGS_INLINE && !(segs = malloc(sizeof(*segs) * nsegs))) {
+		perror("malloc");
+		return -1;
+	}
+
+	nsegs = 0;
+	for (int m = 0; m < raid->count; m++) {
+		parts[m].iov = segs + nsegs;
+		nsegs += parts[m].iovcnt;
+		parts[m].iovcnt = 0;
+		parts[m].len = 0;
+		parts[m].write = write;
+	}
+	raid0_split(raid, offset, iov, len, parts, 1);
+
+	for (int m = 0; m < raid->count; m++) {
+		if (parts[m].len) {
+			used++;
+			if (first < 0)
+				first = m;
+		}
+	}
+
+	/*
+	 * A request spanning several members hands all of its parts but the
+	 * first to the member threads and issues the first one itself. When
+	 * another request already uses the threads, this one is issued part by
+	 * part from the calling thread instead of waiting for them.
+	 */
+	if (used > 1 && !pthread_mutex_trylock(&raid->busy)) {
+		pthread_mutex_lock(&raid->lock);
+		for (int m = first + 1; m < raid->count; m++) {
+			if (parts[m].len) {
+				raid->members[m].part = &parts[m];
+				raid->pending++;
+			}
+		}
+		pthread_cond_broadcast(&raid->start);
+		pthread_mutex_unlock(&raid->lock);
+
+		ret = raid0_part_io(raid->members[first].fd, &parts[first]);
+
+		pthread_mutex_lock(&raid->lock);
+		while (raid->pending)
+			pthread_cond_wait(&raid->done, &raid->lock);
+		pthread_mutex_unlock(&raid->lock);
+		pthread_mutex_unlock(&raid->busy);
+
+		for (int m = first + 1; m < raid->count; m++)
+			if (parts[m].len && parts[m].result)
+				ret = -1;
+	} else {
+		for (int m = first; m >= 0 && m < raid->count; m++)
+			if (parts[m].len && raid0_part_io(raid->members[m].fd, &parts[m]))
+				ret = -1;
+	}
+
+	if (segs != segs_inline)
+		free(segs);
+
+	return ret;
+}
+
+static int raid0_read(void *dev, size_t offset, void *buf, size_t len)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+	return raid0_io(dev, offset, &iov, 1, len, 0);
+}
+
+static int raid0_write(void *dev, size_t offset, const void *buf, size_t len)
+{
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+	return raid0_io(dev, offset, &iov, 1, len, 1);
+}
+
+static int raid0_readv(void *dev, size_t offset, const struct iovec *iov,
+		       int iovcnt, size_t len)
+{
+	return raid0_io(dev, offset, iov, iovcnt, len, 0);
+}
+
+static int raid0_writev(void *dev, size_t offset, const struct iovec *iov,
+			int iovcnt, size_t len)
+{
+	return raid0_io(dev, offset, iov, iovcnt, len, 1);
+}
+
+static int raid0_flush(void *dev)
+{
+	struct raid0 *raid = dev;
+	int ret = 0;
+
+	for (int m = 0; m < raid->count; m++) {
+		if (fsync(raid->members[m].fd)) {
+			perror("fsync");
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+static size_t raid0_size(void *dev)
+{
+	return ((struct raid0 *)dev)->size;
+}
+
+/* Stop the member threads that were started and close the member images */
+static void raid0_release(struct raid0 *raid, int started)
+{
+	pthread_mutex_lock(&raid->lock);
+	raid->stop = 1;
+	pthread_cond_broadcast(&raid->start);
+	pthread_mutex_unlock(&raid->lock);
+
+	for (int m = 0; m < started; m++)
+		pthread_join(raid->members[m].thread, NULL);
+
+	for (int m = 0; m < raid->count; m++)
+		if (raid->members[m].fd >= 0)
+			close(raid->members[m].fd);
+
+	pthread_cond_destroy(&raid->done);
+	pthread_cond_destroy(&raid->start);
+	pthread_mutex_destroy(&raid->lock);
+	pthread_mutex_destroy(&raid->busy);
+	free(raid);
+}
+
+static int raid0_close(void *dev)
+{
+	struct raid0 *raid = dev;
+
+	raid0_release(raid, raid->count);
+
+	return 0;
+}
+
+/* @path is "<stripe unit>:<image>,<image>,..." */
+static void *raid0_open(const char *path)
+{
+	char *names, *name, *save, *end;
+	struct raid0 *raid;
+	size_t stripe, min = 0;
+	int count = 1, started = 0;
+
+	stripe = strtoul(path, &end, 0);
+	if (*end == 'k' || *end == 'K') {
+		stripe *= 1024;
+		end++;
+	}
+	if (*end != ':' || !stripe || stripe % BLOCK_SIZE_MIN) {
+		raid0_error("invalid stripe unit in '%s', expected "
+			    "<stripe unit>:<image>,<image>,...", path);
+		return NULL;
+	}
+
+	for (const char *c = end + 1; *c; c++)
+		count += *c == ',';
+	if (count > RAID0_MEMBERS_MAX) {
+		raid0_error("too many images (%d/%d)", count, RAID0_MEMBERS_MAX);
+		return NULL;
+	}
+
+	raid = calloc(1, sizeof(*raid) + count * sizeof(raid->members[0]));
+	names = strdup(end + 1);
+	if (!raid || !names) {
+		perror("calloc");
+		free(raid);
+		free(names);
+		return NULL;
+	}
+	raid->stripe = stripe;
+	raid->count = count;
+	pthread_mutex_init(&raid->busy, NULL);
+	pthread_mutex_init(&raid->lock, NULL);
+	pthread_cond_init(&raid->start, NULL);
+	pthread_cond_init(&raid->done, NULL);
+	for (int m = 0; m < count; m++) {
+		raid->members[m].fd = -1;
+		raid->members[m].raid = raid;
+	}
+
+	name = strtok_r(names, ",", &save);
+	for (int m = 0; m < count; m++, name = strtok_r(NULL, ",", &save)) {
+		struct stat st;
+
+		if (!name) {
+			raid0_error("empty image name in '%s'", path);
+			goto fail;
+		}
+		if ((raid->members[m].fd = open(name, O_RDWR, 0644)) < 0) {
+			perror("open");
+			goto fail;
+		}
+		if (fstat(raid->members[m].fd, &st)) {
+			perror("fstat");
+			goto fail;
+		}
+		if (!m || (size_t)st.st_size < min)
+			min = st.st_size;
+	}
+
+	/* Only whole stripes are used, on every member the smallest has */
+	raid->size = min / stripe * stripe * count;
+
+	for (; started < count; started++) {
+		if (pthread_create(&raid->members[started].thread, NULL,
+				   raid0_worker, &raid->members[started])) {
+			raid0_error("cannot start member thread");
+			goto fail;
+		}
+	}
+
+	free(names);
+	return raid;
+
+fail:
+	free(names);
+	raid0_release(raid, started);
+	return NULL;
+}
+
+const struct block_driver block_driver_raid0 = {
+	.name = "raid0",
+	.open = raid0_open,
+	.close = raid0_close,
+	.size = raid0_size,
+	.read = raid0_read,
+	.write = raid0_write,
+	.readv = raid0_readv,
+	.writev = raid0_writev,
+	.flush = raid0_flush,
+};
@@ -0,0 +1,234 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "disk.h"
+
+#define sim_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Device model, all times in microseconds */
+struct sim_model {
+	/* Fixed cost of every request */
+	unsigned long latency;
+	/* Extra cost drawn uniformly from [0, jitter] for every request */
+	unsigned long jitter;
+	/* Transfer rate in MB/s, 0 for no limit */
+	unsigned long bandwidth;
+	/* Cost of a seek across the whole device, scaled by the distance */
+	unsigned long seek;
+	/* Requests serviced at the same time, the others wait for a slot */
+	unsigned long depth;
+	unsigned long seed;
+};
+
+struct sim {
+	struct sim_model model;
+	/* Wrapped device */
+	const struct block_driver *driver;
+	void *dev;
+	size_t size;
+	pthread_mutex_t lock;
+	pthread_cond_t slot;
+	/* Requests being serviced */
+	unsigned long active;
+	/* Where the last request ended, seeks are measured from there */
+	size_t head;
+	uint64_t rng;
+};
+
+/* xorshift64*, so runs with the same seed draw the same delays */
+static uint64_t sim_random(struct sim *sim)
+{
+	sim->rng ^= sim->rng >> 12;
+	sim->rng ^= sim->rng << 25;
+	sim->rng ^= sim->rng >> 27;
+
+	return sim->rng * 2685821657736338717ull;
+}
+
+/*
+ * Wait for a queue slot, then for the time the modelled device would take to
+ * service @len bytes at @offset. Seek distance and jitter are drawn under the
+ * lock, in the order requests get their slot.
+ */
+static void sim_enter(struct sim *sim, size_t offset, size_t len)
+{
+	struct sim_model *m = &sim->model;
+	uint64_t delay = m->latency;
+	size_t distance;
+	struct timespec ts;
+
+	pthread_mutex_lock(&sim->lock);
+	while (sim->active >= m->depth)
+		pthread_cond_wait(&sim->slot, &sim->lock);
+	sim->active++;
+
+	distance = offset > sim->head ? offset - sim->head : sim->head - offset;
+	if (sim->size)
+		delay += (uint64_t)m->seek * distance / sim->size;
+	if (m->jitter)
+		delay += sim_random(sim) % (m->jitter + 1);
+	sim->head = offset + len;
+	pthread_mutex_unlock(&sim->lock);
+
+	/* 1 MB/s moves one byte per microsecond */
+	if (m->bandwidth)
+		delay += len / m->bandwidth;
+
+	ts.tv_sec = delay / 1000000;
+	ts.tv_nsec = delay % 1000000 * 1000;
+	while (delay && nanosleep(&ts, &ts))
+		;
+}
+
+static void sim_leave(struct sim *sim)
+{
+	pthread_mutex_lock(&sim->lock);
+	sim->active--;
+	pthread_cond_signal(&sim->slot);
+	pthread_mutex_unlock(&sim->lock);
+}
+
+static int sim_read(void *dev, size_t offset, void *buf, size_t len)
+{
+	struct sim *sim = dev;
+	int ret;
+
+	sim_enter(sim, offset, len);
+	ret = sim->driver->read(sim->dev, offset, buf, len);
+	sim_leave(sim);
+
+	return ret;
+}
+
+static int sim_write(void *dev, size_t offset, const void *buf, size_t len)
+{
+	struct sim *sim = dev;
+	int ret;
+
+	sim_enter(sim, offset, len);
+	ret = sim->driver->write(sim->dev, offset, buf, len);
+	sim_leave(sim);
+
+	return ret;
+}
+
+static int sim_readv(void *dev, size_t offset, const struct iovec *iov,
+		     int iovcnt, size_t len)
+{
+	struct sim *sim = dev;
+	int ret;
+
+	sim_enter(sim, offset, len);
+	ret = sim->driver->readv(sim->dev, offset, iov, iovcnt, len);
+	sim_leave(sim);
+
+	return ret;
+}
+
+static int sim_writev(void *dev, size_t offset, const struct iovec *iov,
+		      int iovcnt, size_t len)
+{
+	struct sim *sim = dev;
+	int ret;
+
+	sim_enter(sim, offset, len);
+	ret = sim->driver->writev(sim->dev, offset, iov, iovcnt, len);
+	sim_leave(sim);
+
+	return ret;
+}
+
+/* A flush costs one request without data or seek */
+static int sim_flush(void *dev)
+{
+	struct sim *sim = dev;
+	int ret;
+
+	sim_enter(sim, sim->head, 0);
+	ret = sim->driver->flush(sim->dev);
+	sim_leave(sim);
+
+	return ret;
+}
+
+static size_t sim_size(void *dev)
+{
+	return ((struct sim *)dev)->size;
+}
+
+static int sim_close(void *dev)
+{
+	struct sim *sim = dev;
+	int ret = sim->driver->close(sim->dev);
+
+	pthread_cond_destroy(&sim->slot);
+	pthread_mutex_destroy(&sim->lock);
+	free(sim);
+
+	return ret;
+}
+
+/* Keys of the path, see block_driver_parse() */
+static const struct block_driver_param sim_params[] = {
+	{ "lat", offsetof(struct sim_model, latency) },
+	{ "jitter", offsetof(struct sim_model, jitter) },
+	{ "bw", offsetof(struct sim_model, bandwidth) },
+	{ "seek", offsetof(struct sim_model, seek) },
+	{ "qd", offsetof(struct sim_model, depth) },
+	{ "seed", offsetof(struct sim_model, seed) },
+};
+
+/* @path is "<key>=<value>,...:<diskname>", see block_driver_sim */
+static void *sim_open(const char *path)
+{
+	struct sim_model model = { .depth = 1, .seed = 1 };
+	const char *name;
+	struct sim *sim;
+
+	name = block_driver_parse(path, sim_params,
+				  sizeof(sim_params) / sizeof(sim_params[0]),
+				  &model);
+	if (!name)
+		return NULL;
+	if (!model.depth) {
+		sim_error("queue depth must be at least 1");
+		return NULL;
+	}
+
+	if (!(sim = calloc(1, sizeof(*sim)))) {
+		perror("calloc");
+		return NULL;
+	}
+	sim->model = model;
+	/* xorshift would stay at 0 forever, any other seed is fine */
+	sim->rng = model.seed ? model.seed : 1;
+
+	if (!(sim->dev = block_driver_open_wrapped(name, &sim->driver))) {
+		free(sim);
+		return NULL;
+	}
+	sim->size = sim->driver->size(sim->dev);
+	pthread_mutex_init(&sim->lock, NULL);
+	pthread_cond_init(&sim->slot, NULL);
+
+	return sim;
+}
+
+const struct block_driver block_driver_sim = {
+	.name = "sim",
+	.open = sim_open,
+	.close = sim_close,
+	.size = sim_size,
+	.read = sim_read,
+	.write = sim_write,
+	.readv = sim_readv,
+	.writev = sim_writev,
+	.flush = sim_flush,
+};